@@ -0,0 +1,397 @@
+/*
+ * accesslog.c - Aggregated and sampled access logging
+ *
+ * In LOG_FULL mode every request gets its own log line, as it always
+ * has. At high request rates formatting and writing those lines is a
+ * bottleneck, so the other modes fold requests into per-interval
+ * aggregates instead, keyed by origin, status and cache outcome:
+ *
+ *   [time] aggregate origin=host:port status=200 cache=hit count=... bytes=...
+ *       p50_us=... p90_us=... p99_us=... max_us=...
+ *
+ * Errors (status 400 and up, or answered by the proxy itself) and
+ * requests slower than slow_ms still get their full line, and in
+ * LOG_SAMPLED mode so does one request in every sample_every. Those
+ * lines are marked aggregated=1, so that log readers do not count their
+ * requests twice.
+ *
+ * Aggregates live in AGG_SHARDS hash tables, each with its own lock, so
+ * recording a request costs a hash, a short lock and a few increments.
+ * A background thread swaps each table out every interval seconds and
+ * writes its lines. Latencies go into a log-linear histogram (four
+ * buckets per power of two) for quantiles within 25%.
+ *
+ * Each request also carries the CPU its thread spent on it: thread CPU
+ * time, user and system time and context switches, read before and
+ * after proxy() with CLOCK_THREAD_CPUTIME_ID and getrusage. Full lines
+ * and aggregates include it, and /proxy-stats totals it per cache
+ * outcome and per origin, so the requests that are expensive to serve
+ * (rather than merely slow) can be found. Outcome totals are relaxed
+ * atomic counters; origin totals live in sharded tables like the
+ * aggregates, but are kept for the life of the proxy.
+ */
+#include "csapp.h"
+#include "accesslog.h"
+#include "lockprof.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+/* RUSAGE_THREAD is a GNU extension, and csapp.h cannot be built with
+ * _GNU_SOURCE, so define it here. */
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD 1
+#endif
+
+#define AGG_SHARDS 16
+#define AGG_SLOTS 64            /* Keys per shard and interval */
+#define AGG_BUCKETS 128
+#define AGG_ORIGIN 128
+#define CPU_SLOTS 16            /* Origins with CPU totals, per shard */
+#define OUTCOMES 6
+
+typedef struct {
+    char origin[AGG_ORIGIN];    /* Empty if the slot is free */
+    int status;
+    int outcome;
+    unsigned long count;
+    unsigned long long bytes;
+    unsigned long max_us;
+    access_cpu_t cpu;
+    unsigned hist[AGG_BUCKETS];
+} aggregate_t;
+
+/* CPU totals for an origin */
+typedef struct {
+    char name[AGG_ORIGIN];      /* Empty if the slot is free */
+    unsigned long requests;
+    access_cpu_t cpu;
+} cpu_total_t;
+
+/* CPU totals for a cache outcome */
+typedef struct {
+    atomic_ulong requests, cpu_us, user_us, sys_us, vcsw, ivcsw;
+} cpu_counter_t;
+
+typedef struct {
+    lockprof_t lock;
+    aggregate_t slots[AGG_SLOTS];
+} agg_shard_t;
+
+typedef struct {
+    lockprof_t lock;
+    cpu_total_t slots[CPU_SLOTS];
+} cpu_shard_t;
+
+static const char *outcome_names[] = { "hit", "miss", "pass", "peer", "tunnel", "error" };
+
+static accesslog_write_t write_line;
+static int log_mode, every, flush_interval;
+static unsigned long slow_us;
+static agg_shard_t shards[AGG_SHARDS];
+static lockstat_t agg_stat = LOCKSTAT_INITIALIZER("accesslog");
+static atomic_ulong requests, lines, aggregated, suppressed, agg_lines, agg_dropped, cpu_dropped;
+static cpu_counter_t cpu_outcomes[OUTCOMES];
+static cpu_shard_t cpu_shards[AGG_SHARDS];
+static lockstat_t cpu_stat = LOCKSTAT_INITIALIZER("accesslog_cpu");
+
+static void add_cpu(access_cpu_t *sum, const access_cpu_t *cpu) {
+    sum->cpu_us += cpu->cpu_us;
+    sum->user_us += cpu->user_us;
+    sum->sys_us += cpu->sys_us;
+    sum->vcsw += cpu->vcsw;
+    sum->ivcsw += cpu->ivcsw;
+}
+
+/*
+ * bucket - Log-linear histogram bucket for v: values below 4 have their
+ * own bucket, and each power of two above is split in four.
+ */
+static int bucket(unsigned long v) {
+    int msb, b;
+
+    if (v < 4)
+        return v;
+    msb = 63 - __builtin_clzl(v);
+    b = (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+    return b < AGG_BUCKETS ? b : AGG_BUCKETS - 1;
+}
+
+/*
+ * bucket_value - The smallest value that falls in bucket b.
+ */
+static unsigned long bucket_value(int b) {
+    if (b < 4)
+        return b;
+    return (unsigned long)(4 + b % 4) << (b / 4 - 1);
+}
+
+/*
+ * quantile - Approximate q-th quantile of agg's latencies.
+ */
+static unsigned long quantile(const aggregate_t *agg, double q) {
+    unsigned long seen = 0;
+
+    for (int b = 0; b < AGG_BUCKETS; b++) {
+        seen += agg->hist[b];
+        if (seen >= agg->count * q)
+            return bucket_value(b);
+    }
+    return agg->max_us;
+}
+
+static unsigned hash_key(const char *origin, int status, int outcome) {
+    unsigned h = 2166136261u;
+
+    while (*origin)
+        h = (h ^ (unsigned char)*origin++) * 16777619u;
+    return (h ^ status * 31 ^ outcome) * 16777619u;
+}
+
+/*
+ * aggregate - Fold a into its aggregate for the current interval.
+ */
+static void aggregate(const access_t *a) {
+    unsigned h = hash_key(a->origin, a->status, a->outcome);
+    agg_shard_t *sh = &shards[h % AGG_SHARDS];
+    aggregate_t *agg = NULL, *slot;
+
+    lockprof_lock(&sh->lock);
+    for (int i = 0; i < AGG_SLOTS; i++) {
+        slot = &sh->slots[(h / AGG_SHARDS + i) % AGG_SLOTS];
+        if (!slot->origin[0]) {
+            snprintf(slot->origin, sizeof(slot->origin), "%s", a->origin[0] ? a->origin : "-");
+            slot->status = a->status;
+            slot->outcome = a->outcome;
+            agg = slot;
+            break;
+        }
+        if (slot->status == a->status && slot->outcome == a->outcome &&
+            strncmp(slot->origin, a->origin[0] ? a->origin : "-", AGG_ORIGIN - 1) == 0) {
+            agg = slot;
+            break;
+        }
+    }
+    if (agg) {
+        agg->count++;
+        agg->bytes += a->bytes;
+        add_cpu(&agg->cpu, &a->cpu);
+        agg->hist[bucket(a->latency_us)]++;
+        if (a->latency_us > agg->max_us)
+            agg->max_us = a->latency_us;
+    }
+    lockprof_unlock(&sh->lock);
+    atomic_fetch_add(agg ? &aggregated : &agg_dropped, 1);
+}
+
+/*
+ * flush - Write and reset every shard's aggregates.
+ */
+static void flush(void) {
+    static aggregate_t batch[AGG_SLOTS];
+    char line[MAXLINE], time_str[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    int n;
+
+    strftime(time_str, sizeof(time_str), "%a %d %b %Y %H:%M:%S %Z", localtime_r(&now, &tm));
+    for (int i = 0; i < AGG_SHARDS; i++) {
+        lockprof_lock(&shards[i].lock);
+        memcpy(batch, shards[i].slots, sizeof(batch));
+        memset(shards[i].slots, 0, sizeof(shards[i].slots));
+        lockprof_unlock(&shards[i].lock);
+
+        for (int j = 0; j < AGG_SLOTS; j++) {
+            aggregate_t *agg = &batch[j];
+
+            if (!agg->origin[0])
+                continue;
+            n = snprintf(line, sizeof(line), "[%s] aggregate origin=%s status=%d cache=%s count=%lu bytes=%llu "
+                         "p50_us=%lu p90_us=%lu p99_us=%lu max_us=%lu",
+                         time_str, agg->origin, agg->status, outcome_names[agg->outcome], agg->count, agg->bytes,
+                         quantile(agg, 0.5), quantile(agg, 0.9), quantile(agg, 0.99), agg->max_us);
+            accesslog_cpu_format(line + n, sizeof(line) - n, &agg->cpu);
+            write_line(line);
+            atomic_fetch_add(&agg_lines, 1);
+        }
+    }
+}
+
+/*
+ * accesslog_thread - Flush the aggregates every interval.
+ */
+static void *accesslog_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    for (;;) {
+        sleep(flush_interval);
+        flush();
+    }
+    return NULL;
+}
+
+/*
+ * accesslog_init - Log in mode (LOG_FULL, LOG_SAMPLED or LOG_AGGREGATE)
+ * through write. Aggregates are written every interval seconds; in
+ * LOG_SAMPLED mode one request in sample_every is also logged in full,
+ * as are errors and requests slower than slow_ms in both.
+ */
+void accesslog_init(accesslog_write_t write, int mode, int sample_every, long slow_ms, int interval) {
+    pthread_t tid;
+
+    write_line = write;
+    log_mode = mode;
+    every = sample_every > 0 ? sample_every : 1;
+    slow_us = slow_ms > 0 ? slow_ms * 1000 : 0;
+    flush_interval = interval > 0 ? interval : 10;
+    for (int i = 0; i < AGG_SHARDS; i++)
+        lockprof_init(&cpu_shards[i].lock, &cpu_stat);
+    if (log_mode == LOG_FULL)
+        return;
+    for (int i = 0; i < AGG_SHARDS; i++)
+        lockprof_init(&shards[i].lock, &agg_stat);
+    Pthread_create(&tid, NULL, accesslog_thread, NULL);
+}
+
+/*
+ * record_cpu - Add a's CPU to the totals for its outcome and origin.
+ */
+static void record_cpu(const access_t *a) {
+    const char *origin = a->origin[0] ? a->origin : "-";
+    cpu_counter_t *c = &cpu_outcomes[a->outcome];
+    unsigned h = hash_key(origin, 0, 0);
+    cpu_shard_t *sh = &cpu_shards[h % AGG_SHARDS];
+    cpu_total_t *t = NULL, *slot;
+
+    atomic_fetch_add_explicit(&c->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->cpu_us, a->cpu.cpu_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->user_us, a->cpu.user_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->sys_us, a->cpu.sys_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->vcsw, a->cpu.vcsw, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->ivcsw, a->cpu.ivcsw, memory_order_relaxed);
+
+    lockprof_lock(&sh->lock);
+    for (int i = 0; i < CPU_SLOTS; i++) {
+        slot = &sh->slots[(h / AGG_SHARDS + i) % CPU_SLOTS];
+        if (!slot->name[0])
+            snprintf(slot->name, sizeof(slot->name), "%s", origin);
+        if (strncmp(slot->name, origin, AGG_ORIGIN - 1) == 0) {
+            t = slot;
+            break;
+        }
+    }
+    if (t) {
+        t->requests++;
+        add_cpu(&t->cpu, &a->cpu);
+    }
+    lockprof_unlock(&sh->lock);
+    if (!t)
+        atomic_fetch_add(&cpu_dropped, 1);
+}
+
+/*
+ * accesslog_record - Account for the finished request a. Returns
+ * ACCESS_FULL or ACCESS_AGGREGATED if it should also be logged in full,
+ * else ACCESS_NONE.
+ */
+int accesslog_record(const access_t *a) {
+    unsigned long n = atomic_fetch_add_explicit(&requests, 1, memory_order_relaxed);
+    int full;
+
+    record_cpu(a);
+
+    if (log_mode == LOG_FULL) {
+        full = ACCESS_FULL;
+    } else {
+        aggregate(a);
+        full = a->status >= 400 || a->outcome == OUTCOME_ERROR || (slow_us && a->latency_us >= slow_us) ||
+               (log_mode == LOG_SAMPLED && n % every == 0) ? ACCESS_AGGREGATED : ACCESS_NONE;
+    }
+    atomic_fetch_add_explicit(full ? &lines : &suppressed, 1, memory_order_relaxed);
+    return full;
+}
+
+/*
+ * accesslog_cpu - Read the calling thread's CPU use so far into cpu.
+ */
+void accesslog_cpu(access_cpu_t *cpu) {
+    struct timespec ts;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    getrusage(RUSAGE_THREAD, &ru);
+    cpu->cpu_us = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    cpu->user_us = ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    cpu->sys_us = ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+    cpu->vcsw = ru.ru_nvcsw;
+    cpu->ivcsw = ru.ru_nivcsw;
+}
+
+/*
+ * accesslog_cpu_since - Set cpu to what the calling thread has used
+ * since the reading start.
+ */
+void accesslog_cpu_since(access_cpu_t *cpu, const access_cpu_t *start) {
+    accesslog_cpu(cpu);
+    cpu->cpu_us -= start->cpu_us;
+    cpu->user_us -= start->user_us;
+    cpu->sys_us -= start->sys_us;
+    cpu->vcsw -= start->vcsw;
+    cpu->ivcsw -= start->ivcsw;
+}
+
+/*
+ * accesslog_cpu_format - Write cpu as " cpu_us=... ivcsw=..." log
+ * fields into buf. Returns the length written.
+ */
+size_t accesslog_cpu_format(char *buf, size_t len, const access_cpu_t *cpu) {
+    int n = snprintf(buf, len, " cpu_us=%lu user_us=%lu sys_us=%lu vcsw=%lu ivcsw=%lu",
+                     cpu->cpu_us, cpu->user_us, cpu->sys_us, cpu->vcsw, cpu->ivcsw);
+    return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/*
+ * print_cpu - Print the totals t as "cpu_field_name value" lines.
+ */
+static void print_cpu(FILE *out, const char *name, const cpu_total_t *t) {
+    fprintf(out, "cpu_requests_%s %lu\n", name, t->requests);
+    fprintf(out, "cpu_us_%s %lu\n", name, t->cpu.cpu_us);
+    fprintf(out, "cpu_user_us_%s %lu\n", name, t->cpu.user_us);
+    fprintf(out, "cpu_sys_us_%s %lu\n", name, t->cpu.sys_us);
+    fprintf(out, "cpu_vcsw_%s %lu\n", name, t->cpu.vcsw);
+    fprintf(out, "cpu_ivcsw_%s %lu\n", name, t->cpu.ivcsw);
+}
+
+/*
+ * accesslog_stats - Print logging counters, and request CPU totals per
+ * cache outcome and per origin, as "name value" lines.
+ */
+void accesslog_stats(FILE *out) {
+    cpu_total_t t, batch[CPU_SLOTS];
+
+    fprintf(out, "log_mode %d\n", log_mode);
+    fprintf(out, "log_requests %lu\n", atomic_load(&requests));
+    fprintf(out, "log_lines %lu\n", atomic_load(&lines));
+    fprintf(out, "log_lines_suppressed %lu\n", atomic_load(&suppressed));
+    fprintf(out, "log_aggregated %lu\n", atomic_load(&aggregated));
+    fprintf(out, "log_aggregate_lines %lu\n", atomic_load(&agg_lines));
+    fprintf(out, "log_aggregate_dropped %lu\n", atomic_load(&agg_dropped));
+    fprintf(out, "cpu_origins_dropped %lu\n", atomic_load(&cpu_dropped));
+    for (int i = 0; i < OUTCOMES; i++) {
+        cpu_counter_t *c = &cpu_outcomes[i];
+
+        t.requests = atomic_load_explicit(&c->requests, memory_order_relaxed);
+        t.cpu.cpu_us = atomic_load_explicit(&c->cpu_us, memory_order_relaxed);
+        t.cpu.user_us = atomic_load_explicit(&c->user_us, memory_order_relaxed);
+        t.cpu.sys_us = atomic_load_explicit(&c->sys_us, memory_order_relaxed);
+        t.cpu.vcsw = atomic_load_explicit(&c->vcsw, memory_order_relaxed);
+        t.cpu.ivcsw = atomic_load_explicit(&c->ivcsw, memory_order_relaxed);
+        print_cpu(out, outcome_names[i], &t);
+    }
+    for (int i = 0; i < AGG_SHARDS; i++) {
+        lockprof_lock(&cpu_shards[i].lock);
+        memcpy(batch, cpu_shards[i].slots, sizeof(batch));
+        lockprof_unlock(&cpu_shards[i].lock);
+        for (int j = 0; j < CPU_SLOTS; j++)
+            if (batch[j].name[0])
+                print_cpu(out, batch[j].name, &batch[j]);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * accesslog.h - Aggregated and sampled access logging
+ */
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdio.h>
+
+/* Logging modes */
+#define LOG_FULL 0              /* One line per request */
+#define LOG_SAMPLED 1           /* Aggregates, plus a sample of requests */
+#define LOG_AGGREGATE 2         /* Aggregates only */
+
+/* What accesslog_record says to write for a request */
+#define ACCESS_NONE 0           /* Nothing; it is in the aggregates */
+#define ACCESS_FULL 1           /* A full line */
+#define ACCESS_AGGREGATED 2     /* A full line, though it is in the aggregates too */
+
+/* How a request was served, for aggregation */
+#define OUTCOME_HIT 0           /* From the cache */
+#define OUTCOME_MISS 1          /* Fetched and offered to the cache */
+#define OUTCOME_PASS 2          /* Not cacheable */
+#define OUTCOME_PEER 3          /* Fetched through a peer */
+#define OUTCOME_TUNNEL 4        /* CONNECT */
+#define OUTCOME_ERROR 5         /* Answered by the proxy with an error */
+
+/* CPU used by a thread, or by a request as the difference of two readings */
+typedef struct {
+    unsigned long cpu_us;       /* CLOCK_THREAD_CPUTIME_ID */
+    unsigned long user_us, sys_us;
+    unsigned long vcsw, ivcsw;  /* Voluntary and involuntary context switches */
+} access_cpu_t;
+
+/* A finished request */
+typedef struct {
+    const char *origin;         /* host:port */
+    int status;
+    int outcome;
+    unsigned long long bytes;
+    unsigned long latency_us;
+    access_cpu_t cpu;
+} access_t;
+
+/* Writes one line to the log */
+typedef void (*accesslog_write_t)(char *line);
+
+void accesslog_init(accesslog_write_t write, int mode, int sample_every, long slow_ms, int interval);
+int accesslog_record(const access_t *a);
+void accesslog_cpu(access_cpu_t *cpu);
+void accesslog_cpu_since(access_cpu_t *cpu, const access_cpu_t *start);
+size_t accesslog_cpu_format(char *buf, size_t len, const access_cpu_t *cpu);
+void accesslog_stats(FILE *out);
+
+#endif /* __ACCESSLOG_H__ */
@@ -0,0 +1,393 @@
+#!/bin/bash
+#
+# bench.sh - Load tests for the concurrent proxy
+#
+#     Starts a test origin and the proxy on loopback in a scratch
+#     directory (the proxy reads its proxy.conf and writes its log there)
+#     and prints what the chosen mode measures.
+#
+#     usage: ./bench.sh mode [args]
+#
+#     slow CLIENTS SIZE     CLIENTS clients that never read fetch a SIZE
+#                           byte object; prints the proxy's RSS. A SIZE
+#                           ending in .chunked comes chunked, so it goes
+#                           through the relay buffer (it is decoded for
+#                           these HTTP/1.0 clients) rather than splice
+#     release SIZE RATE     one client reads a SIZE byte object at RATE
+#                           bytes/s; prints how long the origin connection
+#                           was held and how long the client took
+#     hits SIZE COUNT       fetches a SIZE byte object once, then COUNT
+#                           times from the cache, one request at a time;
+#                           prints the median and 99th percentile times
+#                           and the proxy's CPU time per hit
+#     files VARIANTS COUNT FILE...
+#                           COUNT requests, one at a time, for random
+#                           copies of the given files (VARIANTS URLs
+#                           each, all with the same content); prints the
+#                           proxy's cache figures
+#     page COUNT THINK FOLLOW PAGE OBJECT
+#                           COUNT times, fetches a fresh copy of the file
+#                           PAGE, waits THINK ms and then, for FOLLOW
+#                           percent of the pages, the file OBJECT it
+#                           links to; prints the times and the proxy's
+#                           prefetch figures
+#     upload SIZE CLIENTS [chunked]
+#                           CLIENTS clients at once POST SIZE bytes each,
+#                           with Content-Length or chunked; prints the
+#                           rate and the proxy's peak RSS per upload
+#     tunnel SIZE           one client fetches a SIZE byte object through
+#                           a CONNECT tunnel; prints the rate and the
+#                           proxy's CPU time per GB
+#
+#     PROXY names the proxy binary (default ./concurrentproxy), CONF adds
+#     lines to its proxy.conf and PORT is the first of the two ports used
+#     (default 18500). ORIGIN_DELAY delays every origin response by that
+#     many ms, like a distant origin. Needs python3.
+#
+
+PROXY=$(realpath "${PROXY:-./concurrentproxy}")
+PORT=${PORT:-18500}
+ORIGIN_PORT=$((PORT + 1))
+WORK=$(mktemp -d /tmp/bench.XXXXXX)
+trap 'kill $PROXY_PID $ORIGIN_PID $CLIENTS_PID 2>/dev/null; wait 2>/dev/null; rm -rf $WORK' EXIT
+
+# Test origin and clients
+cat > $WORK/bench.py <<'EOF'
+import os, random, socket, sys, threading, time
+
+def sink(c, req):
+    """Read a POST body (Content-Length or chunked) and answer 200."""
+    head, body = req.split(b'\r\n\r\n', 1)
+    fields = head.lower().split(b'\r\n')
+    length = [int(f.split(b':')[1]) for f in fields if f.startswith(b'content-length:')]
+    got, tail = len(body), body[-7:]
+    while (got < length[0]) if length else not tail.endswith(b'\r\n0\r\n\r\n'):
+        data = c.recv(1 << 20)
+        if not data:
+            return
+        got += len(data)
+        tail = (tail + data)[-7:]
+    c.sendall(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok')
+
+def send_file(c, path):
+    with open('/' + path, 'rb') as f:
+        body = f.read()
+    kind = {'html': b'text/html', 'gif': b'image/gif', 'jpg': b'image/jpeg'}.get(
+        path.rsplit('.', 1)[-1], b'text/plain')
+    c.sendall(b'HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n'
+              b'Connection: close\r\n\r\n%s' % (kind, len(body), body))
+
+def origin(port, delay):
+    """GET /SIZE sends SIZE bytes with Content-Length (GET /SIZE.chunked:
+    in 64 KB chunks) and closes its side;
+    the time from the request until the proxy lets go of the connection
+    goes to held.log. GET /files/VARIANT/PATH sends the file at /PATH.
+    POST bodies are read and thrown away."""
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('127.0.0.1', port))
+    s.listen(4096)
+    chunk = b'x' * 65536
+    def serve(c):
+        try:
+            req = b''
+            while b'\r\n\r\n' not in req:
+                data = c.recv(65536)
+                if not data:
+                    return
+                req += data
+            time.sleep(delay / 1000)
+            if req.startswith(b'POST'):
+                return sink(c, req)
+            if req.split()[1].startswith(b'/files/'):
+                return send_file(c, req.split()[1].decode().split('/', 3)[3])
+            start = time.time()
+            path = req.split()[1].decode().rsplit('/', 1)[-1]
+            n = int(path.split('.')[0])
+            chunked = path.endswith('.chunked')
+            if chunked:
+                c.sendall(b'HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n'
+                          b'Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n')
+            else:
+                c.sendall(b'HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n'
+                          b'Content-Length: %d\r\nConnection: close\r\n\r\n' % n)
+            while n > 0:
+                k = min(n, len(chunk))
+                c.sendall(b'%x\r\n%s\r\n' % (k, chunk[:k]) if chunked else chunk[:k])
+                n -= k
+            if chunked:
+                c.sendall(b'0\r\n\r\n')
+            c.shutdown(socket.SHUT_WR)
+            while c.recv(65536):
+                pass
+            with open('held.log', 'a') as f:
+                f.write('%.3f\n' % (time.time() - start))
+        except OSError:
+            pass
+        finally:
+            c.close()
+    while True:
+        c, _ = s.accept()
+        threading.Thread(target=serve, args=(c,), daemon=True).start()
+
+def request(port, url, rcvbuf=0):
+    c = socket.socket()
+    if rcvbuf:
+        c.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+    c.connect(('127.0.0.1', port))
+    c.sendall(b'GET %s HTTP/1.0\r\n\r\n' % url.encode())
+    return c
+
+def slow(port, url, clients):
+    """Open clients connections that request url and never read."""
+    conns = []
+    for i in range(clients):
+        conns.append(request(port, url, 4096))
+    print('connected', flush=True)
+    sys.stdin.read()
+
+def drain(port, url, rate):
+    """Read url at rate bytes/s; print seconds taken and bytes read."""
+    c = request(port, url, 4096)
+    start, got, step = time.time(), 0, 1024
+    while True:
+        data = c.recv(step)
+        if not data:
+            break
+        got += len(data)
+        delay = start + got / rate - time.time()
+        if delay > 0:
+            time.sleep(delay)
+    print('%.3f %d' % (time.time() - start, got))
+
+def hits(port, url, count):
+    """Fetch url once, then count more times; print the median and 99th
+    percentile of the later fetches, in microseconds."""
+    times = []
+    for i in range(count + 1):
+        start = time.perf_counter()
+        c = request(port, url)
+        while c.recv(1 << 20):
+            pass
+        c.close()
+        times.append((time.perf_counter() - start) * 1e6)
+    times = sorted(times[1:])
+    print('%.0f %.0f' % (times[len(times) // 2], times[len(times) * 99 // 100]))
+
+def files(port, origin_port, variants, count, paths):
+    """count requests for random variants of paths; print mean microseconds."""
+    rand = random.Random(1)
+    total = 0
+    for i in range(count):
+        url = 'http://127.0.0.1:%d/files/%d%s' % (origin_port, rand.randrange(variants),
+                                                  rand.choice(paths))
+        start = time.perf_counter()
+        c = request(port, url)
+        while c.recv(1 << 20):
+            pass
+        c.close()
+        total += time.perf_counter() - start
+    print('%.0f' % (total / count * 1e6))
+
+def fetch(port, url):
+    """Fetch url; return microseconds taken."""
+    start = time.perf_counter()
+    c = request(port, url)
+    while c.recv(1 << 20):
+        pass
+    c.close()
+    return (time.perf_counter() - start) * 1e6
+
+def page(port, origin_port, count, think, follow, page, obj):
+    """Fetch count fresh copies of page and, think ms later, of the object
+    it links to for follow percent of them; print the median and 99th
+    percentile of each in microseconds."""
+    rand = random.Random(1)
+    pages, objs = [], []
+    for i in range(count):
+        base = 'http://127.0.0.1:%d/files/%d' % (origin_port, i)
+        pages.append(fetch(port, base + page))
+        time.sleep(think / 1000)
+        if rand.randrange(100) < follow:
+            objs.append(fetch(port, base + obj))
+    pages.sort()
+    objs.sort()
+    print('%.0f %.0f %.0f %.0f' % (pages[len(pages) // 2], pages[len(pages) * 99 // 100],
+                                   objs[len(objs) // 2] if objs else 0,
+                                   objs[len(objs) * 99 // 100] if objs else 0))
+
+def upload(port, url, size, clients, chunked):
+    """clients threads POST size bytes each; print seconds and bytes."""
+    chunk = b'x' * 65536
+    def post():
+        c = socket.socket()
+        c.connect(('127.0.0.1', port))
+        if chunked:
+            c.sendall(b'POST %s HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n' % url.encode())
+        else:
+            c.sendall(b'POST %s HTTP/1.1\r\nContent-Length: %d\r\n\r\n' % (url.encode(), size))
+        n = size
+        while n > 0:
+            k = min(n, len(chunk))
+            c.sendall(b'%x\r\n%s\r\n' % (k, chunk[:k]) if chunked else chunk[:k])
+            n -= k
+        if chunked:
+            c.sendall(b'0\r\n\r\n')
+        while c.recv(65536):
+            pass
+        c.close()
+    start = time.time()
+    threads = [threading.Thread(target=post) for i in range(clients)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    print('%.3f %d' % (time.time() - start, size * clients))
+
+def tunnel(port, origin_port, size):
+    """Fetch size bytes through a CONNECT tunnel; print seconds and bytes."""
+    c = socket.socket()
+    c.connect(('127.0.0.1', port))
+    c.sendall(b'CONNECT 127.0.0.1:%d HTTP/1.1\r\n\r\n' % origin_port)
+    reply = b''
+    while b'\r\n\r\n' not in reply:
+        reply += c.recv(1)
+    start, got = time.time(), 0
+    c.sendall(b'GET /%d HTTP/1.0\r\n\r\n' % size)
+    buf = memoryview(bytearray(1 << 20))
+    while True:
+        n = c.recv_into(buf)
+        if not n:
+            break
+        got += n
+    print('%.3f %d' % (time.time() - start, got))
+
+if __name__ == '__main__':
+    cmd = sys.argv[1]
+    if cmd == 'origin':
+        origin(int(sys.argv[2]), float(sys.argv[3]))
+    elif cmd == 'slow':
+        slow(int(sys.argv[2]), sys.argv[3], int(sys.argv[4]))
+    elif cmd == 'drain':
+        drain(int(sys.argv[2]), sys.argv[3], float(sys.argv[4]))
+    elif cmd == 'hits':
+        hits(int(sys.argv[2]), sys.argv[3], int(sys.argv[4]))
+    elif cmd == 'files':
+        files(int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]), int(sys.argv[5]), sys.argv[6:])
+    elif cmd == 'page':
+        page(int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]), float(sys.argv[5]), int(sys.argv[6]),
+             sys.argv[7], sys.argv[8])
+    elif cmd == 'upload':
+        upload(int(sys.argv[2]), sys.argv[3], int(sys.argv[4]), int(sys.argv[5]), sys.argv[6] == 'chunked')
+    elif cmd == 'tunnel':
+        tunnel(int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]))
+EOF
+
+start() {
+    cd $WORK
+    printf "%s\n" "$CONF" > proxy.conf
+    python3 bench.py origin $ORIGIN_PORT ${ORIGIN_DELAY:-0} & ORIGIN_PID=$!
+    $PROXY $PORT >/dev/null 2>proxy.err & PROXY_PID=$!
+    sleep 1
+}
+
+# User plus system CPU time of the proxy, in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$PROXY_PID/stat
+}
+
+rss_kb() {
+    awk '/VmRSS/ { print $2 }' /proc/$PROXY_PID/status
+}
+
+peak_rss_kb() {
+    awk '/VmHWM/ { print $2 }' /proc/$PROXY_PID/status
+}
+
+case "$1" in
+slow)
+    start
+    base=$(rss_kb)
+    mkfifo hold
+    python3 bench.py slow $PORT http://127.0.0.1:$ORIGIN_PORT/$3 $2 < hold > slow.out & CLIENTS_PID=$!
+    exec 3> hold
+    until grep -q connected slow.out 2>/dev/null; do
+        kill -0 $CLIENTS_PID 2>/dev/null || { echo "clients=$2 failed:" $(tail -1 proxy.err); exit 1; }
+        sleep 0.5
+    done
+    sleep 3
+    kill -0 $PROXY_PID 2>/dev/null || { echo "clients=$2 failed:" $(tail -1 proxy.err); exit 1; }
+    rss=$(rss_kb)
+    echo "clients=$2 size=$3 rss_kb=$rss idle_rss_kb=$base per_client_kb=$(( (rss - base) / $2 ))" \
+         "threads=$(ls /proc/$PROXY_PID/task | wc -l)"
+    exec 3>&-
+    wait $CLIENTS_PID
+    ;;
+release)
+    start
+    client=$(python3 bench.py drain $PORT http://127.0.0.1:$ORIGIN_PORT/$2 $3)
+    sleep 0.5
+    echo "size=$2 rate=$3 client_s=${client% *} bytes=${client#* } origin_held_s=$(cat held.log)"
+    ;;
+hits)
+    start
+    before=$(cpu_ticks)
+    client=$(python3 bench.py hits $PORT http://127.0.0.1:$ORIGIN_PORT/$2 $3)
+    ticks=$(( $(cpu_ticks) - before ))
+    sleep 0.5
+    echo "size=$2 hits=$3 median_us=${client% *} p99_us=${client#* }" \
+         "cpu_us_per_hit=$(( ticks * 1000000 / $(getconf CLK_TCK) / $3 )) origin_fetches=$(wc -l < held.log)"
+    ;;
+files)
+    variants=$2 count=$3
+    shift 3
+    paths=$(realpath "$@")
+    start
+    client=$(python3 bench.py files $PORT $ORIGIN_PORT $variants $count $paths)
+    curl -s http://127.0.0.1:$PORT/proxy-stats | awk -v n=$count -v v=$variants -v us=$client '
+        /^cache_(bytes|hit_ratio|compression_ratio|decompress_ns_per_hit|hit_write_ns) / { f[$1] = $2 }
+        END { printf "variants=%d requests=%d mean_us=%d hit_ratio=%s cache_bytes=%s" \
+                     " compression_ratio=%s decompress_ns_per_hit=%s hit_write_ns=%s\n", v, n, us,
+                     f["cache_hit_ratio"], f["cache_bytes"], f["cache_compression_ratio"],
+                     f["cache_decompress_ns_per_hit"], f["cache_hit_write_ns"] }'
+    ;;
+page)
+    paths=$(realpath "$5" "$6")
+    start
+    client=$(python3 bench.py page $PORT $ORIGIN_PORT $2 $3 $4 $paths)
+    sleep 1
+    curl -s http://127.0.0.1:$PORT/proxy-stats | awk -v c="$client" -v n=$2 -v t=$3 -v f=$4 '
+        /^prefetch_(fetched|used|wasted_ratio|claimed|joined) / { p[$1] = $2 }
+        END { split(c, us, " ")
+              printf "pages=%d think_ms=%s follow=%d%% page_median_us=%d page_p99_us=%d" \
+                     " object_median_us=%d object_p99_us=%d prefetched=%d used=%d claimed=%d" \
+                     " joined=%d wasted_ratio=%s\n",
+                     n, t, f, us[1], us[2], us[3], us[4],
+                     p["prefetch_fetched"], p["prefetch_used"], p["prefetch_claimed"], p["prefetch_joined"],
+                     p["prefetch_wasted_ratio"] }'
+    ;;
+upload)
+    start
+    base=$(rss_kb)
+    client=$(python3 bench.py upload $PORT http://127.0.0.1:$ORIGIN_PORT/upload $2 $3 ${4:-length})
+    peak=$(peak_rss_kb)
+    echo "$client" | awk -v peak=$peak -v base=$base -v n=$3 -v mode=${4:-length} '{
+        printf "size=%s clients=%d mode=%s secs=%s mb_s=%.0f peak_rss_kb=%d idle_rss_kb=%d per_upload_kb=%d\n",
+               $2 / n, n, mode, $1, $2 / $1 / 1e6, peak, base, (peak - base) / n }'
+    ;;
+tunnel)
+    CONF=$(printf "%s\nconnect_port %d" "$CONF" $ORIGIN_PORT)
+    start
+    before=$(cpu_ticks)
+    client=$(python3 bench.py tunnel $PORT $ORIGIN_PORT $2)
+    ticks=$(( $(cpu_ticks) - before ))
+    echo "$client $ticks $(getconf CLK_TCK)" | awk '{
+        printf "size=%s secs=%s mb_s=%.0f cpu_s=%.2f cpu_s_per_gb=%.2f\n",
+               $2, $1, $2 / $1 / 1e6, $3 / $4, $3 / $4 / ($2 / 1e9) }'
+    ;;
+*)
+    echo "usage: $0 slow CLIENTS SIZE | release SIZE RATE | hits SIZE COUNT | files VARIANTS COUNT FILE... |
+       page COUNT THINK FOLLOW PAGE OBJECT | upload SIZE CLIENTS [chunked] | tunnel SIZE" >&2
+    exit 1
+    ;;
+esac
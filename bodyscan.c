@@ -0,0 +1,629 @@
+/*
+ * bodyscan.c - Streaming scan of response bodies for blocked markers
+ *
+ * Each line of the marker file is a byte string that must not reach a
+ * client in the body of a response of a scanned content type; \xNN
+ * stands for any byte and \\ for a backslash. Bodies are fed to the
+ * scanner in whatever runs the relay reads them, and the last
+ * MAX_MARKER_LEN - 1 bytes of each run are carried over, so a marker
+ * split across reads or chunks is still found.
+ *
+ * Matching has two steps, as in Hyperscan's Teddy. For each marker the
+ * prefilter looks for its least common four bytes (its window), so that
+ * markers beginning with everyday words do not flood it. The markers are
+ * spread over 8 buckets, and each window byte sets its bucket's bit in
+ * two 16-entry tables, one indexed by the low and one by the high nibble
+ * of the byte. For 32 (AVX2) or 16 (SSSE3) positions at once, PSHUFB
+ * looks up the nibbles of the bytes at offsets 0 to 3, and ANDing the
+ * eight lookups leaves, for each position, the buckets with a window
+ * that could be there. Only those positions are confirmed, through a
+ * hash table of the windows, against the markers themselves.
+ *
+ * With more than TEDDY_MAX markers (none shorter than the window) the
+ * nibble tables let most positions through, so, as Hyperscan switches
+ * to FDR, the prefilter becomes a bitmap of the windows' hashes (32 KB):
+ * each position's four bytes are hashed and looked up, 16 positions at
+ * a time with AVX2 gathers. The kernel is picked for the CPU at startup; without SSSE3 (or AVX2 for
+ * the bitmap) the same tables are used a byte at a time.
+ *
+ * On a match the response is aborted: the relay drops what it has not
+ * yet sent and the connection is reset, so the client sees a truncated
+ * body (the headers have gone out, so the status cannot change). With
+ * mask set, a marker that lies wholly in the run being fed is
+ * overwritten with '*' instead and the response goes on; one that began
+ * in an earlier, possibly already sent, run still aborts it.
+ */
+#include "csapp.h"
+#include "bodyscan.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_PSHUFB 1
+#endif
+
+#define BUCKETS 8
+#define WINDOW 4                /* Marker bytes the prefilter looks for */
+#define TEDDY_MAX 32            /* Beyond this many markers, use the bitmap */
+#define BITMAP_BITS 18          /* log2 of the bits in the window bitmap */
+#define MAX_TYPES 16
+
+struct bodyscan {
+    unsigned char carry[MAX_MARKER_LEN - 1];   /* Tail of the body so far */
+    size_t carried;
+    int marker;                 /* Last marker found, or -1 */
+    int aborted;
+};
+
+/* Looks for a marker whose window is at or after position from in the n
+ * bytes at p, and which starts before limit and ends within them. Sets
+ * *marker and returns the window's position, or -1 if there is none. */
+typedef long (*kernel_t)(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker);
+
+static unsigned char **markers;
+static int *marker_len, *window_at, nmarkers, longest;
+static uint32_t *window_word;           /* The window, as loaded from memory */
+static uint32_t bitmap[(1 << BITMAP_BITS) / 32];   /* Hashes of the windows */
+static int *confirm, *confirm_next;     /* Hash chains on the window */
+static unsigned confirm_mask;
+static int *short_markers, nshort;      /* Markers under WINDOW bytes */
+static unsigned short_bits;             /* Their buckets */
+static uint8_t lo_mask[WINDOW][16] __attribute__((aligned(16)));
+static uint8_t hi_mask[WINDOW][16] __attribute__((aligned(16)));
+static char *types[MAX_TYPES];
+static int ntypes, masking;
+static kernel_t kernel;
+static int use_bitmap;          /* The kernel is a bitmap one, not Teddy */
+static int kernel_width = 1;    /* Positions the kernel tests at once */
+
+static atomic_ulong responses, skipped, bytes_scanned, candidates, found, masked, aborted;
+
+static inline uint32_t load4(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - BITMAP_BITS);
+}
+
+/*
+ * try - Whether marker m, with its window at p[j], starts before limit,
+ * fits in the n bytes at p and is there.
+ */
+static inline int try(const unsigned char *p, size_t n, size_t j, size_t limit, int m) {
+    size_t at = j - window_at[m];
+
+    return j >= (size_t)window_at[m] && at < limit && at + marker_len[m] <= n &&
+           memcmp(p + at, markers[m], marker_len[m]) == 0;
+}
+
+/*
+ * verify - A marker with its window at p[j], or -1. bits are the buckets
+ * the prefilter let through there. Markers of WINDOW bytes or more are
+ * found through the hash of their window whatever their bucket, shorter
+ * ones by trying each.
+ */
+static inline int verify(const unsigned char *p, size_t n, size_t j, size_t limit, unsigned bits) {
+    int m;
+
+    uint32_t v;
+
+    if (j + WINDOW <= n) {
+        v = load4(p + j);
+        for (m = confirm[hash4(v) & confirm_mask]; m >= 0; m = confirm_next[m])
+            if (window_word[m] == v && try(p, n, j, limit, m))
+                return m;
+    }
+    if (bits & short_bits) {
+        for (int k = 0; k < nshort; k++)
+            if (try(p, n, j, limit, short_markers[k]))
+                return short_markers[k];
+    }
+    return -1;
+}
+
+/*
+ * scan_range - The byte-at-a-time kernel, from position i on. Window
+ * bytes past the end of p match anything; verify rejects what does not
+ * fit.
+ */
+static long scan_range(const unsigned char *p, size_t n, size_t i, size_t limit, int *marker,
+                       unsigned long *cands) {
+    unsigned bits;
+
+    for (; i < n; i++) {
+        bits = 0xff;
+        for (int k = 0; k < WINDOW && bits && i + k < n; k++)
+            bits &= lo_mask[k][p[i + k] & 15] & hi_mask[k][p[i + k] >> 4];
+        if (bits) {
+            (*cands)++;
+            if ((*marker = verify(p, n, i, limit, bits)) >= 0)
+                return i;
+        }
+    }
+    return -1;
+}
+
+static long scan_scalar(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker) {
+    unsigned long cands = 0;
+    long at = scan_range(p, n, from, limit, marker, &cands);
+
+    atomic_fetch_add_explicit(&candidates, cands, memory_order_relaxed);
+    return at;
+}
+
+/*
+ * scan_bitmap - Kernel for large marker sets, where the nibble tables
+ * would let nearly every position through: each position's four bytes
+ * are hashed and looked up in a bitmap of the windows' hashes.
+ */
+static long scan_bitmap(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker) {
+    unsigned long cands = 0;
+    unsigned h;
+    size_t i = from;
+    long at = -1;
+
+    for (; i + WINDOW <= n; i++) {
+        h = hash4(load4(p + i));
+        if (bitmap[h >> 5] & (1u << (h & 31))) {
+            cands++;
+            if ((*marker = verify(p, n, i, limit, 0)) >= 0) {
+                at = i;
+                break;
+            }
+        }
+    }
+    if (at < 0)
+        at = scan_range(p, n, i, limit, marker, &cands);
+    atomic_fetch_add_explicit(&candidates, cands, memory_order_relaxed);
+    return at;
+}
+
+#ifdef HAVE_PSHUFB
+__attribute__((target("ssse3")))
+static long scan_ssse3(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker) {
+    __m128i lo[WINDOW], hi[WINDOW], acc, v, nib = _mm_set1_epi8(0x0f);
+    uint8_t hits[16] __attribute__((aligned(16)));
+    unsigned long cands = 0;
+    unsigned m;
+    size_t i = from, j;
+    long at = -1;
+
+    for (int k = 0; k < WINDOW; k++) {
+        lo[k] = _mm_load_si128((const __m128i *)lo_mask[k]);
+        hi[k] = _mm_load_si128((const __m128i *)hi_mask[k]);
+    }
+    for (; at < 0 && i + 16 + WINDOW - 1 <= n; i += 16) {
+        acc = _mm_set1_epi8(-1);
+        for (int k = 0; k < WINDOW; k++) {
+            v = _mm_loadu_si128((const __m128i *)(p + i + k));
+            acc = _mm_and_si128(acc, _mm_and_si128(_mm_shuffle_epi8(lo[k], _mm_and_si128(v, nib)),
+                                                   _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(v, 4), nib))));
+        }
+        m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) & 0xffff;
+        if (!m)
+            continue;
+        _mm_store_si128((__m128i *)hits, acc);
+        for (; m; m &= m - 1) {
+            j = i + __builtin_ctz(m);
+            cands++;
+            if ((*marker = verify(p, n, j, limit, hits[j - i])) >= 0) {
+                at = j;
+                break;
+            }
+        }
+    }
+    if (at < 0)
+        at = scan_range(p, n, i, limit, marker, &cands);
+    atomic_fetch_add_explicit(&candidates, cands, memory_order_relaxed);
+    return at;
+}
+
+__attribute__((target("avx2")))
+static long scan_avx2(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker) {
+    __m256i lo[WINDOW], hi[WINDOW], acc, v, nib = _mm256_set1_epi8(0x0f);
+    uint8_t hits[32] __attribute__((aligned(32)));
+    unsigned long cands = 0;
+    uint32_t m;
+    size_t i = from, j;
+    long at = -1;
+
+    for (int k = 0; k < WINDOW; k++) {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)lo_mask[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)hi_mask[k]));
+    }
+    for (; at < 0 && i + 32 + WINDOW - 1 <= n; i += 32) {
+        acc = _mm256_set1_epi8(-1);
+        for (int k = 0; k < WINDOW; k++) {
+            v = _mm256_loadu_si256((const __m256i *)(p + i + k));
+            acc = _mm256_and_si256(acc,
+                                   _mm256_and_si256(_mm256_shuffle_epi8(lo[k], _mm256_and_si256(v, nib)),
+                                                    _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(v, 4), nib))));
+        }
+        m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, _mm256_setzero_si256()));
+        if (!m)
+            continue;
+        _mm256_store_si256((__m256i *)hits, acc);
+        for (; m; m &= m - 1) {
+            j = i + __builtin_ctz(m);
+            cands++;
+            if ((*marker = verify(p, n, j, limit, hits[j - i])) >= 0) {
+                at = j;
+                break;
+            }
+        }
+    }
+    if (at < 0)
+        at = scan_range(p, n, i, limit, marker, &cands);
+    atomic_fetch_add_explicit(&candidates, cands, memory_order_relaxed);
+    return at;
+}
+
+/*
+ * scan_bitmap_avx2 - scan_bitmap for 16 positions at once: PSHUFB spreads
+ * each 11 bytes into 8 overlapping windows, which are hashed together
+ * and looked up with one gather.
+ */
+__attribute__((target("avx2")))
+static long scan_bitmap_avx2(const unsigned char *p, size_t n, size_t from, size_t limit, int *marker) {
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4, 2, 3, 4, 5, 3, 4, 5, 6,
+                                            4, 5, 6, 7, 5, 6, 7, 8, 6, 7, 8, 9, 7, 8, 9, 10);
+    const __m256i mul = _mm256_set1_epi32(2654435761u), low5 = _mm256_set1_epi32(31), one = _mm256_set1_epi32(1);
+    __m256i h0, h1, w0, w1;
+    unsigned long cands = 0;
+    unsigned m;
+    size_t i = from, j;
+    long at = -1;
+
+    for (; at < 0 && i + 24 <= n; i += 16) {
+        h0 = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p + i))), spread);
+        h1 = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p + i + 8))), spread);
+        h0 = _mm256_srli_epi32(_mm256_mullo_epi32(h0, mul), 32 - BITMAP_BITS);
+        h1 = _mm256_srli_epi32(_mm256_mullo_epi32(h1, mul), 32 - BITMAP_BITS);
+        w0 = _mm256_i32gather_epi32((const int *)bitmap, _mm256_srli_epi32(h0, 5), 4);
+        w1 = _mm256_i32gather_epi32((const int *)bitmap, _mm256_srli_epi32(h1, 5), 4);
+        w0 = _mm256_and_si256(_mm256_srlv_epi32(w0, _mm256_and_si256(h0, low5)), one);
+        w1 = _mm256_and_si256(_mm256_srlv_epi32(w1, _mm256_and_si256(h1, low5)), one);
+        m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(w0, one))) |
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(w1, one))) << 8;
+        for (; m; m &= m - 1) {
+            j = i + __builtin_ctz(m);
+            cands++;
+            if ((*marker = verify(p, n, j, limit, 0)) >= 0) {
+                at = j;
+                break;
+            }
+        }
+    }
+    atomic_fetch_add_explicit(&candidates, cands, memory_order_relaxed);
+    return at >= 0 ? at : scan_bitmap(p, n, i, limit, marker);
+}
+#endif
+
+/*
+ * parse_marker - Decode the escapes in a marker line into out. Returns
+ * its length, or -1 if it is longer than MAX_MARKER_LEN.
+ */
+static int parse_marker(const char *line, unsigned char *out) {
+    int n = 0;
+
+    for (const char *p = line; *p; p++) {
+        if (n == MAX_MARKER_LEN)
+            return -1;
+        if (p[0] == '\\' && p[1] == 'x' && isxdigit((unsigned char)p[2]) && isxdigit((unsigned char)p[3])) {
+            char hex[3] = { p[2], p[3], '\0' };
+            out[n++] = strtol(hex, NULL, 16);
+            p += 3;
+        } else if (p[0] == '\\' && p[1] == '\\') {
+            out[n++] = '\\';
+            p++;
+        } else {
+            out[n++] = *p;
+        }
+    }
+    return n;
+}
+
+/*
+ * commonness - A rough rank of how often byte c turns up in web text,
+ * used to pick the part of each marker the prefilter looks for.
+ */
+static int commonness(unsigned char c) {
+    if (c == ' ' || (c && strchr("etaoinsrhl", c)))
+        return 8;
+    if (islower(c))
+        return 6;
+    if (isdigit(c) || (c && strchr("<>/\"'=.,:;-_()\n\t", c)))
+        return 5;
+    if (isupper(c))
+        return 3;
+    return isprint(c) ? 2 : 1;
+}
+
+/*
+ * add_marker - Add a marker to the prefilter tables. The prefilter looks
+ * for the marker's least common WINDOW bytes, so markers that begin with
+ * everyday words do not flood it. Markers with the same window share a
+ * bucket; positions past the end of a short marker match any byte.
+ */
+static void add_marker(const unsigned char *text, int len) {
+    int b, score, least = INT_MAX, m = nmarkers++;
+    const unsigned char *w;
+    unsigned h = 0;
+
+    markers = Realloc(markers, nmarkers * sizeof(unsigned char *));
+    marker_len = Realloc(marker_len, nmarkers * sizeof(int));
+    window_at = Realloc(window_at, nmarkers * sizeof(int));
+    markers[m] = Malloc(len);
+    memcpy(markers[m], text, len);
+    marker_len[m] = len;
+    window_at[m] = 0;
+    longest = len > longest ? len : longest;
+
+    for (int at = 0; at + WINDOW <= len; at++) {
+        score = 0;
+        for (int k = 0; k < WINDOW; k++)
+            score += commonness(text[at + k]);
+        if (score < least) {
+            least = score;
+            window_at[m] = at;
+        }
+    }
+    w = text + window_at[m];
+    for (int k = 0; k < WINDOW && k < len; k++)
+        h = h * 31 + w[k];
+    b = h % BUCKETS;
+    if (len < WINDOW) {
+        short_markers = Realloc(short_markers, (nshort + 1) * sizeof(int));
+        short_markers[nshort++] = m;
+        short_bits |= 1 << b;
+    }
+
+    for (int k = 0; k < WINDOW; k++) {
+        if (k < len) {
+            lo_mask[k][w[k] & 15] |= 1 << b;
+            hi_mask[k][w[k] >> 4] |= 1 << b;
+        } else {
+            for (int c = 0; c < 16; c++) {
+                lo_mask[k][c] |= 1 << b;
+                hi_mask[k][c] |= 1 << b;
+            }
+        }
+    }
+}
+
+/*
+ * bodyscan_init - Load the markers in filename, one per line, and scan
+ * bodies whose Content-Type starts with one of the comma-separated
+ * types. Markers are masked instead of aborting the response if mask is
+ * set. Returns the number of markers, or -1 if the file cannot be read.
+ */
+int bodyscan_init(const char *filename, const char *type_list, int mask) {
+    FILE *f = fopen(filename, "r");
+    char line[MAXLINE], *list, *type, *save;
+    unsigned char text[MAX_MARKER_LEN];
+    int len;
+    unsigned h;
+
+    if (!f) {
+        fprintf(stderr, "bodyscan: cannot read %s\n", filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if ((len = parse_marker(line, text)) < 0)
+            fprintf(stderr, "bodyscan: marker longer than %d bytes ignored: %s\n", MAX_MARKER_LEN, line);
+        else
+            add_marker(text, len);
+    }
+    fclose(f);
+
+    /* Chain the markers of WINDOW bytes or more by the hash of their window */
+    for (confirm_mask = 15; confirm_mask < (unsigned)nmarkers * 4 && confirm_mask < (1 << BITMAP_BITS) - 1;
+         confirm_mask = confirm_mask * 2 + 1)
+        ;
+    confirm = Malloc((confirm_mask + 1) * sizeof(int));
+    confirm_next = Malloc((nmarkers + 1) * sizeof(int));
+    memset(confirm, -1, (confirm_mask + 1) * sizeof(int));
+    window_word = Malloc((nmarkers + 1) * sizeof(uint32_t));
+    for (int m = nmarkers - 1; m >= 0; m--) {
+        if (marker_len[m] >= WINDOW) {
+            window_word[m] = load4(markers[m] + window_at[m]);
+            h = hash4(window_word[m]);
+            confirm_next[m] = confirm[h & confirm_mask];
+            confirm[h & confirm_mask] = m;
+            bitmap[h >> 5] |= 1u << (h & 31);
+        }
+    }
+
+    list = strdup(type_list);
+    for (type = strtok_r(list, ", ", &save); type && ntypes < MAX_TYPES; type = strtok_r(NULL, ", ", &save))
+        types[ntypes++] = strdup(type);
+    free(list);
+    masking = mask;
+
+    /* Markers shorter than the window only fit in the nibble tables */
+    use_bitmap = nmarkers > TEDDY_MAX && nshort == 0;
+    kernel = use_bitmap ? scan_bitmap : scan_scalar;
+#ifdef HAVE_PSHUFB
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = use_bitmap ? scan_bitmap_avx2 : scan_avx2;
+        kernel_width = use_bitmap ? 16 : 32;
+    } else if (__builtin_cpu_supports("ssse3") && !use_bitmap) {
+        kernel = scan_ssse3;
+        kernel_width = 16;
+    }
+#endif
+    return nmarkers;
+}
+
+/*
+ * bodyscan_start - Start scanning a response body, or return NULL if
+ * its content type is not scanned. Bodies with a content coding other
+ * than identity cannot be scanned and are passed (and counted).
+ */
+bodyscan_t *bodyscan_start(const char *content_type, const char *content_encoding) {
+    bodyscan_t *s;
+    int i;
+
+    if (!nmarkers || !content_type)
+        return NULL;
+    for (i = 0; i < ntypes && strncasecmp(content_type, types[i], strlen(types[i])) != 0; i++)
+        ;
+    if (i == ntypes)
+        return NULL;
+    if (content_encoding && content_encoding[0] && strncasecmp(content_encoding, "identity", 8) != 0) {
+        atomic_fetch_add(&skipped, 1);
+        return NULL;
+    }
+    s = Malloc(sizeof(bodyscan_t));
+    s->carried = 0;
+    s->marker = -1;
+    s->aborted = 0;
+    atomic_fetch_add(&responses, 1);
+    return s;
+}
+
+static int abort_scan(bodyscan_t *s, int marker) {
+    s->marker = marker;
+    s->aborted = 1;
+    atomic_fetch_add(&found, 1);
+    atomic_fetch_add(&aborted, 1);
+    return BODYSCAN_ABORT;
+}
+
+/*
+ * bodyscan_feed - Scan the next len bytes of a body. Returns
+ * BODYSCAN_PASS, BODYSCAN_MASKED if markers in data were overwritten, or
+ * BODYSCAN_ABORT (and from then on) if the response must be cut off.
+ */
+int bodyscan_feed(bodyscan_t *s, char *data, size_t len) {
+    unsigned char stitch[2 * (MAX_MARKER_LEN - 1)];
+    const unsigned char *p = (const unsigned char *)data;
+    size_t head, from = 0, keep = longest - 1, drop;
+    long at;
+    int m, rc = BODYSCAN_PASS;
+
+    if (s->aborted)
+        return BODYSCAN_ABORT;
+    atomic_fetch_add_explicit(&bytes_scanned, len, memory_order_relaxed);
+
+    /* Markers that start in the carried tail and end in data */
+    if (s->carried && len) {
+        head = len < keep ? len : keep;
+        memcpy(stitch, s->carry, s->carried);
+        memcpy(stitch + s->carried, data, head);
+        if (kernel(stitch, s->carried + head, 0, s->carried, &m) >= 0)
+            return abort_scan(s, m);
+    }
+
+    /* Markers that start in data */
+    while ((at = kernel(p, len, from, len, &m)) >= 0) {
+        if (!masking)
+            return abort_scan(s, m);
+        memset(data + at - window_at[m], '*', marker_len[m]);
+        from = at + 1;
+        s->marker = m;
+        rc = BODYSCAN_MASKED;
+        atomic_fetch_add(&found, 1);
+        atomic_fetch_add(&masked, 1);
+    }
+
+    /* Carry the last keep bytes of the body into the next run */
+    if (len >= keep) {
+        memcpy(s->carry, data + len - keep, keep);
+        s->carried = keep;
+    } else if (s->carried + len <= keep) {
+        memcpy(s->carry + s->carried, data, len);
+        s->carried += len;
+    } else {
+        drop = s->carried + len - keep;
+        memmove(s->carry, s->carry + drop, s->carried - drop);
+        memcpy(s->carry + s->carried - drop, data, len);
+        s->carried = keep;
+    }
+    return rc;
+}
+
+/*
+ * bodyscan_marker - The index of the last marker found, or -1.
+ */
+int bodyscan_marker(bodyscan_t *s) {
+    return s->marker;
+}
+
+void bodyscan_finish(bodyscan_t *s) {
+    free(s);
+}
+
+/*
+ * header_value - Copy the value of header name from the headers that
+ * run from p to end into val, or leave val empty.
+ */
+static void header_value(const char *p, const char *end, const char *name, char *val, size_t cap) {
+    size_t nlen = strlen(name), n;
+    const char *eol;
+
+    val[0] = '\0';
+    for (; p < end; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p)))
+            eol = end;
+        if ((size_t)(eol - p) > nlen && strncasecmp(p, name, nlen) == 0) {
+            p += nlen + strspn(p + nlen, " \t");
+            n = eol - p < (long)cap ? eol - p : cap - 1;
+            memcpy(val, p, n);
+            val[n] = '\0';
+            val[strcspn(val, "\r")] = '\0';
+            return;
+        }
+    }
+}
+
+/*
+ * bodyscan_response - Scan the body of a whole HTTP/1.0 response held
+ * in memory (headers included), as fetched by the prefetcher. Returns
+ * what bodyscan_feed would.
+ */
+int bodyscan_response(char *response, size_t len) {
+    char type[MAXLINE], encoding[MAXLINE];
+    size_t body;
+    bodyscan_t *s;
+    int rc;
+
+    if (!nmarkers)
+        return BODYSCAN_PASS;
+    for (body = 0; body + 4 <= len && memcmp(response + body, "\r\n\r\n", 4) != 0; body++)
+        ;
+    if (body + 4 > len)
+        return BODYSCAN_PASS;
+    header_value(response, response + body, "Content-Type:", type, sizeof(type));
+    header_value(response, response + body, "Content-Encoding:", encoding, sizeof(encoding));
+    if (!(s = bodyscan_start(type, encoding)))
+        return BODYSCAN_PASS;
+    rc = bodyscan_feed(s, response + body + 4, len - body - 4);
+    bodyscan_finish(s);
+    return rc;
+}
+
+/*
+ * bodyscan_stats - Print the scanner's counters as "name value" lines.
+ */
+void bodyscan_stats(FILE *out) {
+    fprintf(out, "bodyscan_markers %d\n", nmarkers);
+    fprintf(out, "bodyscan_bitmap %d\n", use_bitmap);
+    fprintf(out, "bodyscan_simd_width %d\n", kernel_width);
+    fprintf(out, "bodyscan_responses %lu\n", atomic_load(&responses));
+    fprintf(out, "bodyscan_skipped_encoded %lu\n", atomic_load(&skipped));
+    fprintf(out, "bodyscan_bytes %lu\n", atomic_load(&bytes_scanned));
+    fprintf(out, "bodyscan_candidates %lu\n", atomic_load(&candidates));
+    fprintf(out, "bodyscan_found %lu\n", atomic_load(&found));
+    fprintf(out, "bodyscan_masked %lu\n", atomic_load(&masked));
+    fprintf(out, "bodyscan_aborted %lu\n", atomic_load(&aborted));
+}
@@ -0,0 +1,27 @@
+/*
+ * bodyscan.h - Streaming scan of response bodies for blocked markers
+ */
+#ifndef __BODYSCAN_H__
+#define __BODYSCAN_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define MAX_MARKER_LEN 64
+
+/* What bodyscan_feed found in a run of body bytes */
+#define BODYSCAN_PASS 0         /* No marker */
+#define BODYSCAN_MASKED 1       /* Markers overwritten in place; relay it */
+#define BODYSCAN_ABORT 2        /* A marker; the response must not go on */
+
+typedef struct bodyscan bodyscan_t;
+
+int bodyscan_init(const char *filename, const char *types, int mask);
+bodyscan_t *bodyscan_start(const char *content_type, const char *content_encoding);
+int bodyscan_feed(bodyscan_t *s, char *data, size_t len);
+int bodyscan_marker(bodyscan_t *s);
+void bodyscan_finish(bodyscan_t *s);
+int bodyscan_response(char *response, size_t len);
+void bodyscan_stats(FILE *out);
+
+#endif /* __BODYSCAN_H__ */
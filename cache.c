@@ -0,0 +1,843 @@
+/*
+ * cache.c - Shared web object cache for the concurrent proxy
+ *
+ * Layout: the key space is split across CACHE_SHARDS shards by the top
+ * bits of the hash.  Each shard owns one open-addressing table whose
+ * slots are kept as parallel arrays (control tags, full hashes, object
+ * pointers) so a probe touches one 16-byte tag group and, on a tag hit,
+ * one 8-byte hash before dereferencing anything.
+ *
+ * Control tags: CTRL_EMPTY ends a probe sequence, CTRL_DELETED is a
+ * tombstone, and a full slot stores the low 7 bits of its hash.
+ *
+ * Concurrency: writers take the shard mutex.  Readers take no lock;
+ * they publish the global epoch in a per-thread reader slot for the
+ * duration of a probe.  Anything a writer unlinks (an object or a
+ * replaced table) is retired with the epoch at unlink time and is only
+ * released once no reader that could still see it remains active.
+ *
+ * Compression: with compression on, the body (everything after the
+ * header block) of a compressible response is stored LZ4 compressed and
+ * only the compressed bytes count against the capacity. Content types
+ * that are already compressed (images, audio, video, archives) and
+ * bodies that do not shrink by at least an eighth are kept as is.
+ *
+ * Capacity: cache_resize may change the capacity at any time. Growing
+ * takes effect at once; after shrinking, each insert evicts at most as
+ * much as it adds, and the rest of the excess is left to cache_trim, so
+ * no single request pays for evicting megabytes at once.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "lockprof.h"
+#include "lz4.h"
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CACHE_SHARDS 16
+#define GROUP_WIDTH 16
+#define MIN_SLOTS 64
+#define MAX_READERS 256
+#define EVICT_SAMPLES 8
+#define MIN_COMPRESS 256     /* Smaller bodies are not worth compressing */
+#define WIRE_SLACK 32        /* Room for the Content-Length header we add */
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+typedef struct {
+    size_t nslots;           /* Power of two, multiple of GROUP_WIDTH */
+    size_t live;             /* Full slots */
+    size_t used;             /* Full slots plus tombstones */
+    uint8_t *ctrl;           /* Control tag per slot */
+    uint64_t *hashes;        /* Full hash per slot */
+    cache_obj_t **objs;      /* Object per slot */
+} cache_table_t;
+
+typedef struct {
+    lockprof_t lock;                 /* Serializes writers */
+    _Atomic(cache_table_t *) table;  /* Current table, replaced on rehash */
+    size_t hand;                     /* Eviction sampling position */
+    atomic_ulong hits;               /* Lookup outcomes for this shard */
+    atomic_ulong misses;
+} __attribute__((aligned(64))) cache_shard_t;
+
+typedef struct {
+    atomic_uint_fast64_t epoch;      /* Epoch on entry, 0 when quiescent */
+    atomic_int in_use;               /* Slot owned by a live thread */
+} __attribute__((aligned(64))) reader_t;
+
+typedef struct retired {
+    void *ptr;
+    void (*release)(void *);
+    uint64_t epoch;
+    struct retired *next;
+} retired_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static atomic_size_t cache_capacity;
+static atomic_size_t cache_bytes;
+static int cache_compress;
+
+/* Compression statistics */
+static atomic_ulong compressed_objs;     /* Objects stored compressed */
+static atomic_ulong raw_body_bytes;      /* Their body bytes before ... */
+static atomic_ulong packed_body_bytes;   /* ... and after compression */
+static atomic_ulong decompressions;      /* Hits served from a compressed body */
+static atomic_ulong decompress_ns;       /* Time spent expanding them */
+static atomic_ulong hits_served;         /* Hits written by cache_write */
+static atomic_ulong hit_write_ns;        /* Time spent in cache_write */
+
+static reader_t readers[MAX_READERS];
+static atomic_uint_fast64_t global_epoch = 1;
+static __thread int reader_slot = -1;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static lockstat_t shard_stat = LOCKSTAT_INITIALIZER("cache_shard");
+static lockstat_t retire_stat = LOCKSTAT_INITIALIZER("cache_retire");
+static lockprof_t retire_lock = LOCKPROF_INITIALIZER(&retire_stat);
+static retired_t *retire_list;
+
+/*
+ * hash_key - FNV-1a over the key followed by a 64-bit finalizer so that
+ * the top bits (shard) and bottom bits (tag, group) are both well mixed.
+ */
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline cache_shard_t *shard_of(uint64_t h) { return &shards[h >> 60]; }
+static inline size_t hash_group(uint64_t h) { return (size_t)(h >> 7); }
+static inline uint8_t hash_tag(uint64_t h) { return (uint8_t)(h & 0x7f); }
+
+/*
+ * cache_tick - Coarse millisecond clock used as the LRU access stamp.
+ */
+static uint64_t cache_tick(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned long elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000UL + end->tv_nsec - start->tv_nsec;
+}
+
+/*
+ * group_match - Bitmask of the slots in a 16-slot group whose control
+ * tag equals tag.
+ */
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    unsigned mask = 0;
+
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (__atomic_load_n(&ctrl[i], __ATOMIC_RELAXED) == tag)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/*
+ * group_match_free - Bitmask of empty or deleted slots in a group. Both
+ * have the high bit set, which full slots never do.
+ */
+static inline unsigned group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return (unsigned)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    unsigned mask = 0;
+
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (__atomic_load_n(&ctrl[i], __ATOMIC_RELAXED) & 0x80)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/******************************
+ * Epoch-based reclamation
+ ******************************/
+
+static void reader_unregister(void *arg) {
+    int slot = (int)(intptr_t)arg - 1;
+
+    atomic_store(&readers[slot].epoch, 0);
+    atomic_store(&readers[slot].in_use, 0);
+}
+
+static void reader_key_init(void) {
+    pthread_key_create(&reader_key, reader_unregister);
+}
+
+/*
+ * reader_register - Claim a reader slot for the calling thread. The slot
+ * is returned automatically when the thread exits. Returns -1 if every
+ * slot is taken, in which case the caller falls back to the shard lock.
+ */
+static int reader_register(void) {
+    pthread_once(&reader_once, reader_key_init);
+    for (int i = 0; i < MAX_READERS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&readers[i].in_use, &expected, 1)) {
+            reader_slot = i;
+            pthread_setspecific(reader_key, (void *)(intptr_t)(i + 1));
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int reader_enter(void) {
+    if (reader_slot < 0 && reader_register() < 0)
+        return -1;
+    atomic_store(&readers[reader_slot].epoch, atomic_load(&global_epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+    return reader_slot;
+}
+
+static void reader_exit(int slot) {
+    atomic_store_explicit(&readers[slot].epoch, 0, memory_order_release);
+}
+
+/*
+ * reclaim - Release every retired pointer that no active reader can
+ * still reference, i.e. those retired before the oldest active epoch.
+ * The scan starts from the current global epoch so that pointers
+ * retired by other writers while we scan are never released early.
+ */
+static void reclaim(void) {
+    uint64_t oldest = atomic_load(&global_epoch);
+    retired_t **pp, *r, *done = NULL;
+
+    for (int i = 0; i < MAX_READERS; i++) {
+        uint64_t e = atomic_load(&readers[i].epoch);
+        if (e && e < oldest)
+            oldest = e;
+    }
+
+    lockprof_lock(&retire_lock);
+    pp = &retire_list;
+    while ((r = *pp) != NULL) {
+        if (r->epoch < oldest) {
+            *pp = r->next;
+            r->next = done;
+            done = r;
+        } else {
+            pp = &r->next;
+        }
+    }
+    lockprof_unlock(&retire_lock);
+
+    while ((r = done) != NULL) {
+        done = r->next;
+        r->release(r->ptr);
+        free(r);
+    }
+}
+
+/*
+ * retire - Defer release of ptr until all readers that might have seen
+ * it have left their read sections. Must be called after ptr has been
+ * unlinked from every table.
+ */
+static void retire(void *ptr, void (*release)(void *)) {
+    retired_t *r = Malloc(sizeof(retired_t));
+
+    r->ptr = ptr;
+    r->release = release;
+    r->epoch = atomic_fetch_add(&global_epoch, 1);
+    lockprof_lock(&retire_lock);
+    r->next = retire_list;
+    retire_list = r;
+    lockprof_unlock(&retire_lock);
+    reclaim();
+}
+
+/******************************
+ * Tables
+ ******************************/
+
+static cache_table_t *table_new(size_t nslots) {
+    cache_table_t *t = Malloc(sizeof(cache_table_t));
+
+    t->nslots = nslots;
+    t->live = t->used = 0;
+    if (!(t->ctrl = aligned_alloc(GROUP_WIDTH, nslots)))
+        unix_error("aligned_alloc error");
+    memset(t->ctrl, CTRL_EMPTY, nslots);
+    t->hashes = Calloc(nslots, sizeof(uint64_t));
+    t->objs = Calloc(nslots, sizeof(cache_obj_t *));
+    return t;
+}
+
+static void table_free(void *p) {
+    cache_table_t *t = p;
+
+    free(t->ctrl);
+    free(t->hashes);
+    free(t->objs);
+    free(t);
+}
+
+/*
+ * table_find - Return the slot holding key and the object found there
+ * in *objp, or -1. Safe to call from a read section concurrently with a
+ * writer on the same table; readers must use *objp rather than reload
+ * the slot, which a writer may have reused since.
+ */
+static ssize_t table_find(cache_table_t *t, const char *key, uint64_t h, cache_obj_t **objp) {
+    size_t mask = t->nslots / GROUP_WIDTH - 1;
+    size_t g = hash_group(h) & mask;
+    uint8_t tag = hash_tag(h);
+
+    for (size_t step = 1; step <= mask + 1; step++) {
+        const uint8_t *ctrl = t->ctrl + g * GROUP_WIDTH;
+        unsigned match = group_match(ctrl, tag);
+
+        atomic_thread_fence(memory_order_acquire);
+        while (match) {
+            size_t s = g * GROUP_WIDTH + __builtin_ctz(match);
+            cache_obj_t *obj;
+
+            match &= match - 1;
+            if (__atomic_load_n(&t->hashes[s], __ATOMIC_RELAXED) != h)
+                continue;
+            obj = __atomic_load_n(&t->objs[s], __ATOMIC_ACQUIRE);
+            if (obj && obj->hash == h && strcmp(obj->key, key) == 0) {
+                *objp = obj;
+                return (ssize_t)s;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY))
+            return -1;
+        g = (g + step) & mask;  /* Triangular probing visits every group */
+    }
+    return -1;
+}
+
+/*
+ * table_find_free - Return the first empty or deleted slot on the probe
+ * sequence for h. The caller guarantees the table is not full.
+ */
+static size_t table_find_free(cache_table_t *t, uint64_t h) {
+    size_t mask = t->nslots / GROUP_WIDTH - 1;
+    size_t g = hash_group(h) & mask;
+
+    for (size_t step = 1; ; step++) {
+        unsigned free_mask = group_match_free(t->ctrl + g * GROUP_WIDTH);
+        if (free_mask)
+            return g * GROUP_WIDTH + __builtin_ctz(free_mask);
+        g = (g + step) & mask;
+    }
+}
+
+/*
+ * table_put - Store obj in a free slot. Writers only. The object pointer
+ * and hash are published before the tag so that a reader that sees the
+ * tag also sees a valid slot.
+ */
+static void table_put(cache_table_t *t, cache_obj_t *obj) {
+    size_t s = table_find_free(t, obj->hash);
+
+    if (t->ctrl[s] == CTRL_EMPTY)
+        t->used++;
+    t->live++;
+    __atomic_store_n(&t->hashes[s], obj->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->objs[s], obj, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->ctrl[s], hash_tag(obj->hash), __ATOMIC_RELEASE);
+}
+
+/*
+ * table_rehash - Replace the shard's table with a fresh one sized for
+ * the live entries, dropping tombstones. The old table is retired.
+ */
+static cache_table_t *table_rehash(cache_shard_t *sh, cache_table_t *old) {
+    size_t nslots = MIN_SLOTS;
+    cache_table_t *t;
+
+    while (nslots * 7 / 8 < (old->live + 1) * 2)
+        nslots <<= 1;
+    t = table_new(nslots);
+    for (size_t s = 0; s < old->nslots; s++)
+        if (!(old->ctrl[s] & 0x80))
+            table_put(t, old->objs[s]);
+    atomic_store_explicit(&sh->table, t, memory_order_release);
+    retire(old, table_free);
+    return t;
+}
+
+/******************************
+ * Objects
+ ******************************/
+
+/*
+ * header_value - Find the named header in the header block hdr and
+ * return a pointer to its value (length in *vlen), or NULL.
+ */
+static const char *header_value(const char *hdr, size_t len, const char *name, size_t *vlen) {
+    size_t nlen = strlen(name);
+    const char *p = hdr, *end = hdr + len, *eol;
+
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        if ((size_t)(eol - p) > nlen && p[nlen] == ':' && strncasecmp(p, name, nlen) == 0) {
+            const char *v = p + nlen + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            *vlen = eol - v;
+            if (*vlen && v[*vlen - 1] == '\r')
+                (*vlen)--;
+            return v;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+/*
+ * header_end - Return the length of the header block at the start of
+ * data, including the blank line, or len if it is never terminated.
+ */
+static size_t header_end(const char *data, size_t len) {
+    for (size_t i = 0; i + 4 <= len; i++)
+        if (data[i] == '\r' && memcmp(data + i, "\r\n\r\n", 4) == 0)
+            return i + 4;
+    return len;
+}
+
+/*
+ * wire_headers - Build the stored header block of a wire image in out:
+ * the status line and end-to-end headers of the origin's header block
+ * hdr, then a Content-Length for the body. Hop-by-hop headers, the
+ * origin's own framing and any Age are dropped since cache_write adds
+ * per-request values. The terminating blank line is left off for the
+ * same reason. out needs len + WIRE_SLACK bytes. Returns bytes written.
+ */
+static size_t wire_headers(const char *hdr, size_t len, size_t body_len, char *out) {
+    static const char *drop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "TE",
+        "Trailer", "Upgrade", "Content-Length", "Age", NULL
+    };
+    const char *p = hdr, *end = hdr + len, *eol;
+    char *op = out;
+    int first = 1, keep = 1;
+
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        eol = eol ? eol + 1 : end;
+        if (*p == '\r' || *p == '\n')
+            break;  /* Blank line ending the block */
+        if (first) {
+            keep = 1;
+            first = 0;
+        } else if (*p != ' ' && *p != '\t') {
+            /* A continuation line shares the fate of the header it extends */
+            size_t nlen = 0;
+            while (p + nlen < eol && p[nlen] != ':')
+                nlen++;
+            keep = 1;
+            for (int i = 0; drop[i]; i++)
+                if (nlen == strlen(drop[i]) && strncasecmp(p, drop[i], nlen) == 0)
+                    keep = 0;
+        }
+        if (keep) {
+            memcpy(op, p, eol - p);
+            op += eol - p;
+            if (op[-1] != '\n') {
+                memcpy(op, "\r\n", 2);
+                op += 2;
+            }
+        }
+        p = eol;
+    }
+    op += sprintf(op, "Content-Length: %zu\r\n", body_len);
+    return op - out;
+}
+
+/*
+ * body_compressible - Decide from the response headers whether a body is
+ * worth compressing: not already content-encoded and not a media or
+ * archive type that LZ4 cannot shrink.
+ */
+static int body_compressible(const char *hdr, size_t len) {
+    static const char *skip[] = {
+        "image/", "audio/", "video/", "font/woff", "application/zip",
+        "application/gzip", "application/x-gzip", "application/x-bzip2",
+        "application/x-xz", "application/zstd", "application/pdf", NULL
+    };
+    const char *type;
+    size_t vlen;
+
+    if (header_value(hdr, len, "Content-Encoding", &vlen))
+        return 0;
+    if (!(type = header_value(hdr, len, "Content-Type", &vlen)))
+        return 1;
+    if (vlen >= 13 && strncasecmp(type, "image/svg+xml", 13) == 0)
+        return 1;
+    for (int i = 0; skip[i]; i++)
+        if (vlen >= strlen(skip[i]) && strncasecmp(type, skip[i], strlen(skip[i])) == 0)
+            return 0;
+    return 1;
+}
+
+static void obj_pin(cache_obj_t *obj) {
+    uint64_t now = cache_tick();
+
+    atomic_fetch_add(&obj->refcnt, 1);
+    if (atomic_load_explicit(&obj->atime, memory_order_relaxed) != now)
+        atomic_store_explicit(&obj->atime, now, memory_order_relaxed);
+}
+
+static void obj_unref(void *p) {
+    cache_release(p);
+}
+
+/*
+ * shard_unlink - Remove the slot holding obj from the shard's table.
+ * Caller holds the shard lock. Returns 1 if obj was present.
+ */
+static int shard_unlink(cache_shard_t *sh, cache_obj_t *obj) {
+    cache_table_t *t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    cache_obj_t *found;
+    ssize_t s = table_find(t, obj->key, obj->hash, &found);
+
+    if (s < 0 || found != obj)
+        return 0;
+    __atomic_store_n(&t->ctrl[s], CTRL_DELETED, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->objs[s], NULL, __ATOMIC_RELEASE);
+    t->live--;
+    atomic_fetch_sub(&cache_bytes, obj->size);
+    return 1;
+}
+
+/*
+ * cache_evict_one - Approximate LRU: sample a few entries from every
+ * shard, then unlink the least recently used sample. Returns the bytes
+ * freed (1 if another thread unlinked the sample first), or 0 if the
+ * cache is empty.
+ */
+static size_t cache_evict_one(void) {
+    size_t freed = 0;
+    cache_obj_t *victim = NULL;
+    uint64_t oldest = UINT64_MAX;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *sh = &shards[i];
+        cache_table_t *t;
+        int seen = 0;
+
+        lockprof_lock(&sh->lock);
+        t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+        for (size_t n = 0; n < t->nslots && seen < EVICT_SAMPLES; n++) {
+            size_t s = (sh->hand + n) & (t->nslots - 1);
+            cache_obj_t *obj = t->objs[s];
+            uint64_t atime;
+
+            if (t->ctrl[s] & 0x80)
+                continue;
+            seen++;
+            atime = atomic_load_explicit(&obj->atime, memory_order_relaxed);
+            if (atime < oldest) {
+                if (victim)
+                    cache_release(victim);
+                atomic_fetch_add(&obj->refcnt, 1);
+                victim = obj;
+                oldest = atime;
+            }
+        }
+        sh->hand += EVICT_SAMPLES;
+        lockprof_unlock(&sh->lock);
+    }
+
+    if (!victim)
+        return 0;
+    cache_shard_t *sh = shard_of(victim->hash);
+    lockprof_lock(&sh->lock);
+    if (shard_unlink(sh, victim)) {
+        retire(victim, obj_unref);
+        freed = victim->size;
+    }
+    lockprof_unlock(&sh->lock);
+    cache_release(victim);
+    return freed ? freed : 1;
+}
+
+/******************************
+ * Public interface
+ ******************************/
+
+/*
+ * cache_init - Set up empty shards for a cache holding at most capacity
+ * bytes of object data, storing compressible bodies LZ4 compressed if
+ * compress is set.
+ */
+void cache_init(size_t capacity, int compress) {
+    atomic_store(&cache_capacity, capacity);
+    cache_compress = compress;
+    atomic_store(&cache_bytes, 0);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        lockprof_init(&shards[i].lock, &shard_stat);
+        atomic_store(&shards[i].table, table_new(MIN_SLOTS));
+        shards[i].hand = 0;
+    }
+}
+
+/*
+ * cache_lookup - Find the object cached under key. On a hit the object
+ * is pinned and must be released with cache_release; returns NULL on a
+ * miss.
+ */
+cache_obj_t *cache_lookup(const char *key) {
+    uint64_t h = hash_key(key);
+    cache_shard_t *sh = shard_of(h);
+    cache_table_t *t;
+    cache_obj_t *obj = NULL;
+    int slot;
+
+    if ((slot = reader_enter()) < 0) {
+        /* No reader slot left: fall back to the writer lock */
+        lockprof_lock(&sh->lock);
+        t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+        if (table_find(t, key, h, &obj) >= 0)
+            obj_pin(obj);
+        lockprof_unlock(&sh->lock);
+        atomic_fetch_add_explicit(obj ? &sh->hits : &sh->misses, 1, memory_order_relaxed);
+        return obj;
+    }
+
+    t = atomic_load_explicit(&sh->table, memory_order_acquire);
+    if (table_find(t, key, h, &obj) >= 0)
+        obj_pin(obj);
+    reader_exit(slot);
+    atomic_fetch_add_explicit(obj ? &sh->hits : &sh->misses, 1, memory_order_relaxed);
+    return obj;
+}
+
+/*
+ * cache_release - Drop a reference to obj, freeing it with the last one.
+ */
+void cache_release(cache_obj_t *obj) {
+    if (atomic_fetch_sub(&obj->refcnt, 1) == 1) {
+        free(obj->key);
+        free(obj->data);
+        free(obj);
+    }
+}
+
+/*
+ * cache_insert - Copy size bytes of data into the cache under key,
+ * replacing any existing entry and evicting least recently used objects
+ * to stay within capacity. flags is a mask of CACHE_* flags. Returns -1
+ * if the object can never fit.
+ */
+int cache_insert(const char *key, const char *data, size_t size, int flags) {
+    cache_obj_t *obj, *old = NULL;
+    cache_shard_t *sh;
+    cache_table_t *t;
+    size_t src_hdr = header_end(data, size), body_len = size - src_hdr, hdr_len, packed = 0, vlen;
+    size_t freed = 0, evicted;
+    const char *body = data + src_hdr;
+    ssize_t s;
+
+    /* A still-chunked body cannot be replayed behind a computed Content-Length */
+    if (!(flags & CACHE_DECHUNKED) && header_value(data, src_hdr, "Transfer-Encoding", &vlen))
+        return -1;
+
+    obj = Malloc(sizeof(cache_obj_t));
+    obj->data = Malloc(src_hdr + WIRE_SLACK + body_len);
+    hdr_len = wire_headers(data, src_hdr, body_len, obj->data);
+    if (cache_compress && body_len >= MIN_COMPRESS && body_compressible(data, src_hdr))
+        packed = lz4_compress(body, body_len, obj->data + hdr_len, body_len / 8 * 7);
+    if (packed) {
+        obj->compressed = 1;
+        obj->size = hdr_len + packed;
+        atomic_fetch_add(&compressed_objs, 1);
+        atomic_fetch_add(&raw_body_bytes, body_len);
+        atomic_fetch_add(&packed_body_bytes, packed);
+    } else {
+        obj->compressed = 0;
+        obj->size = hdr_len + body_len;
+        memcpy(obj->data + hdr_len, body, body_len);
+    }
+    obj->data = Realloc(obj->data, obj->size);
+    obj->length = hdr_len + body_len;
+    obj->hdr_len = hdr_len;
+    obj->created = time(NULL);
+    size = obj->size;
+
+    if (size > atomic_load(&cache_capacity)) {
+        free(obj->data);
+        free(obj);
+        return -1;
+    }
+    obj->key = strdup(key);
+    obj->hash = hash_key(key);
+    atomic_init(&obj->refcnt, 1);
+    atomic_init(&obj->atime, cache_tick());
+    atomic_init(&obj->prefetched, (flags & CACHE_PREFETCHED) != 0);
+
+    atomic_fetch_add(&cache_bytes, size);
+    while (freed < size && atomic_load(&cache_bytes) > atomic_load(&cache_capacity)
+           && (evicted = cache_evict_one()) != 0)
+        freed += evicted;
+
+    sh = shard_of(obj->hash);
+    lockprof_lock(&sh->lock);
+    t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    if ((s = table_find(t, key, obj->hash, &old)) >= 0) {
+        __atomic_store_n(&t->objs[s], obj, __ATOMIC_RELEASE);
+        atomic_fetch_sub(&cache_bytes, old->size);
+    } else {
+        if ((t->used + 1) * 8 > t->nslots * 7)
+            t = table_rehash(sh, t);
+        table_put(t, obj);
+    }
+    lockprof_unlock(&sh->lock);
+
+    if (old)
+        retire(old, obj_unref);
+    return 0;
+}
+
+/*
+ * writev_all - writev that retries after short writes and EINTR.
+ */
+static ssize_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0, n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/*
+ * cache_write - Send the response held in obj to fd with one gathered
+ * write: the stored status line and headers, the per-request headers
+ * (Age, Connection) and the blank line, then the body, which is first
+ * expanded into a temporary buffer if stored compressed. Returns the
+ * number of bytes sent, or -1 on a write or decompression error.
+ */
+ssize_t cache_write(int fd, cache_obj_t *obj) {
+    struct timespec start, end;
+    struct iovec iov[3];
+    char patch[64], *body = obj->data + obj->hdr_len, *buf = NULL;
+    size_t body_len = obj->length - obj->hdr_len;
+    ssize_t n;
+    int plen;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (obj->compressed) {
+        buf = Malloc(body_len);
+        n = lz4_decompress(body, obj->size - obj->hdr_len, buf, body_len);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        atomic_fetch_add_explicit(&decompressions, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&decompress_ns, elapsed_ns(&start, &end), memory_order_relaxed);
+        if (n != (ssize_t)body_len) {
+            free(buf);
+            return -1;
+        }
+        body = buf;
+    }
+
+    plen = snprintf(patch, sizeof(patch), "Age: %ld\r\nConnection: close\r\n\r\n",
+                    (long)(time(NULL) - obj->created));
+    iov[0].iov_base = obj->data;
+    iov[0].iov_len = obj->hdr_len;
+    iov[1].iov_base = patch;
+    iov[1].iov_len = plen;
+    iov[2].iov_base = body;
+    iov[2].iov_len = body_len;
+    n = writev_all(fd, iov, 3);
+    free(buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atomic_fetch_add_explicit(&hits_served, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hit_write_ns, elapsed_ns(&start, &end), memory_order_relaxed);
+    return n;
+}
+
+/*
+ * cache_resize - Change the capacity. Growing is immediate; shrinking
+ * leaves the excess for inserts and cache_trim to evict.
+ */
+void cache_resize(size_t capacity) {
+    atomic_store(&cache_capacity, capacity);
+}
+
+/*
+ * cache_trim - Evict up to max least recently used objects while the
+ * cache holds more than its capacity. Returns the number evicted.
+ */
+int cache_trim(int max) {
+    int n = 0;
+
+    while (n < max && atomic_load(&cache_bytes) > atomic_load(&cache_capacity) && cache_evict_one())
+        n++;
+    return n;
+}
+
+/*
+ * cache_used - Bytes of object data the cache holds.
+ */
+size_t cache_used(void) {
+    return atomic_load(&cache_bytes);
+}
+
+/*
+ * cache_stats - Print cache counters as "name value" lines.
+ */
+void cache_stats(FILE *out) {
+    unsigned long hits = 0, misses = 0;
+    unsigned long raw = atomic_load(&raw_body_bytes), packed = atomic_load(&packed_body_bytes);
+    unsigned long ndecomp = atomic_load(&decompressions), nserved = atomic_load(&hits_served);
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        hits += atomic_load(&shards[i].hits);
+        misses += atomic_load(&shards[i].misses);
+    }
+    fprintf(out, "cache_capacity %zu\n", atomic_load(&cache_capacity));
+    fprintf(out, "cache_bytes %zu\n", atomic_load(&cache_bytes));
+    fprintf(out, "cache_hits %lu\n", hits);
+    fprintf(out, "cache_misses %lu\n", misses);
+    fprintf(out, "cache_hit_ratio %.4f\n", hits + misses ? (double)hits / (hits + misses) : 0.0);
+    fprintf(out, "cache_compress %d\n", cache_compress);
+    fprintf(out, "cache_compressed_objects %lu\n", atomic_load(&compressed_objs));
+    fprintf(out, "cache_compression_ratio %.3f\n", packed ? (double)raw / packed : 1.0);
+    fprintf(out, "cache_decompress_ns_per_hit %lu\n", ndecomp ? atomic_load(&decompress_ns) / ndecomp : 0);
+    fprintf(out, "cache_hit_write_ns %lu\n", nserved ? atomic_load(&hit_write_ns) / nserved : 0);
+}
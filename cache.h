@@ -0,0 +1,56 @@
+/*
+ * cache.h - Shared web object cache for the concurrent proxy
+ *
+ * The index is a sharded open-addressing hash table in the style of a
+ * Swiss table: every slot has a one-byte control tag, and tags are
+ * probed sixteen at a time (with SSE2 where available).  Lookups never
+ * take a lock; they run inside an epoch-protected read section so that
+ * writers, which are serialized per shard, can safely retire objects
+ * and tables while readers are still probing them.
+ *
+ * Objects are stored as ready-to-send wire images: the status line and
+ * filtered headers with a computed Content-Length, followed by the body.
+ * When compression is enabled, bodies of compressible content types are
+ * stored LZ4 compressed and expanded again by cache_write on each hit.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <stdatomic.h>
+
+/* A cached web object.  Objects returned by cache_lookup are pinned
+ * and must be handed back with cache_release once sent. */
+typedef struct cache_obj {
+    char *key;                   /* Request URI */
+    char *data;                  /* Status line and headers, then the body */
+    size_t size;                 /* Bytes held in data */
+    size_t length;               /* Header and body bytes data encodes */
+    size_t hdr_len;              /* Header bytes, without the blank line */
+    int compressed;              /* Body is LZ4 compressed */
+    time_t created;              /* Insertion time, for the Age header */
+    uint64_t hash;               /* Hash of key */
+    atomic_int refcnt;           /* One for the cache, one per reader */
+    atomic_uint_fast64_t atime;  /* Access tick for approximate LRU */
+    atomic_int prefetched;       /* Prefetched and not yet requested */
+} cache_obj_t;
+
+/* cache_insert flags */
+#define CACHE_PREFETCHED 0x1     /* Inserted by the prefetcher */
+#define CACHE_DECHUNKED 0x2      /* Body was chunked and has been decoded */
+
+void cache_init(size_t capacity, int compress);
+cache_obj_t *cache_lookup(const char *key);
+void cache_release(cache_obj_t *obj);
+int cache_insert(const char *key, const char *data, size_t size, int flags);
+ssize_t cache_write(int fd, cache_obj_t *obj);
+void cache_resize(size_t capacity);
+int cache_trim(int max);
+size_t cache_used(void);
+void cache_stats(FILE *out);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,170 @@
+/*
+ * cachebench.c - Measure cache lookup throughput
+ *
+ * usage: cachebench [-n keys] [-s seconds] [-t threads,...]
+ *
+ * Fills the cache (cache.c) with keys small objects, then for each
+ * thread count runs that many threads doing lookups of random keys (and
+ * releasing the objects, as the proxy does) for the given number of
+ * seconds, and prints lookups per second. Where the kernel lets the
+ * process count hardware events (perf_event_paranoid 2 or lower, on a
+ * machine with a PMU) it also prints last-level cache misses per
+ * lookup, counted in user space over all the lookup threads; otherwise
+ * that column reads "-".
+ *
+ *   -n keys     objects in the cache (default 1000000)
+ *   -s seconds  time per thread count (default 2)
+ *   -t threads  comma-separated thread counts (default 1,2,4,8,16,32)
+ *
+ * Keys look like request URIs and are formatted on the fly rather than
+ * read from a table, so the misses counted are the cache's own.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MAX_THREADS 256
+#define BODY_SIZE 64
+
+static const char *object_head = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+static unsigned long nkeys = 1000000;
+static atomic_int running;
+static atomic_ulong total;
+
+static int format_key(char *buf, size_t len, unsigned long i) {
+    return snprintf(buf, len, "http://host%lu.example.com/objects/%lu.txt", i % 1024, i);
+}
+
+/*
+ * lookup_thread - Look up random keys until running is cleared, then
+ * add the number done to total.
+ */
+static void *lookup_thread(void *vargp) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL * ((uintptr_t)vargp + 1);
+    unsigned long done = 0;
+    cache_obj_t *obj;
+    char key[MAXLINE];
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        for (int i = 0; i < 256; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            format_key(key, sizeof(key), x % nkeys);
+            if ((obj = cache_lookup(key)) != NULL)
+                cache_release(obj);
+        }
+        done += 256;
+    }
+    atomic_fetch_add(&total, done);
+    return NULL;
+}
+
+/*
+ * open_llc_counter - Count last-level cache misses of this process and
+ * the threads it starts from now on, in user space. Returns the counter
+ * descriptor, or -1 if the kernel does not allow it.
+ */
+static int open_llc_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * run - Run threads lookup threads for seconds and print the result.
+ */
+static void run(int threads, int seconds) {
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+    unsigned long long misses = 0;
+    double elapsed;
+    int fd = open_llc_counter();
+
+    atomic_store(&total, 0);
+    atomic_store(&running, 1);
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < threads; i++)
+        Pthread_create(&tids[i], NULL, lookup_thread, (void *)i);
+    sleep(seconds);
+    atomic_store(&running, 0);
+    for (int i = 0; i < threads; i++)
+        Pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            fd = -1;
+    }
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%7d %14.0f", threads, atomic_load(&total) / elapsed);
+    if (fd >= 0) {
+        printf(" %14.2f\n", (double)misses / atomic_load(&total));
+        close(fd);
+    } else {
+        printf(" %14s\n", "-");
+    }
+}
+
+int main(int argc, char **argv) {
+    char key[MAXLINE], object[256], *list = "1,2,4,8,16,32", *p;
+    int opt, seconds = 2, threads, len;
+    struct timespec start, end;
+
+    while ((opt = getopt(argc, argv, "n:s:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nkeys = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 't':
+            list = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n keys] [-s seconds] [-t threads,...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nkeys == 0 || seconds <= 0) {
+        fprintf(stderr, "%s: keys and seconds must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    /* Room for every object, so nothing is evicted while filling */
+    len = snprintf(object, sizeof(object), "%s", object_head);
+    memset(object + len, 'x', BODY_SIZE);
+    cache_init((size_t)-1 / 2, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < nkeys; i++) {
+        format_key(key, sizeof(key), i);
+        cache_insert(key, object, len + BODY_SIZE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%lu keys inserted in %.2f s, %zu bytes cached\n", nkeys,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, cache_used());
+
+    printf("%7s %14s %14s\n", "threads", "lookups/s", "llc_miss/op");
+    for (p = list; *p; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        threads = atoi(p);
+        if (threads > 0 && threads <= MAX_THREADS)
+            run(threads, seconds);
+    }
+    return 0;
+}
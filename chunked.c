@@ -0,0 +1,210 @@
+/*
+ * chunked.c - Incremental HTTP/1.1 chunked transfer-coding decoder and
+ * chunk framing for the concurrent proxy
+ *
+ * The decoder is a byte-level state machine over the framing only: it
+ * accepts input split at any boundary, keeps its place in a chunked_t
+ * between calls, and hands chunk payloads to a sink as pointers into the
+ * caller's buffer, so payload bytes are never copied by the decoder.
+ * Chunk extensions and trailer fields are consumed and discarded. Bare
+ * LF line endings are accepted as well as CRLF.
+ */
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include "chunked.h"
+
+#define MAX_SIZE_DIGITS 15    /* Keeps chunk sizes well inside 64 bits */
+
+enum {
+    SIZE,           /* Hex digits of a chunk size */
+    EXT,            /* Rest of the size line: extensions, up to LF */
+    SIZE_LF,        /* LF ending the size line */
+    DATA,           /* Chunk payload */
+    DATA_CR,        /* CR after the payload */
+    DATA_LF,        /* LF after the payload */
+    TRAILER,        /* Start of a trailer line, or the final blank line */
+    TRAILER_LINE,   /* Rest of a trailer field, up to LF */
+    TRAILER_LF,     /* LF of the final blank line */
+    DONE,           /* Message body complete */
+    FAILED          /* Malformed framing */
+};
+
+/*
+ * hexval - Value of a hex digit, or -1.
+ */
+static int hexval(char ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * chunked_init - Prepare c to decode a new body.
+ */
+void chunked_init(chunked_t *c) {
+    c->state = SIZE;
+    c->digits = 0;
+    c->left = 0;
+    c->body = 0;
+}
+
+/*
+ * size_line_end - The size line is complete: start the payload, or the
+ * trailer section after the last (zero-size) chunk.
+ */
+static void size_line_end(chunked_t *c) {
+    c->state = c->left ? DATA : TRAILER;
+}
+
+/*
+ * chunked_decode - Decode len bytes of chunked body from in, passing
+ * each run of payload to sink. Returns the bytes consumed, which is len
+ * unless the body ends (or turns out malformed) partway through; bytes
+ * after the end of the body are left alone.
+ */
+size_t chunked_decode(chunked_t *c, const char *in, size_t len, chunked_sink_t sink, void *arg) {
+    const char *p = in, *end = in + len, *eol;
+    size_t run;
+    int v;
+
+    while (p < end) {
+        switch (c->state) {
+        case SIZE:
+            if ((v = hexval(*p)) >= 0) {
+                if (++c->digits > MAX_SIZE_DIGITS) {
+                    c->state = FAILED;
+                    break;
+                }
+                c->left = c->left << 4 | v;
+            } else if (c->digits == 0) {
+                c->state = FAILED;
+                break;
+            } else if (*p == '\r') {
+                c->state = SIZE_LF;
+            } else if (*p == '\n') {
+                size_line_end(c);
+            } else if (*p == ';' || *p == ' ' || *p == '\t') {
+                c->state = EXT;
+            } else {
+                c->state = FAILED;
+                break;
+            }
+            p++;
+            break;
+
+        case EXT:
+            if (!(eol = memchr(p, '\n', end - p))) {
+                p = end;
+                break;
+            }
+            p = eol + 1;
+            size_line_end(c);
+            break;
+
+        case SIZE_LF:
+            if (*p++ != '\n') {
+                c->state = FAILED;
+                break;
+            }
+            size_line_end(c);
+            break;
+
+        case DATA:
+            run = (size_t)(end - p) < c->left ? (size_t)(end - p) : c->left;
+            sink(arg, p, run);
+            p += run;
+            c->body += run;
+            if ((c->left -= run) == 0)
+                c->state = DATA_CR;
+            break;
+
+        case DATA_CR:
+        case DATA_LF:
+            if (*p == '\r' && c->state == DATA_CR) {
+                c->state = DATA_LF;
+            } else if (*p == '\n') {
+                c->state = SIZE;
+                c->digits = 0;
+            } else {
+                c->state = FAILED;
+                break;
+            }
+            p++;
+            break;
+
+        case TRAILER:
+            if (*p == '\r')
+                c->state = TRAILER_LF;
+            else if (*p == '\n')
+                c->state = DONE;
+            else
+                c->state = TRAILER_LINE;
+            p++;
+            break;
+
+        case TRAILER_LINE:
+            if (!(eol = memchr(p, '\n', end - p))) {
+                p = end;
+                break;
+            }
+            p = eol + 1;
+            c->state = TRAILER;
+            break;
+
+        case TRAILER_LF:
+            c->state = *p++ == '\n' ? DONE : FAILED;
+            break;
+
+        default:
+            return p - in;  /* DONE or FAILED: consume no more */
+        }
+        if (c->state == FAILED)
+            return p - in;
+    }
+    return p - in;
+}
+
+/*
+ * chunked_done - Returns 1 once the whole body, trailers included, has
+ * been decoded.
+ */
+int chunked_done(const chunked_t *c) {
+    return c->state == DONE;
+}
+
+/*
+ * chunked_failed - Returns 1 if the framing was malformed.
+ */
+int chunked_failed(const chunked_t *c) {
+    return c->state == FAILED;
+}
+
+/*
+ * chunked_coding - Whether a Transfer-Encoding value, a comma-separated
+ * list of codings, ends with chunked. Only then does chunked framing
+ * delimit the message ("gzip, chunked" does; "chunked, gzip" does not).
+ */
+int chunked_coding(const char *value) {
+    const char *last = strrchr(value, ',');
+
+    last = last ? last + 1 : value;
+    last += strspn(last, " \t");
+    if (strncasecmp(last, "chunked", 7) != 0)
+        return 0;
+    last += 7;
+    return last[strspn(last, " \t\r\n")] == '\0';
+}
+
+/*
+ * chunked_header - Write the size line framing a chunk of len payload
+ * bytes into dst (at least CHUNKED_HEADER_MAX bytes). The payload and a
+ * CRLF follow it on the wire. Returns the length written.
+ */
+size_t chunked_header(char *dst, size_t len) {
+    return sprintf(dst, "%zx\r\n", len);
+}
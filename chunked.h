@@ -0,0 +1,31 @@
+/*
+ * chunked.h - Incremental HTTP/1.1 chunked transfer-coding decoder and
+ * chunk framing for the concurrent proxy
+ */
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Receives each run of payload bytes, pointing into the caller's input */
+typedef void (*chunked_sink_t)(void *arg, const char *data, size_t len);
+
+typedef struct {
+    int state;          /* Where in the framing the decoder stands */
+    int digits;         /* Hex digits read of the current size line */
+    uint64_t left;      /* Size, then payload bytes left, of the current chunk */
+    uint64_t body;      /* Payload bytes decoded so far */
+} chunked_t;
+
+void chunked_init(chunked_t *c);
+size_t chunked_decode(chunked_t *c, const char *in, size_t len, chunked_sink_t sink, void *arg);
+int chunked_done(const chunked_t *c);
+int chunked_failed(const chunked_t *c);
+int chunked_coding(const char *value);
+size_t chunked_header(char *dst, size_t len);
+
+#define CHUNKED_HEADER_MAX 20       /* Room chunked_header needs */
+#define CHUNKED_LAST "0\r\n\r\n"     /* Last chunk with no trailers */
+
+#endif /* __CHUNKED_H__ */
@@ -0,0 +1,301 @@
+/*
+ * chunkfuzz.c - Fuzz and time the chunked decoder
+ *
+ * usage: chunkfuzz [-n iterations] [-r seed] [-s seconds] [-c sizes,...]
+ *
+ * Fuzzing (-n iterations, default 100000) builds random chunked bodies
+ * with chunked_header: chunk sizes from 1 byte to 64 KB, extensions,
+ * bare LF line endings, trailers and bytes after the end of the body.
+ * Half of them are then damaged (bytes flipped, inserted or removed).
+ * Each body is decoded in one call and again split at random points, and
+ * the two runs must agree on the bytes consumed, the payload delivered
+ * and whether the body ended or failed; every payload run must point
+ * inside the input. Undamaged bodies must also decode to exactly the
+ * payload they were built from, ending where the framing ends. The
+ * first disagreement is printed with its seed and the run stops with
+ * status 1. Building with CFLAGS="-g -fsanitize=address,undefined"
+ * checks memory accesses as well.
+ *
+ * Timing (-s seconds per size, default 1) then decodes a 64 MB body cut
+ * into chunks of each of the comma-separated sizes (default
+ * 16,256,4096,65536) over and over, in 64 KB reads whose payload is
+ * copied out as the proxy's dechunking filter does, and prints the
+ * input and payload decoded per second.
+ */
+#include "csapp.h"
+#include "chunked.h"
+#include <stdint.h>
+
+#define MAX_CHUNK 65536
+#define MAX_BODY (8 * MAX_CHUNK)
+#define BENCH_BODY (64 << 20)
+
+typedef struct {
+    const char *in, *end;   /* Input, so runs can be checked against it */
+    char *out;              /* Payload delivered */
+    size_t len, size;
+    int stray;              /* A run pointed outside the input */
+} collect_t;
+
+typedef struct {
+    size_t used;            /* Bytes consumed */
+    int done, failed;
+} result_t;
+
+static uint64_t rng;
+
+static uint64_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static size_t below(size_t n) {
+    return next() % n;
+}
+
+static void collect(void *arg, const char *data, size_t len) {
+    collect_t *c = arg;
+
+    if (data < c->in || data + len > c->end) {
+        c->stray = 1;
+        return;
+    }
+    if (c->len + len > c->size)
+        c->out = realloc(c->out, c->size = 2 * (c->len + len));
+    memcpy(c->out + c->len, data, len);
+    c->len += len;
+}
+
+/* Appends payload to a buffer of one read's size, as the proxy's
+ * dechunking filter does when relaying to an HTTP/1.0 client */
+typedef struct {
+    char *out;
+    size_t len;
+} append_t;
+
+static void append(void *arg, const char *data, size_t len) {
+    append_t *a = arg;
+
+    memcpy(a->out + a->len, data, len);
+    a->len += len;
+}
+
+/*
+ * build - Frame random payload into buf; returns the framed length. The
+ * payload goes to payload (*plen bytes).
+ */
+static size_t build(char *buf, char *payload, size_t *plen) {
+    size_t n = 0, len, chunks = below(8);
+    const char *eol = "\r\n";
+
+    *plen = 0;
+    for (size_t i = 0; ; i++) {
+        len = i == chunks ? 0 : below(4) ? 1 + below(64) : 1 + below(MAX_CHUNK);
+        if (n + len + 64 > MAX_BODY)
+            len = 0;
+        eol = below(8) ? "\r\n" : "\n";
+        n += chunked_header(buf + n, len);
+        if (below(8)) {
+            n -= 2;  /* Swap the CRLF for an extension and our line ending */
+            n += sprintf(buf + n, "%s", below(2) ? ";name=value" : " ;x");
+            n += sprintf(buf + n, "%s", eol);
+        } else if (eol[0] == '\n') {
+            buf[n - 2] = '\n';
+            n--;
+        }
+        for (size_t j = 0; j < len; j++)
+            payload[*plen + j] = buf[n + j] = next();
+        *plen += len;
+        n += len;
+        if (len == 0)
+            break;  /* That was the last chunk */
+        n += sprintf(buf + n, "%s", eol);
+    }
+    if (below(4))
+        n += sprintf(buf + n, "X-Trailer: %d%s", (int)below(1000), eol);
+    n += sprintf(buf + n, "%s", eol);
+    return n;
+}
+
+/*
+ * damage - Flip, insert or remove a few random bytes of buf.
+ */
+static size_t damage(char *buf, size_t n) {
+    static const char interesting[] = "\r\n;0123456789abcdefABCDEF \t";
+    char ch;
+
+    for (int k = 1 + below(4); k > 0 && n > 0; k--) {
+        size_t at = below(n);
+        ch = below(2) ? interesting[below(sizeof(interesting) - 1)] : (char)next();
+        switch (below(3)) {
+        case 0:
+            buf[at] = ch;
+            break;
+        case 1:
+            if (n < MAX_BODY) {
+                memmove(buf + at + 1, buf + at, n - at);
+                buf[at] = ch;
+                n++;
+            }
+            break;
+        default:
+            memmove(buf + at, buf + at + 1, n - at - 1);
+            n--;
+        }
+    }
+    return n;
+}
+
+/*
+ * decode - Decode buf into out, splitting the input at random points if
+ * split is set, the way reads from a socket would.
+ */
+static result_t decode(const char *buf, size_t n, int split, collect_t *out) {
+    chunked_t c;
+    result_t r = { 0, 0, 0 };
+    size_t piece, got;
+
+    chunked_init(&c);
+    out->in = buf;
+    out->end = buf + n;
+    out->len = 0;
+    out->stray = 0;
+    while (r.used < n) {
+        piece = split ? 1 + below(below(2) ? 8 : n - r.used) : n - r.used;
+        if (piece > n - r.used)
+            piece = n - r.used;
+        got = chunked_decode(&c, buf + r.used, piece, collect, out);
+        r.used += got;
+        if (chunked_done(&c) || chunked_failed(&c) || got < piece)
+            break;
+    }
+    r.done = chunked_done(&c);
+    r.failed = chunked_failed(&c);
+    return r;
+}
+
+static int fuzz_one(uint64_t seed, char *buf, char *payload) {
+    collect_t whole = { 0 }, split = { 0 };
+    result_t a, b;
+    size_t n, framed, plen;
+    int damaged, ok = 1;
+
+    rng = seed ? seed : 1;
+    framed = n = build(buf, payload, &plen);
+    for (size_t k = below(16); k > 0; k--)
+        buf[n++] = 'A' + below(26);  /* The next response, pipelined */
+    if ((damaged = below(2)))
+        n = damage(buf, n);
+
+    a = decode(buf, n, 0, &whole);
+    b = decode(buf, n, 1, &split);
+    if (a.used != b.used || a.done != b.done || a.failed != b.failed || whole.len != split.len ||
+        (whole.len && memcmp(whole.out, split.out, whole.len) != 0)) {
+        printf("seed %#llx: one call consumed %zu (done %d failed %d, %zu payload), "
+               "split consumed %zu (done %d failed %d, %zu payload)\n", (unsigned long long)seed,
+               a.used, a.done, a.failed, whole.len, b.used, b.done, b.failed, split.len);
+        ok = 0;
+    } else if (whole.stray || split.stray) {
+        printf("seed %#llx: payload run outside the input\n", (unsigned long long)seed);
+        ok = 0;
+    } else if (!damaged && (!a.done || a.used != framed || whole.len != plen ||
+                            (plen && memcmp(whole.out, payload, plen) != 0))) {
+        printf("seed %#llx: valid body of %zu bytes (%zu payload) decoded to %zu consumed, "
+               "%zu payload, done %d\n", (unsigned long long)seed, framed, plen, a.used, whole.len, a.done);
+        ok = 0;
+    }
+    free(whole.out);
+    free(split.out);
+    return ok;
+}
+
+/*
+ * bench - Decode a BENCH_BODY byte body in chunks of size bytes for
+ * seconds and print the rate.
+ */
+static void bench(size_t size, int seconds) {
+    char *buf = malloc(BENCH_BODY + (BENCH_BODY / size + 1) * (CHUNKED_HEADER_MAX + 2) + 64);
+    size_t n = 0, len, sunk = 0, rounds = 0;
+    append_t a = { malloc(MAX_CHUNK), 0 };
+    struct timespec start, now;
+    double elapsed;
+    chunked_t c;
+
+    for (size_t left = BENCH_BODY; left > 0; left -= len) {
+        len = left < size ? left : size;
+        n += chunked_header(buf + n, len);
+        memset(buf + n, 'x', len);
+        n += len;
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+    }
+    n += sprintf(buf + n, CHUNKED_LAST);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        /* In 64 KB reads, as relayed from a socket */
+        chunked_init(&c);
+        for (size_t off = 0; off < n; off += MAX_CHUNK) {
+            a.len = 0;
+            chunked_decode(&c, buf + off, n - off < MAX_CHUNK ? n - off : MAX_CHUNK, append, &a);
+            sunk += a.len;
+        }
+        if (!chunked_done(&c)) {
+            fprintf(stderr, "chunk size %zu: body did not decode\n", size);
+            exit(1);
+        }
+        rounds++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (elapsed < seconds);
+
+    printf("%10zu %12.2f %12.2f\n", size, rounds * n / elapsed / 1e9, sunk / elapsed / 1e9);
+    free(a.out);
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    char *buf = malloc(MAX_BODY + 64), *payload = malloc(MAX_BODY), *list = "16,256,4096,65536", *p;
+    unsigned long iterations = 100000;
+    uint64_t seed = time(NULL);
+    int opt, seconds = 1;
+
+    while ((opt = getopt(argc, argv, "n:r:s:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'c':
+            list = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-r seed] [-s seconds] [-c sizes,...]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    /* Each body gets its own seed, so a failure can be replayed with -n 1 -r */
+    for (unsigned long i = 0; i < iterations; i++) {
+        if (!fuzz_one(seed + i * 0x9e3779b97f4a7c15ULL, buf, payload))
+            exit(1);
+    }
+    printf("%lu bodies decoded consistently (seed %#llx)\n", iterations, (unsigned long long)seed);
+
+    if (seconds > 0) {
+        printf("%10s %12s %12s\n", "chunk", "input GB/s", "payload GB/s");
+        for (p = list; *p; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ','))
+            if (atoi(p) > 0)
+                bench(atoi(p), seconds);
+    }
+    free(buf);
+    free(payload);
+    return 0;
+}
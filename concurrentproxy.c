@@ -4,60 +4,199 @@
  * TEAM MEMBERS:
  *     Mustafa Ali, eldmema0@sewanee.edu
  *
- * This concurrent web proxy server efficiently handles multiple HTTP GET requests simultaneously by managing each connection in a separate thread. 
+ * This concurrent web proxy server efficiently handles multiple HTTP requests simultaneously by managing each connection in a separate thread. 
  * It forwards requests to the intended servers unless the URLs are on a blocklist.
  * The proxy is compatible with HTTP/1.0 standards and seamlessly converts HTTP/1.1 requests from clients to HTTP/1.0 before forwarding them to the server.
  * Additionally, it maintains a log file to record each request, providing insights for monitoring and debugging purposes.
+ * Successful GET responses up to MAX_OBJECT_SIZE are kept in a shared in-memory cache (see cache.c) and served from it on repeat requests.
+ * The cache is sized to the cgroup memory limit and shrinks and grows with memory pressure (see memwatch.c).
+ * Optionally, links found in cached HTML pages are prefetched into the cache in the background (see prefetch.c).
+ * GET and HEAD are supported along with POST, PUT, PATCH and DELETE, whose request bodies are streamed to the server and never cached.
+ * CONNECT opens a byte tunnel to the requested host:port, e.g. for HTTPS.
+ * https:// URIs are fetched over TLS, and origin connections are kept alive in a pool for reuse (see upstream.c).
+ * Instances configured with a peer list fetch cache misses through the fleet member that owns the URI (see peer.c).
+ * Requests for configured domains can be chained through parent proxies, with failover between them (see parent.c).
+ * TCP_INFO is sampled from both sockets of finished requests for the log and per-origin stats (see tcpinfo.c).
+ * Requests over a latency threshold get their stage timeline written to a separate slow log (see slowlog.c).
+ * Response bodies are relayed through a bounded per-connection buffer (see relay.c) so slow clients push back on origins without unbounded memory.
+ * Optional behaviour is controlled from proxy.conf (see config.c), and counters can be read by requesting /proxy-stats from the proxy itself.
  */
 
 #include "csapp.h"
+#include "cache.h"
+#include "chunked.h"
+#include "config.h"
+#include "accesslog.h"
+#include "bodyscan.h"
+#include "lockprof.h"
+#include "memwatch.h"
+#include "parent.h"
+#include "peer.h"
+#include "preconnect.h"
+#include "prefetch.h"
+#include "relay.h"
+#include "rewrite.h"
+#include "sched.h"
+#include "slowlog.h"
+#include "sockopt.h"
+#include "tcpinfo.h"
+#include "upstream.h"
+#include "urlfilter.h"
 #include <pthread.h>
+#include <sys/uio.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-#define MAX_BLOCKLIST 100
+#define MAX_CONNECT_PORTS 16    /* connect_port settings, besides 443 */
+#define MAX_STATS_ALLOW 16      /* stats_allow settings */
 #define LOGFILE "proxy.log"
 
 /* User agent header */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-char blocklist[MAX_BLOCKLIST][MAXLINE];
-int blocklist_count = 0;
 
 typedef struct {
     int connfd;
     struct sockaddr_in clientaddr;
+    struct timespec start;      /* When the request line arrived */
+    access_cpu_t cpu_start;     /* Thread CPU use before proxy() */
+    int sched_class;            /* Priority class holding a slot, or -1 */
+    slowlog_t slow;             /* Stage timeline, for the slow log */
 } thread_args;
 
-pthread_mutex_t log_mutex;
+/* What proxy() keeps about a response while relaying it */
+typedef struct {
+    char *object;             /* Copy for the cache, NULL once it cannot be cached */
+    size_t size;              /* Bytes received from the server */
+    prefetch_scan_t *scan;    /* Link scanner for cacheable HTML, or NULL */
+    int chunked;              /* Body arrives with chunked transfer-coding */
+    int trailing;             /* Bytes followed the last chunk */
+    chunked_t chunks;         /* Decoder for a chunked body */
+    bodyscan_t *markers;      /* Marker scanner for the body, or NULL */
+    upstream_t *up;           /* Server connection, until released */
+    int reusable;             /* It may be pooled once the body is read */
+    int tcp_sampled;          /* Sampled for TCP_INFO stats */
+    int have_up_tcp;          /* up_tcp was read */
+    tcpinfo_t up_tcp;         /* Server socket's TCP_INFO at release */
+    char up_key[UPSTREAM_KEYLEN];   /* Its origin, for the TCP stats */
+} response_t;
+
+/* Where forward_body sends a chunked request body */
+typedef struct {
+    upstream_t *up;           /* Server */
+    int failed;               /* A write to the server failed */
+} upload_t;
+
+lockstat_t log_stat = LOCKSTAT_INITIALIZER("log");
+lockprof_t log_mutex = LOCKPROF_INITIALIZER(&log_stat);
 FILE *log_file = NULL;
+size_t relay_buffer_size;
+int tunnel_idle_ms;
+int connect_ports[MAX_CONNECT_PORTS + 1] = { 443 }, nconnect_ports = 1;
+const char *stats_allow[MAX_STATS_ALLOW] = { "127." };
+int nstats_allow;
+atomic_ulong uploads, upload_bytes, peer_requests, connect_denied;
 
 /*
  * Function prototypes
  */
 int parse_uri(char *uri, char *target_addr, char *path, int *port);
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size);
+void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, long long size);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 void *thread(void *vargp);
 void proxy(thread_args *args);
-void read_blocklist(const char *filename);
 void log_request(char *log_entry);
+int log_mode(const char *name);
+void serve_stats(int fd);
+int stats_allowed(const char *client);
+size_t relay_limit(void);
+int is_blocked(const char *uri);
+int fetch_to_cache(const char *uri);
+upstream_t *open_origin(const char *hostname, int port, int tls, int reuse, parent_t **via);
+void tunnel(thread_args *args, char *authority, rio_t *rio);
+int forward_body(rio_t *rio, int connfd, upstream_t *up, long long length, int chunked);
+void keep_copy(response_t *resp, const char *data, size_t len);
+void take_body(void *arg, const char *data, size_t len);
+void collect_body(relay_t *r, const char *data, size_t len);
+size_t dechunk_body(relay_t *r, const char *in, size_t len, char *out);
+void send_chunk(void *arg, const char *data, size_t len);
+void release_origin(response_t *resp, int reusable);
+void body_read(relay_t *r);
+void sample_tcp(const char *origin, const tcpinfo_t *up, int connfd, char *fields, size_t len);
+void log_access(thread_args *args, char *uri, const char *origin, int status, int outcome, size_t bytes,
+                const char *fields);
 
 int main(int argc, char **argv) {
-    int listenfd, port;
+    const char *peers[MAX_PEERS], *parents[MAX_PARENT_RULES], *rules[MAX_REWRITE_RULES], *bulk_clients[16];
+    const char *ports[MAX_CONNECT_PORTS];
+    int listenfd, port, npeers, nparents, nports;
     socklen_t clientlen;
     pthread_t tid;
     thread_args *args;
     struct sockaddr_in clientaddr;
+    sockopt_profile_t *sp;
 
-    pthread_mutex_init(&log_mutex, NULL);
     log_file = fopen(LOGFILE, "a");
     if (!log_file) {
         fprintf(stderr, "Error opening log file.\n");
         exit(1);
     }
 
-    read_blocklist("blocklist.txt");
+    config_load(CONFIGFILE);
+    lockprof_enable(config_get_bool("lock_profile", 0));
+    urlfilter_load("blocklist.txt");
+    Signal(SIGPIPE, SIG_IGN);
+    cache_init(config_get_long("cache_size", MAX_CACHE_SIZE), config_get_bool("cache_compress", 0));
+    if (config_get_bool("memory_autosize", 1))
+        memwatch_init(config_get_long("cache_size", MAX_CACHE_SIZE), config_get("cache_size", NULL) != NULL,
+                      config_get_long("memory_cache_min", 1 << 20), config_get_long("memory_cache_share", 50),
+                      config_get_long("memory_check_interval", 1), atof(config_get("memory_psi_threshold", "10")),
+                      config_get_bool("memory_host_psi", 0));
+    relay_buffer_size = config_get_long("relay_buffer", 16384);
+    relay_set_splice(config_get_bool("relay_splice", 1));
+    tunnel_idle_ms = config_get_long("tunnel_idle_timeout", 300) * 1000;
+    nports = config_get_all("connect_port", ports, MAX_CONNECT_PORTS);
+    for (int i = 0; i < nports; i++)
+        connect_ports[nconnect_ports++] = atoi(ports[i]);
+    if ((nstats_allow = config_get_all("stats_allow", stats_allow, MAX_STATS_ALLOW)) == 0)
+        nstats_allow = 1;  /* Just the loopback default */
+    tcpinfo_init(config_get_long("tcp_info_sample", 1));
+    accesslog_init(log_request, log_mode(config_get("log_mode", "full")), config_get_long("log_sample", 100),
+                   config_get_long("log_slow_ms", 0), config_get_long("log_interval", 60));
+    slowlog_init(config_get_long("slow_log_ms", 0), config_get("slow_log_file", "slow.log"),
+                 config_get_long("slow_log_queue", 64));
+    sp = sockopt_init(config_get("socket_profile", "default"));
+    sp->nodelay = config_get_bool("socket_nodelay", sp->nodelay);
+    sp->defer_accept = config_get_long("socket_defer_accept", sp->defer_accept);
+    sp->fastopen = config_get_long("socket_fastopen", sp->fastopen);
+    sp->sndbuf = config_get_long("socket_sndbuf", sp->sndbuf);
+    sp->rcvbuf = config_get_long("socket_rcvbuf", sp->rcvbuf);
+    sp->keepalive = config_get_long("socket_keepalive", sp->keepalive);
+    rewrite_init(rules, config_get_all("header_rule", rules, MAX_REWRITE_RULES), user_agent_hdr);
+    sched_init(config_get_long("sched_slots", 0), config_get_long("sched_bulk_share", 50),
+               config_get_long("sched_aging_ms", 200), config_get_long("sched_bulk_bytes", 1 << 20),
+               config_get("sched_interactive_ext", "html,htm,css,js,json,svg,ico,png,gif,jpg,jpeg,webp,woff2"),
+               config_get("sched_bulk_ext", "zip,gz,tgz,xz,bz2,tar,iso,img,bin,dmg,exe,msi,deb,rpm,mp4,mkv,avi,mov"),
+               bulk_clients, config_get_all("sched_bulk_client", bulk_clients, 16));
+    upstream_init(config_get_long("upstream_pool_per_origin", 4), config_get_long("upstream_idle_timeout", 30),
+                  config_get_bool("tls_verify", 1), config_get("tls_ca_file", NULL));
+    // Names are cached only where asked for, or to let preconnect refresh them
+    preconnect_init(config_get_long("dns_cache_ttl", config_get_bool("preconnect", 0) ? 60 : 0),
+                    config_get_bool("preconnect", 0) ? config_get_long("preconnect_origins", 16) : 0,
+                    config_get_long("preconnect_per_origin", 2), config_get_long("preconnect_interval_ms", 1000),
+                    config_get_long("preconnect_idle", 60), config_get("preconnect_seed", NULL));
+    if ((npeers = config_get_all("peer", peers, MAX_PEERS)) > 0)
+        peer_init(config_get("peer_self", ""), peers, npeers, atof(config_get("peer_load_factor", "1.25")),
+                  config_get_long("peer_retry", 10));
+    if ((nparents = config_get_all("parent", parents, MAX_PARENT_RULES)) > 0)
+        parent_init(parents, nparents, config_get_long("parent_retry", 10));
+    if (config_get("body_scan_file", NULL))
+        bodyscan_init(config_get("body_scan_file", NULL),
+                      config_get("body_scan_types", "text/,application/javascript,application/json,application/xml"),
+                      strcasecmp(config_get("body_scan_action", "abort"), "mask") == 0);
+    if (config_get_bool("prefetch", 0))
+        prefetch_init(fetch_to_cache, config_get_long("prefetch_queue", 64), config_get_long("prefetch_per_origin", 8),
+                      config_get_long("prefetch_wait_ms", 1000));
 
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <port>\n", argv[0]);
@@ -67,16 +206,25 @@ int main(int argc, char **argv) {
     char port_str[6];
     sprintf(port_str, "%d", port);
     listenfd = Open_listenfd(port_str);
+    sockopt_listen(listenfd);
 
     while (1) {
         clientlen = sizeof(struct sockaddr_in);
         args = malloc(sizeof(thread_args));
-        args->connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        /* Out of descriptors: back off and let connections finish rather than exit */
+        while ((args->connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            if (errno == EMFILE || errno == ENFILE)
+                usleep(100000);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                unix_error("Accept error");
+            clientlen = sizeof(struct sockaddr_in);
+        }
+        slowlog_accept(&args->slow);
         args->clientaddr = clientaddr;
+        args->sched_class = -1;
         pthread_create(&tid, NULL, thread, args);
     }
     fclose(log_file);
-    pthread_mutex_destroy(&log_mutex);
 }
 
 /*
@@ -86,65 +234,622 @@ int main(int argc, char **argv) {
  * response, and sending that response back to the client. It also logs each processed request.
 */
 void proxy(thread_args *args) {
-    int clientfd, port;
+    int port, tls, status, outcome, reusable, no_body, retry = 0, from_peer = 0, via_peer;
     ssize_t n;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], pathname[MAXLINE], port_str[6];
-    rio_t rio, server_rio;
+    char hostname[MAXLINE], pathname[MAXLINE];
+    char origin[MAXLINE + 16], hdrs[MAXBUF], req[MAXLINE], tcp_fields[MAXLINE] = "";
+    char content_type[128] = "", content_encoding[64] = "";
+    size_t hdrs_len = 0, head_size;
+    ssize_t m;
+    struct iovec iov[3];
+    rewrite_t rw;
+    long long content_length = -1, body_length = -1, length, expected;
+    char client[INET_ADDRSTRLEN];
+    int has_body, chunked = 0, expect_continue = 0, too_large = 0, req_len, client_11;
+    int coded = 0, resp_coded = 0, ambiguous = 0;
+    cache_obj_t *obj;
+    response_t resp = { NULL, 0, NULL, 0, 0 };
+    relay_t relay;
+    upstream_t *up;
+    peer_t *peer = NULL;
+    parent_t *parent = NULL;
+    rio_t rio;
 
     // Initialize RIO for reading from the client
     Rio_readinitb(&rio, args->connfd);
     if (!Rio_readlineb(&rio, buf, MAXLINE)) return; // Read the request line
+    clock_gettime(CLOCK_MONOTONIC, &args->start);
 
     sscanf(buf, "%s %s %s", method, uri, version); // Parse the request line
+    client_11 = strcasecmp(version, "HTTP/1.1") == 0;
+
+    // Requests addressed to the proxy itself rather than an origin
+    if (strcmp(uri, "/proxy-stats") == 0) {
+        inet_ntop(AF_INET, &args->clientaddr.sin_addr, client, sizeof(client));
+        if (stats_allowed(client)) {
+            serve_stats(args->connfd);
+        } else {
+            clienterror(args->connfd, uri, "403", "Forbidden", "Statistics are not available to this client");
+            log_access(args, uri, "", 403, OUTCOME_ERROR, 0, "");
+        }
+        return;
+    }
 
-    // Block non-GET and non-HEAD methods
-    if (strcasecmp(method, "GET") != 0 && strcasecmp(method, "HEAD") != 0) {
+    // Block methods the proxy does not know how to forward
+    if (strcasecmp(method, "GET") != 0 && strcasecmp(method, "HEAD") != 0 &&
+        strcasecmp(method, "POST") != 0 && strcasecmp(method, "PUT") != 0 &&
+        strcasecmp(method, "PATCH") != 0 && strcasecmp(method, "DELETE") != 0 &&
+        strcasecmp(method, "CONNECT") != 0) {
         clienterror(args->connfd, method, "501", "Not Implemented", "This method is not implemented by the proxy");
         return;
     }
+    has_body = strcasecmp(method, "GET") != 0 && strcasecmp(method, "HEAD") != 0 &&
+               strcasecmp(method, "CONNECT") != 0;
+
+    // Read the request headers. Requests that may carry a body forward
+    // the client's end-to-end headers; GET and HEAD go out with the
+    // proxy's own headers only, since their responses may be cached.
+    // Either way the header rules apply as the headers are copied.
+    // A body framed more than one way (Content-Length with
+    // Transfer-Encoding, lengths that disagree, or codings that do not
+    // end in chunked) could be read differently by the origin, so such
+    // requests are refused rather than forwarded.
+    rewrite_start(&rw);
+    while ((n = Rio_readlineb(&rio, buf, MAXLINE)) > 0 && buf[0] != '\r' && buf[0] != '\n') {
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            length = strtoll(buf + 15, NULL, 10);
+            ambiguous |= length < 0 || (content_length >= 0 && length != content_length);
+            content_length = length;
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+            chunked = chunked_coding(buf + 18);
+            coded = 1;
+        } else if (strncasecmp(buf, "Expect:", 7) == 0)
+            expect_continue = strncasecmp(buf + 7 + strspn(buf + 7, " \t"), "100-continue", 12) == 0;
+        else if (strncasecmp(buf, PEER_HEADER ":", sizeof(PEER_HEADER)) == 0)
+            from_peer = 1;
+        if (!has_body || too_large)
+            continue;
+        if ((m = rewrite_header(&rw, buf, n, hdrs + hdrs_len, sizeof(hdrs) - hdrs_len)) < 0)
+            too_large = 1;
+        else
+            hdrs_len += m;
+    }
+    if (!too_large && (m = rewrite_finish(&rw, hdrs + hdrs_len, sizeof(hdrs) - hdrs_len)) >= 0)
+        hdrs_len += m;
+    else
+        too_large = 1;
+    if (too_large) {
+        clienterror(args->connfd, method, "431", "Request Header Fields Too Large", "Request headers are too large to forward");
+        return;
+    }
+    if (ambiguous || (coded && (!chunked || content_length >= 0))) {
+        clienterror(args->connfd, method, "400", "Bad Request", "Request body framing is ambiguous");
+        return;
+    }
+    if (!has_body || (!chunked && content_length <= 0))
+        chunked = content_length = 0;
+    slowlog_mark(SLOW_PARSE);
 
     // Check if the requested URI is on the blocklist
-    for (int i = 0; i < blocklist_count; i++) {
-        if (strstr(uri, blocklist[i]) != NULL) {
-            clienterror(args->connfd, "Blocked", "403", "Forbidden", "This site is blocked by the proxy.");
-            return;
-        }
+    if (is_blocked(uri)) {
+        clienterror(args->connfd, "Blocked", "403", "Forbidden", "This site is blocked by the proxy.");
+        log_access(args, uri, "", 403, OUTCOME_ERROR, 0, "");
+        return;
+    }
+
+    // CONNECT names host:port rather than a URI and becomes a tunnel
+    if (strcasecmp(method, "CONNECT") == 0) {
+        tunnel(args, uri, &rio);
+        return;
     }
 
     // Parse the URI to get hostname and path
-    if (parse_uri(uri, hostname, pathname, &port) < 0) {
+    if ((tls = parse_uri(uri, hostname, pathname, &port)) < 0) {
         clienterror(args->connfd, uri, "400", "Bad Request", "Proxy cannot parse the request");
         return;
     }
 
-    // Connect to the destination server
-    snprintf(port_str, sizeof(port_str), "%d", port);
-    clientfd = Open_clientfd(hostname, port_str);
-    if (clientfd < 0) {
-        clienterror(args->connfd, hostname, "404", "Not found", "Cannot connect to the host");
+    // Wait for a turn by priority class. Whether a request is bulk is
+    // told by its cached object's size, else by its body's, else by the
+    // size of the last response for its URI.
+    obj = strcasecmp(method, "GET") == 0 ? cache_lookup(uri) : NULL;
+    if (!obj && strcasecmp(method, "GET") == 0 && prefetch_claim(uri))
+        obj = cache_lookup(uri);
+    inet_ntop(AF_INET, &args->clientaddr.sin_addr, client, sizeof(client));
+    expected = obj ? (long long)obj->length : content_length > 0 ? content_length : sched_expected(uri);
+    args->sched_class = sched_classify(method, pathname, client, expected);
+    sched_acquire(args->sched_class);
+    slowlog_mark(SLOW_ADMIT);
+
+    // Serve GET requests from the cache when possible
+    if (obj) {
+        prefetch_hit(obj);
+        n = cache_write(args->connfd, obj);
+        cache_release(obj);
+        slowlog_mark(SLOW_RELAY);
+        slowlog_client(args->connfd);
+        snprintf(origin, sizeof(origin), "%s:%d", hostname, port);
+        log_access(args, uri, origin, 200, OUTCOME_HIT, n < 0 ? 0 : n, "");
         return;
     }
+    if (strcasecmp(method, "GET") == 0)
+        resp.object = Malloc(MAX_OBJECT_SIZE);
 
-    // Send the modified request to the server
-    Rio_readinitb(&server_rio, clientfd);
-    snprintf(buf, sizeof(buf), "%s %s HTTP/1.0\r\nHost: %s\r\n", method, pathname[0] ? pathname : "/", hostname);
-    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "User-Agent: %sConnection: close\r\nProxy-Connection: close\r\n\r\n", user_agent_hdr);
-    Rio_writen(clientfd, buf, strlen(buf));
+    // A cache miss for a URI that another member of the fleet owns is
+    // fetched through that peer, which caches it, rather than from the
+    // origin. Requests from peers are always served here.
+    if (resp.object && !from_peer)
+        peer = peer_route(uri);
+    if ((via_peer = peer && !peer->self)) {
+        free(resp.object);
+        resp.object = NULL;
+    }
+    if (from_peer)
+        atomic_fetch_add(&peer_requests, 1);
 
-    // Read the server's response and forward it to the client
-    int size = 0;
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-        Rio_writen(args->connfd, buf, n);
-        size += n;
+    // Send the modified request to the server (or peer) as HTTP/1.1, so
+    // the response may come back chunked and the connection can be kept
+    // for the next request to the same origin. A pooled connection that
+    // the origin has closed meanwhile is replaced by a new one; requests
+    // with a body always get a new connection, as their body cannot be
+    // resent. A peer that cannot be reached, or that fails before any of
+    // its response has been sent on, is skipped for the origin.
+    // Through a parent proxy, plain requests carry the absolute URI.
+    do {
+        up = NULL;
+        if (via_peer && (up = upstream_open(peer->host, peer->port, 0, 1)) == NULL) {
+            peer_release(peer, 0);
+            peer = NULL;
+            via_peer = 0;
+            resp.object = Malloc(MAX_OBJECT_SIZE);
+        }
+        if (!up && (up = open_origin(hostname, port, tls, !has_body, &parent)) == NULL) {
+            clienterror(args->connfd, hostname, "404", "Not found", "Cannot connect to the host");
+            free(resp.object);
+            if (peer)
+                peer_release(peer, 1);
+            snprintf(origin, sizeof(origin), "%s:%d", hostname, port);
+            log_access(args, uri, origin, 404, OUTCOME_ERROR, 0, "");
+            return;
+        }
+        slowlog_mark(SLOW_CONNECT);
+        req_len = snprintf(req, MAXLINE, "%s %s HTTP/1.1\r\nHost: %s\r\n", method,
+                           via_peer || (parent && !tls) ? uri : pathname[0] ? pathname : "/", hostname);
+        if (via_peer)
+            req_len += snprintf(req + req_len, MAXLINE - req_len, "%s: %s\r\n", PEER_HEADER, peer_self());
+        iov[0].iov_base = req;
+        iov[0].iov_len = req_len;
+        iov[1].iov_base = hdrs;
+        iov[1].iov_len = hdrs_len;
+        iov[2].iov_base = "\r\n";
+        iov[2].iov_len = 2;
+        n = upstream_writev(up, iov, 3);
+
+        // Stream the request body, if any, to the server
+        if (n > 0 && (content_length || chunked)) {
+            if (expect_continue && client_11)
+                rio_writen(args->connfd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+            n = forward_body(&rio, args->connfd, up, content_length, chunked) < 0 ? -1 : 1;
+        }
+        if (n > 0) {
+            n = upstream_readline(up, buf, MAXLINE);
+            slowlog_mark(SLOW_TTFB);
+        }
+
+        // Interim (1xx) responses are not passed on
+        while (n > 0 && strncmp(buf + strcspn(buf, " "), " 1", 2) == 0) {
+            while ((n = upstream_readline(up, buf, MAXLINE)) > 0 && buf[0] != '\r' && buf[0] != '\n')
+                ;
+            if (n > 0)
+                n = upstream_readline(up, buf, MAXLINE);
+        }
+        if (n <= 0) {
+            retry = up->reused;
+            upstream_release(up, 0);
+            up = NULL;
+            if (via_peer && !retry) {
+                // Nothing has reached the client, and a GET has no body
+                // to resend, so fetch from the origin instead
+                peer_release(peer, 0);
+                peer = NULL;
+                via_peer = 0;
+                resp.object = Malloc(MAX_OBJECT_SIZE);
+                retry = 1;
+            }
+        }
+    } while (!up && retry);
+    if (!up) {
+        clienterror(args->connfd, hostname, "502", "Bad Gateway", "No response from the host");
+        free(resp.object);
+        if (peer)
+            peer_release(peer, !via_peer);
+        snprintf(origin, sizeof(origin), "%s:%d", hostname, port);
+        log_access(args, uri, origin, 502, OUTCOME_ERROR, 0, "");
+        return;
+    }
+    resp.up = up;
+
+    // Forward the response headers line by line, keeping a copy for the
+    // cache and noting HTML pages whose links can be prefetched and how
+    // the body is framed. An HTTP/1.0 client gets a chunked body decoded,
+    // so it is not told about the transfer-coding. HTTP/1.0 origins
+    // close after each response, and some responses never have a body.
+    status = atoi(buf + strcspn(buf, " "));
+    outcome = via_peer ? OUTCOME_PEER : resp.object ? OUTCOME_MISS : OUTCOME_PASS;
+    reusable = strncmp(buf, "HTTP/1.1", 8) == 0;
+    no_body = strcasecmp(method, "HEAD") == 0 || status == 204 || status == 304;
+    for (; n > 0; n = upstream_readline(up, buf, MAXLINE)) {
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            body_length = strtoll(buf + 15, NULL, 10);
+            if (body_length > MAX_OBJECT_SIZE && resp.object) {
+                // Too large to cache: do not copy or read ahead any of it
+                free(resp.object);
+                resp.object = NULL;
+            }
+        } else if (strncasecmp(buf, "Connection:", 11) == 0 &&
+                   strncasecmp(buf + 11 + strspn(buf + 11, " \t"), "close", 5) == 0) {
+            reusable = 0;
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+            resp_coded = !no_body;
+            resp.chunked = !no_body && chunked_coding(buf + 18);
+            if (!client_11 && chunked_coding(buf + 18)) {
+                keep_copy(&resp, buf, n);
+                continue;
+            }
+        }
+        if (rio_writen(args->connfd, buf, n) < 0)
+            break;
+        keep_copy(&resp, buf, n);
+        if (buf[0] == '\r' || buf[0] == '\n')
+            break;
+        if (strncasecmp(buf, "Content-Type:", 13) == 0)
+            snprintf(content_type, sizeof(content_type), "%s", buf + 13 + strspn(buf + 13, " \t"));
+        else if (strncasecmp(buf, "Content-Encoding:", 17) == 0)
+            snprintf(content_encoding, sizeof(content_encoding), "%s", buf + 17 + strspn(buf + 17, " \t"));
+        if (resp.object && !resp.scan && strncasecmp(buf, "Content-Type:", 13) == 0 &&
+            strncasecmp(buf + 13 + strspn(buf + 13, " \t"), "text/html", 9) == 0)
+            resp.scan = prefetch_scan_start(uri);
+    }
+    if (resp_coded) {
+        // Transfer-Encoding overrides Content-Length, and a body whose
+        // codings do not end in chunked runs to EOF
+        if (!resp.chunked)
+            body_length = -1;
+        reusable = reusable && resp.chunked && body_length < 0;
+    }
+    if (!no_body && content_type[0])
+        resp.markers = bodyscan_start(content_type, content_encoding);
+
+    // Relay the body through a bounded buffer. While the response may
+    // still be cached the whole object may be read ahead. The relay stops
+    // at the end of the body as framed by Content-Length or the last
+    // chunk; only bodies without either run to EOF, which rules out
+    // reusing the connection. A chunked body goes to HTTP/1.1 clients as
+    // it is and is decoded for HTTP/1.0 clients; either way the cache
+    // keeps the decoded body. Bodies of scanned content types are checked
+    // for markers on the way (see bodyscan.c). A body that nothing needs
+    // to see (not cached, scanned or decoded) is spliced straight from
+    // origin to client, so objects of any size stream in constant memory.
+    // The server connection is released as soon as the whole body has
+    // been read, while the client may still be draining the buffer.
+    if (n > 0 && (buf[0] == '\r' || buf[0] == '\n')) {
+        relay_init(&relay, up->fd, args->connfd,
+                   resp.object && relay_buffer_size < MAX_OBJECT_SIZE ? MAX_OBJECT_SIZE : relay_limit());
+        relay.own_from = 0;
+        relay.from_up = up;
+        relay.zero_copy = !resp.object && !resp.scan && !resp.markers && !resp.chunked;
+        relay.tap = relay.zero_copy ? NULL : collect_body;
+        relay.finished = body_read;
+        relay.arg = &resp;
+        head_size = resp.size;
+        if (no_body) {
+            relay.remaining = 0;
+        } else if (resp.chunked) {
+            chunked_init(&resp.chunks);
+            if (!client_11)
+                relay.filter = dechunk_body;
+        } else if (body_length >= 0) {
+            relay.remaining = body_length;
+        } else {
+            reusable = 0;
+        }
+        resp.reusable = reusable;
+        if (relay_run(&relay) < 0 || (resp.chunked && !chunked_done(&resp.chunks))) {
+            reusable = 0;
+            free(resp.object);
+            resp.object = NULL;
+        }
+        if (relay.aborted) {
+            // Reset rather than close the client connection, so that even
+            // a close-delimited body is seen to be cut short
+            struct linger reset = { 1, 0 };
+            setsockopt(args->connfd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        }
+        if (!relay.tap)
+            resp.size = head_size + relay.sent;
+        relay_free(&relay);
+    } else {
+        reusable = 0;
+        free(resp.object);
+        resp.object = NULL;
+    }
+    if (resp.markers) {
+        if (bodyscan_marker(resp.markers) >= 0)
+            outcome = OUTCOME_ERROR;
+        bodyscan_finish(resp.markers);
     }
+    release_origin(&resp, reusable);
+    slowlog_mark(SLOW_RELAY);
+    slowlog_client(args->connfd);
+    if (resp.tcp_sampled)
+        sample_tcp(resp.up_key, resp.have_up_tcp ? &resp.up_tcp : NULL, args->connfd, tcp_fields,
+                   sizeof(tcp_fields));
+    if (peer)
+        peer_release(peer, 1);
+
+    sched_learn(uri, resp.size);
+
+    // Only complete 200 responses are worth caching
+    if (resp.object && resp.size > 12 && strncmp(resp.object + 8, " 200", 4) == 0) {
+        cache_insert(uri, resp.object, resp.size, resp.chunked ? CACHE_DECHUNKED : 0);
+        if (resp.scan)
+            prefetch_scan_finish(resp.scan, 1);
+    } else if (resp.scan) {
+        prefetch_scan_finish(resp.scan, 0);
+    }
+    free(resp.object);
 
     // Log the request
-    char log_entry[MAXLINE];
-    format_log_entry(log_entry, &args->clientaddr, uri, size);
-    log_request(log_entry);
+    snprintf(origin, sizeof(origin), "%s:%d", hostname, port);
+    log_access(args, uri, origin, status, outcome, resp.size, tcp_fields);
+}
+
+/*
+ * tunnel - Handle a CONNECT request for authority (host:port): connect
+ * to the origin (or tunnel through a parent proxy for its domain),
+ * confirm to the client, then carry bytes both ways
+ * until either side closes or the tunnel sits idle for
+ * tunnel_idle_timeout seconds. Bytes in each direction are logged.
+ * Only port 443 and those given as connect_port may be tunnelled to, so
+ * the proxy cannot be used to reach mail or other plain-TCP services.
+ */
+void tunnel(thread_args *args, char *authority, rio_t *rio) {
+    char hostname[MAXLINE], fields[MAXLINE + 64], origin[MAXLINE + 16], tcp_fields[MAXLINE] = "", *colon, *end;
+    parent_t *parents[MAX_PARENTS];
+    size_t up = 0, down = 0;
+    tcpinfo_t up_tcp;
+    int serverfd = -1, nparents, have_up, allowed = 0;
+    long port;
+
+    colon = strrchr(authority, ':');
+    if (!colon || colon == authority || colon - authority >= MAXLINE ||
+        (port = strtol(colon + 1, &end, 10)) <= 0 || port > 65535 || *end) {
+        clienterror(args->connfd, authority, "400", "Bad Request", "CONNECT needs a host:port");
+        return;
+    }
+    memcpy(hostname, authority, colon - authority);
+    hostname[colon - authority] = '\0';
+    for (int i = 0; i < nconnect_ports && !allowed; i++)
+        allowed = connect_ports[i] == port;
+    if (!allowed) {
+        atomic_fetch_add(&connect_denied, 1);
+        clienterror(args->connfd, authority, "403", "Forbidden", "CONNECT is not allowed to this port");
+        log_access(args, authority, authority, 403, OUTCOME_ERROR, 0, "");
+        return;
+    }
+
+    if ((nparents = parent_route(hostname, parents)) == 0)
+        serverfd = preconnect_connect(hostname, colon + 1, 1);
+    for (int i = 0; i < nparents && serverfd < 0; i++) {
+        serverfd = upstream_connect_via(parents[i]->host, parents[i]->port, hostname, port);
+        parent_result(parents[i], serverfd >= 0);
+    }
+    if (serverfd < 0) {
+        clienterror(args->connfd, hostname, "502", "Bad Gateway", "Cannot connect to the host");
+        log_access(args, authority, authority, 502, OUTCOME_ERROR, 0, "");
+        return;
+    }
+    slowlog_mark(SLOW_CONNECT);
+    if (rio_writen(args->connfd, "HTTP/1.1 200 Connection Established\r\n\r\n", 39) < 0 ||
+        (rio->rio_cnt > 0 && rio_writen(serverfd, rio->rio_bufptr, rio->rio_cnt) < 0)) {
+        Close(serverfd);
+        return;
+    }
+    up = rio->rio_cnt;
+    rio->rio_cnt = 0;
+
+    relay_tunnel(args->connfd, serverfd, tunnel_idle_ms > 0 ? tunnel_idle_ms : -1, &up, &down);
+    snprintf(origin, sizeof(origin), "connect://%s", authority);
+    slowlog_mark(SLOW_RELAY);
+    slowlog_upstream(serverfd);
+    slowlog_client(args->connfd);
+    if (tcpinfo_sampled()) {
+        have_up = tcpinfo_read(serverfd, &up_tcp) == 0;
+        sample_tcp(origin, have_up ? &up_tcp : NULL, args->connfd, tcp_fields, sizeof(tcp_fields));
+    }
+    Close(serverfd);
+
+    snprintf(fields, sizeof(fields), " up=%zu down=%zu%s", up, down, tcp_fields);
+    log_access(args, authority, authority, 200, OUTCOME_TUNNEL, down, fields);
+}
+
+/*
+ * forward_body - Stream a request body from the client to the server
+ * without buffering it whole. A body with a Content-Length goes through
+ * the same bounded relay as responses; a chunked body is decoded as it
+ * arrives and each run of payload is sent on as a chunk of its own, so
+ * extensions and trailers are dropped. Returns 0 on success, -1 on error.
+ */
+int forward_body(rio_t *rio, int connfd, upstream_t *up, long long length, int chunked) {
+    char buf[MAXBUF];
+    const char *data;
+    chunked_t chunks;
+    upload_t upload = { up, 0 };
+    relay_t relay;
+    ssize_t n;
+    size_t have, used;
+
+    atomic_fetch_add(&uploads, 1);
+    if (!chunked) {
+        /* Bytes already read into the Rio buffer go first */
+        have = rio->rio_cnt < length ? rio->rio_cnt : length;
+        relay_init(&relay, connfd, up->fd, relay_limit());
+        relay.own_from = 0;
+        relay.to_up = up;
+        relay_push(&relay, rio->rio_bufptr, have);
+        rio->rio_bufptr += have;
+        rio->rio_cnt -= have;
+        relay.remaining = length - have;
+        n = relay_run(&relay);
+        relay_free(&relay);
+        if (n >= 0)
+            atomic_fetch_add(&upload_bytes, n);
+        return n == length ? 0 : -1;
+    }
+
+    /* Bytes already in the Rio buffer first, then straight from the socket */
+    chunked_init(&chunks);
+    data = rio->rio_bufptr;
+    n = rio->rio_cnt;
+    for (;;) {
+        used = chunked_decode(&chunks, data, n, send_chunk, &upload);
+        if (data == rio->rio_bufptr) {
+            rio->rio_bufptr += used;
+            rio->rio_cnt -= used;
+        }
+        if (upload.failed || chunked_failed(&chunks))
+            return -1;
+        if (chunked_done(&chunks))
+            break;
+        while ((n = read(connfd, buf, sizeof(buf))) < 0 && errno == EINTR)
+            ;
+        if (n <= 0)
+            return -1;
+        data = buf;
+    }
+    atomic_fetch_add(&upload_bytes, chunks.body);
+    return upstream_write(up, CHUNKED_LAST, 5) < 0 ? -1 : 0;
+}
+
+/*
+ * send_chunk - Decoder sink for forward_body: send one run of request
+ * payload to the server as a chunk, framing and payload in one writev.
+ */
+void send_chunk(void *arg, const char *data, size_t len) {
+    upload_t *upload = arg;
+    char hdr[CHUNKED_HEADER_MAX];
+    struct iovec iov[3];
+
+    if (upload->failed)
+        return;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = chunked_header(hdr, len);
+    iov[1].iov_base = (char *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    if (upstream_writev(upload->up, iov, 3) < 0)
+        upload->failed = 1;
+}
+
+/*
+ * keep_copy - Append response bytes to the copy kept for the cache, or
+ * give up on caching once the response outgrows MAX_OBJECT_SIZE.
+ */
+void keep_copy(response_t *resp, const char *data, size_t len) {
+    if (resp->object && resp->size + len <= MAX_OBJECT_SIZE) {
+        memcpy(resp->object + resp->size, data, len);
+    } else if (resp->object) {
+        free(resp->object);
+        resp->object = NULL;
+    }
+    resp->size += len;
+}
+
+/*
+ * collect_body - Relay tap for response bodies. A chunked body that is
+ * relayed as it is gets decoded here; the payload goes to take_body,
+ * and the relay ends with the last chunk rather than at EOF.
+ */
+void collect_body(relay_t *r, const char *data, size_t len) {
+    response_t *resp = r->arg;
 
-    Close(clientfd);
+    if (!resp->chunked || r->filter) {
+        take_body(r, data, len);
+    } else {
+        if (chunked_decode(&resp->chunks, data, len, take_body, r) < len)
+            resp->trailing = 1;
+        if (chunked_done(&resp->chunks) || chunked_failed(&resp->chunks))
+            r->remaining = 0;
+    }
+}
+
+/*
+ * take_body - Check response body bytes for markers, keep a copy for
+ * the cache and feed HTML to the prefetch scanner. Once the response can
+ * no longer be cached, read-ahead drops back to the normal relay buffer,
+ * and if nothing else needs the bytes the rest of the body is spliced.
+ * The bytes are still in the relay's buffer, unsent, so a marker can be
+ * masked in place; a response with a marker is never cached.
+ */
+void take_body(void *arg, const char *data, size_t len) {
+    relay_t *r = arg;
+    response_t *resp = r->arg;
+    int found;
+
+    if (resp->markers && (found = bodyscan_feed(resp->markers, (char *)data, len)) != BODYSCAN_PASS) {
+        free(resp->object);
+        resp->object = NULL;
+        if (found == BODYSCAN_ABORT) {
+            relay_abort(r);
+            return;
+        }
+    }
+    if (resp->scan)
+        prefetch_scan_feed(resp->scan, data, len);
+    if (resp->object) {
+        keep_copy(resp, data, len);
+        if (!resp->object)
+            relay_set_limit(r, relay_limit());
+        if (!resp->object && !resp->scan && !resp->markers && !resp->chunked) {
+            // Nothing else looks at the rest of the body
+            r->tap = NULL;
+            r->zero_copy = 1;
+        }
+    } else {
+        resp->size += len;
+    }
+}
+
+/* Where dechunk_body writes decoded payload */
+typedef struct {
+    char *out;
+    size_t len;
+} dechunk_out_t;
+
+static void dechunk_append(void *arg, const char *data, size_t len) {
+    dechunk_out_t *o = arg;
+
+    if (o->out + o->len != data)
+        memmove(o->out + o->len, data, len);
+    o->len += len;
+}
+
+/*
+ * dechunk_body - Relay filter that strips chunked framing for HTTP/1.0
+ * clients. Payload only ever moves towards the start of the buffer, so
+ * in may equal out; the relay ends with the last chunk.
+ */
+size_t dechunk_body(relay_t *r, const char *in, size_t len, char *out) {
+    response_t *resp = r->arg;
+    dechunk_out_t o = { out, 0 };
+
+    if (chunked_decode(&resp->chunks, in, len, dechunk_append, &o) < len)
+        resp->trailing = 1;
+    if (chunked_done(&resp->chunks) || chunked_failed(&resp->chunks))
+        r->remaining = 0;
+    return o.len;
 }
 
 /*
@@ -176,21 +881,26 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
  * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
  * the host name, path name, and port.  The memory for hostname and
  * pathname must already be allocated and should be at least MAXLINE
- * bytes. Return -1 if there are any problems.
+ * bytes. Return 1 for an https URI, 0 for http, or -1 if there are any problems.
  */
 int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
     char *hostbegin;
     char *hostend;
     char *pathbegin;
-    int len;
+    int len, tls;
 
-    if (strncasecmp(uri, "http://", 7) != 0) {
+    if (strncasecmp(uri, "http://", 7) == 0) {
+        tls = 0;
+        hostbegin = uri + 7;  // Move past "http://"
+    } else if (strncasecmp(uri, "https://", 8) == 0) {
+        tls = 1;
+        hostbegin = uri + 8;  // Move past "https://"
+    } else {
         hostname[0] = '\0';
         return -1;
     }
 
     /* Extract the host name */
-    hostbegin = uri + 7;  // Move past "http://"
     hostend = strpbrk(hostbegin, " :/\r\n\0");
     if (!hostend) {
         hostname[0] = '\0';
@@ -201,7 +911,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
     hostname[len] = '\0';
 
     /* Extract the port number */
-    *port = 80; // Default HTTP port
+    *port = tls ? 443 : 80; // Default HTTPS or HTTP port
     if (*hostend == ':') {
         *port = atoi(hostend + 1);
     }
@@ -214,7 +924,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
         strcpy(pathname, "/");  // Default to root path if none is specified
     }
 
-    return 0;
+    return tls;
 }
 
 /*
@@ -224,7 +934,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
  * (sockaddr), the URI from the request (uri), and the size in bytes
  * of the response from the server (size).
  */
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size) {
+void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, long long size) {
     time_t now;
     char time_str[MAXLINE];
     char host_ip[INET_ADDRSTRLEN];
@@ -237,7 +947,7 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri,
     inet_ntop(AF_INET, &(sockaddr->sin_addr), host_ip, INET_ADDRSTRLEN);
 
     /* Create the log entry */
-    sprintf(logstring, "[%s] %s %s %d", time_str, host_ip, uri, size);
+    sprintf(logstring, "[%s] %s %s %lld", time_str, host_ip, uri, size);
 }
 
 /*
@@ -248,38 +958,257 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri,
 void *thread(void *vargp) {
     thread_args *args = (thread_args *)vargp;
     pthread_detach(pthread_self());
+    slowlog_begin(&args->slow);
+    accesslog_cpu(&args->cpu_start);
+    sockopt_accepted(args->connfd);
     proxy(args);
+    if (args->sched_class >= 0)
+        sched_release(args->sched_class);
     Close(args->connfd);
     free(vargp);
     return NULL;
 }
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * log_access - Account for a finished request to origin (host:port),
+ * with the time and CPU it took, and unless the log mode leaves it to
+ * the aggregates, log it in full with fields appended to the entry.
+ */
+void log_access(thread_args *args, char *uri, const char *origin, int status, int outcome, size_t bytes,
+                const char *fields) {
+    char log_entry[MAXLINE], client[INET_ADDRSTRLEN];
+    struct timespec now;
+    access_t a;
+    size_t n;
+    int line;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    a.origin = origin;
+    a.status = status;
+    a.outcome = outcome;
+    a.bytes = bytes;
+    a.latency_us = (now.tv_sec - args->start.tv_sec) * 1000000 + (now.tv_nsec - args->start.tv_nsec) / 1000;
+    accesslog_cpu_since(&a.cpu, &args->cpu_start);
+    if ((line = accesslog_record(&a)) != ACCESS_NONE) {
+        format_log_entry(log_entry, &args->clientaddr, uri, bytes);
+        n = strlen(log_entry);
+        if (line == ACCESS_AGGREGATED)
+            n += snprintf(log_entry + n, MAXLINE - n, " aggregated=1");
+        n += accesslog_cpu_format(log_entry + n, MAXLINE - n, &a.cpu);
+        snprintf(log_entry + n, MAXLINE - n, "%s", fields);
+        log_request(log_entry);
+    }
+    inet_ntop(AF_INET, &args->clientaddr.sin_addr, client, sizeof(client));
+    slowlog_finish(client, uri, origin, status, bytes);
+}
+
+/*
+ * log_mode - The LOG_ mode named by the log_mode setting.
+ */
+int log_mode(const char *name) {
+    if (strcasecmp(name, "sampled") == 0)
+        return LOG_SAMPLED;
+    if (strcasecmp(name, "aggregate") == 0)
+        return LOG_AGGREGATE;
+    return LOG_FULL;
+}
 
 /*
  * log_request - Logs a request to a log file.
 */
 void log_request(char *log_entry) {
-    pthread_mutex_lock(&log_mutex);
+    lockprof_lock(&log_mutex);
     if (log_file) {
         fprintf(log_file, "%s\n", log_entry);
         fflush(log_file);
     }
-    pthread_mutex_unlock(&log_mutex);
+    lockprof_unlock(&log_mutex);
 }
 
 /*
- * read_blocklist - Reads the blocklist from a specified file and stores the entries
- * in a global array. Each line in the file is treated as one blocklist entry.
-*/
-void read_blocklist(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) return;
-    while (fgets(blocklist[blocklist_count], MAXLINE, file) != NULL) {
-        blocklist[blocklist_count][strcspn(blocklist[blocklist_count], "\n")] = 0; // Remove newline
-        if (strlen(blocklist[blocklist_count]) > 0) {
-            blocklist_count++;
+ * is_blocked - Returns 1 if uri matches any blocklist rule (see urlfilter.c).
+ */
+int is_blocked(const char *uri) {
+    int blocked = urlfilter_match(uri) >= 0;
+
+    slowlog_mark(SLOW_BLOCKLIST);
+    return blocked;
+}
+
+/*
+ * fetch_to_cache - Fetch uri from its origin on behalf of the prefetcher
+ * and cache the response if it is a complete 200 with no marker in its
+ * body. Nothing is sent to a client and nothing is logged. Returns 0 if the object was cached.
+ */
+int fetch_to_cache(const char *uri) {
+    static char close_hdrs[] = "Connection: close\r\nProxy-Connection: close\r\n\r\n";
+    char buf[MAXLINE], hostname[MAXLINE], pathname[MAXLINE], uri_copy[MAXLINE], hdrs[MAXBUF];
+    char *object;
+    int port, tls, rc = -1;
+    ssize_t n, size = 0;
+    struct iovec iov[3];
+    rewrite_t rw;
+    upstream_t *up;
+    parent_t *parent;
+
+    snprintf(uri_copy, sizeof(uri_copy), "%s", uri);
+    if (is_blocked(uri) || (tls = parse_uri(uri_copy, hostname, pathname, &port)) < 0)
+        return -1;
+    if ((up = open_origin(hostname, port, tls, 0, &parent)) == NULL)
+        return -1;
+
+    /* HTTP/1.0 keeps the response close-delimited and never chunked */
+    rewrite_start(&rw);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\nHost: %s\r\n",
+                              parent && !tls ? uri : pathname[0] ? pathname : "/", hostname);
+    iov[1].iov_base = hdrs;
+    iov[1].iov_len = (n = rewrite_finish(&rw, hdrs, sizeof(hdrs))) < 0 ? 0 : n;
+    iov[2].iov_base = close_hdrs;
+    iov[2].iov_len = sizeof(close_hdrs) - 1;
+    if (iov[0].iov_len >= sizeof(buf) || upstream_writev(up, iov, 3) < 0) {
+        upstream_release(up, 0);
+        return -1;
+    }
+
+    object = Malloc(MAX_OBJECT_SIZE);
+    while ((n = upstream_recv(up, object + size, MAX_OBJECT_SIZE - size)) > 0 && size + n < MAX_OBJECT_SIZE)
+        size += n;
+    if (n == 0 && size > 12 && strncmp(object + 8, " 200", 4) == 0 &&
+        bodyscan_response(object, size) == BODYSCAN_PASS)
+        rc = cache_insert(uri, object, size, CACHE_PREFETCHED);
+    free(object);
+    upstream_release(up, 0);
+    return rc;
+}
+
+/*
+ * release_origin - Done reading the response from its server: note the
+ * connection for the slow log and, if this request is sampled, its
+ * TCP_INFO, then pool it (if reusable) or close it. Does nothing once
+ * the connection has been released.
+ */
+void release_origin(response_t *resp, int reusable) {
+    upstream_t *up = resp->up;
+
+    if (!up)
+        return;
+    resp->up = NULL;
+    snprintf(resp->up_key, sizeof(resp->up_key), "%s", up->key);
+    if ((resp->tcp_sampled = tcpinfo_sampled()))
+        resp->have_up_tcp = tcpinfo_read(up->fd, &resp->up_tcp) == 0;
+    slowlog_upstream(up->fd);
+    upstream_release(up, reusable && !resp->trailing);
+}
+
+/*
+ * body_read - Relay hook for the end of a response body from the server.
+ * The connection goes back to the pool right away if the body arrived
+ * complete, even though the client may not have all of it yet.
+ */
+void body_read(relay_t *r) {
+    response_t *resp = r->arg;
+
+    release_origin(resp, resp->reusable && !r->aborted && (!resp->chunked || chunked_done(&resp->chunks)));
+}
+
+/*
+ * sample_tcp - Add a sampled request's TCP_INFO to the stats for origin:
+ * up, read from its upstream socket (NULL if there is none), and that of
+ * the client socket connfd. Writes both as log fields into fields.
+ */
+void sample_tcp(const char *origin, const tcpinfo_t *up, int connfd, char *fields, size_t len) {
+    tcpinfo_t client;
+    int have_client;
+    size_t n = 0;
+
+    have_client = tcpinfo_read(connfd, &client) == 0;
+    tcpinfo_record(origin, up, have_client ? &client : NULL);
+    if (up)
+        n = tcpinfo_format(fields, len, "up", up);
+    if (have_client)
+        tcpinfo_format(fields + n, len - n, "cl", &client);
+}
+
+/*
+ * relay_limit - Relay buffer size for a new transfer: relay_buffer, cut
+ * in half or to a quarter under memory pressure, but at least 4 KB.
+ */
+size_t relay_limit(void) {
+    size_t limit = relay_buffer_size >> memwatch_level();
+
+    return limit < 4096 ? 4096 : limit;
+}
+
+/*
+ * open_origin - Connect to hostname:port for a request: through the
+ * parent proxies configured for hostname, trying each in turn until one
+ * can be reached, or directly if there are none. *via is set to the
+ * parent used, or NULL. Returns NULL if the request cannot be sent.
+ */
+upstream_t *open_origin(const char *hostname, int port, int tls, int reuse, parent_t **via) {
+    parent_t *parents[MAX_PARENTS];
+    int n = parent_route(hostname, parents);
+    upstream_t *up;
+
+    *via = NULL;
+    if (n == 0)
+        return upstream_open(hostname, port, tls, reuse);
+    for (int i = 0; i < n; i++) {
+        if ((up = upstream_open_via(parents[i]->host, parents[i]->port, hostname, port, tls, reuse)) != NULL) {
+            parent_result(parents[i], 1);
+            *via = parents[i];
+            return up;
         }
+        parent_result(parents[i], 0);
     }
-    fclose(file);
+    return NULL;
+}
+
+/*
+ * stats_allowed - Whether client (a dotted address) starts with one of
+ * the stats_allow prefixes.
+ */
+int stats_allowed(const char *client) {
+    for (int i = 0; i < nstats_allow; i++)
+        if (strncmp(client, stats_allow[i], strlen(stats_allow[i])) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * serve_stats - Reply with the proxy's counters as plain text, one
+ * "name value" pair per line.
+ */
+void serve_stats(int fd) {
+    char buf[MAXLINE], *text;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+
+    cache_stats(out);
+    memwatch_stats(out);
+    lockprof_stats(out);
+    accesslog_stats(out);
+    slowlog_stats(out);
+    rewrite_stats(out);
+    sched_stats(out);
+    sockopt_stats(out);
+    tcpinfo_stats(out);
+    prefetch_stats(out);
+    relay_stats(out);
+    upstream_stats(out);
+    preconnect_stats(out);
+    urlfilter_stats(out);
+    bodyscan_stats(out);
+    peer_stats(out);
+    parent_stats(out);
+    fprintf(out, "peer_requests_served %lu\n", atomic_load(&peer_requests));
+    fprintf(out, "upload_count %lu\n", atomic_load(&uploads));
+    fprintf(out, "upload_bytes %lu\n", atomic_load(&upload_bytes));
+    fprintf(out, "connect_denied %lu\n", atomic_load(&connect_denied));
+    fclose(out);
+    sprintf(buf, "HTTP/1.0 200 OK\r\nContent-type: text/plain\r\nContent-length: %zu\r\n\r\n", len);
+    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, text, len);
+    free(text);
 }
@@ -0,0 +1,87 @@
+/*
+ * config.c - Runtime settings for the concurrent proxy
+ *
+ * The configuration file holds one "key value" pair per line; blank
+ * lines and lines starting with '#' are ignored. A key may appear more
+ * than once, in which case config_get returns the last value and
+ * config_get_all returns every value in file order. Settings are read
+ * once at startup and never change, so lookups need no locking.
+ */
+#include "csapp.h"
+#include "config.h"
+
+#define MAX_SETTINGS 256
+
+typedef struct {
+    char *key;
+    char *value;
+} setting_t;
+
+static setting_t settings[MAX_SETTINGS];
+static int setting_count = 0;
+
+/*
+ * config_load - Read settings from filename. A missing file is not an
+ * error; every setting then takes its default.
+ */
+void config_load(const char *filename) {
+    char line[MAXLINE], *key, *value, *end;
+    FILE *file = fopen(filename, "r");
+
+    if (!file) return;
+    while (fgets(line, MAXLINE, file) != NULL && setting_count < MAX_SETTINGS) {
+        key = line + strspn(line, " \t");
+        if (*key == '#' || *key == '\n' || *key == '\0')
+            continue;
+        value = key + strcspn(key, " \t\n");
+        if (*value != '\0')
+            *value++ = '\0';
+        value += strspn(value, " \t");
+        end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        settings[setting_count].key = strdup(key);
+        settings[setting_count].value = strdup(value);
+        setting_count++;
+    }
+    fclose(file);
+}
+
+/*
+ * config_get - Return the last value given for key, or def if unset.
+ */
+const char *config_get(const char *key, const char *def) {
+    for (int i = setting_count - 1; i >= 0; i--)
+        if (strcmp(settings[i].key, key) == 0)
+            return settings[i].value;
+    return def;
+}
+
+long config_get_long(const char *key, long def) {
+    const char *value = config_get(key, NULL);
+    return value ? strtol(value, NULL, 0) : def;
+}
+
+/*
+ * config_get_bool - Accepts on/off, yes/no, true/false and 1/0.
+ */
+int config_get_bool(const char *key, int def) {
+    const char *value = config_get(key, NULL);
+
+    if (!value) return def;
+    return strcasecmp(value, "on") == 0 || strcasecmp(value, "yes") == 0 ||
+           strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0;
+}
+
+/*
+ * config_get_all - Store up to max values given for key, in file order,
+ * and return how many were stored.
+ */
+int config_get_all(const char *key, const char **values, int max) {
+    int n = 0;
+
+    for (int i = 0; i < setting_count && n < max; i++)
+        if (strcmp(settings[i].key, key) == 0)
+            values[n++] = settings[i].value;
+    return n;
+}
@@ -0,0 +1,15 @@
+/*
+ * config.h - Runtime settings for the concurrent proxy
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#define CONFIGFILE "proxy.conf"
+
+void config_load(const char *filename);
+const char *config_get(const char *key, const char *def);
+long config_get_long(const char *key, long def);
+int config_get_bool(const char *key, int def);
+int config_get_all(const char *key, const char **values, int max);
+
+#endif /* __CONFIG_H__ */
@@ -0,0 +1,235 @@
+/*
+ * lockprof.c - Mutexes that can profile their own contention
+ *
+ * A lockprof_t is a pthread mutex that, while profiling is on (the
+ * lock_profile setting), records for its lockstat_t how often it was
+ * taken and from where, how long each acquisition waited and how long
+ * the lock was then held. Waits and holds go into log2 histograms of
+ * nanoseconds, from which /proxy-stats reports totals, medians, 99th
+ * percentiles and maxima, so the locks that limit scaling stand out.
+ *
+ * An acquisition first tries the lock; only when that fails is the wait
+ * timed, so an uncontended lock costs one clock read on each side. With
+ * profiling off, lockprof_acquire and lockprof_unlock are a branch in
+ * front of pthread_mutex_lock and pthread_mutex_unlock.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include <time.h>
+
+static int profiling;
+static lockstat_t *registry;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * lockprof_enable - Turn profiling on or off. Set it before any thread
+ * other than main takes a lock.
+ */
+void lockprof_enable(int on) {
+    profiling = on;
+}
+
+/*
+ * lockprof_init - Initialize l at run time, recording into stat.
+ */
+void lockprof_init(lockprof_t *l, lockstat_t *stat) {
+    pthread_mutex_init(&l->mutex, NULL);
+    l->stat = stat;
+    l->since = 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * bucket - Histogram bucket for ns: bucket b counts values below 2^b.
+ */
+static int bucket(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    return b < LOCKPROF_BUCKETS ? b : LOCKPROF_BUCKETS - 1;
+}
+
+static void update_max(atomic_ulong *max, uint64_t v) {
+    unsigned long cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (v > cur && !atomic_compare_exchange_weak(max, &cur, v))
+        ;
+}
+
+/*
+ * site_of - The slot for site in s, claimed on first use; NULL once all
+ * LOCKPROF_SITES are taken by other sites.
+ */
+static lockprof_site_t *site_of(lockstat_t *s, const char *site) {
+    const char *cur;
+
+    for (int i = 0; i < LOCKPROF_SITES; i++) {
+        cur = atomic_load(&s->sites[i].site);
+        if (!cur) {
+            if (atomic_compare_exchange_strong(&s->sites[i].site, &cur, site))
+                return &s->sites[i];
+        }
+        if (cur == site || strcmp(cur, site) == 0)
+            return &s->sites[i];
+    }
+    return NULL;
+}
+
+/*
+ * lockstat_register - Add s to the registry the first time it is used.
+ */
+static void lockstat_register(lockstat_t *s) {
+    pthread_mutex_lock(&registry_mutex);
+    if (!atomic_load(&s->registered)) {
+        s->next = registry;
+        registry = s;
+        atomic_store(&s->registered, 1);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+/*
+ * lockprof_acquire - Lock l, recording the acquisition against site
+ * while profiling. Use through lockprof_lock.
+ */
+void lockprof_acquire(lockprof_t *l, const char *site) {
+    lockstat_t *s = l->stat;
+    lockprof_site_t *slot;
+    uint64_t start, now, wait = 0;
+    int waited = 0;
+
+    if (!profiling) {
+        pthread_mutex_lock(&l->mutex);
+        return;
+    }
+    if (pthread_mutex_trylock(&l->mutex) == 0) {
+        now = now_ns();
+    } else {
+        start = now_ns();
+        pthread_mutex_lock(&l->mutex);
+        now = now_ns();
+        wait = now - start;
+        waited = 1;
+    }
+    l->since = now;
+
+    if (!atomic_load_explicit(&s->registered, memory_order_acquire))
+        lockstat_register(s);
+    atomic_fetch_add_explicit(&s->acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wait_hist[bucket(wait)], 1, memory_order_relaxed);
+    if (waited) {
+        atomic_fetch_add_explicit(&s->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->wait_ns, wait, memory_order_relaxed);
+        update_max(&s->wait_max, wait);
+    }
+    if ((slot = site_of(s, site)) != NULL) {
+        atomic_fetch_add_explicit(&slot->acquisitions, 1, memory_order_relaxed);
+        if (waited) {
+            atomic_fetch_add_explicit(&slot->contended, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&slot->wait_ns, wait, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * record_hold - Record the hold of l that is ending now.
+ */
+static void record_hold(lockprof_t *l) {
+    lockstat_t *s = l->stat;
+    uint64_t hold = now_ns() - l->since;
+
+    atomic_fetch_add_explicit(&s->hold_ns, hold, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->hold_hist[bucket(hold)], 1, memory_order_relaxed);
+    update_max(&s->hold_max, hold);
+}
+
+/*
+ * lockprof_unlock - Unlock l, recording how long it was held.
+ */
+void lockprof_unlock(lockprof_t *l) {
+    if (profiling)
+        record_hold(l);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/*
+ * lockprof_wait - pthread_cond_wait on cond with l held. Time asleep
+ * counts as neither waiting for nor holding l.
+ */
+void lockprof_wait(pthread_cond_t *cond, lockprof_t *l) {
+    if (profiling)
+        record_hold(l);
+    pthread_cond_wait(cond, &l->mutex);
+    if (profiling)
+        l->since = now_ns();
+}
+
+/*
+ * lockprof_timedwait - lockprof_wait, giving up at abstime (on the
+ * realtime clock). Returns ETIMEDOUT if it gave up, else 0.
+ */
+int lockprof_timedwait(pthread_cond_t *cond, lockprof_t *l, const struct timespec *abstime) {
+    int rc;
+
+    if (profiling)
+        record_hold(l);
+    rc = pthread_cond_timedwait(cond, &l->mutex, abstime);
+    if (profiling)
+        l->since = now_ns();
+    return rc;
+}
+
+/*
+ * percentile - Upper bound in ns of the bucket holding the p-th
+ * percentile of hist, 0 if it is empty.
+ */
+static unsigned long percentile(atomic_ulong *hist, double p) {
+    unsigned long total = 0, seen = 0;
+
+    for (int b = 0; b < LOCKPROF_BUCKETS; b++)
+        total += atomic_load(&hist[b]);
+    for (int b = 0; b < LOCKPROF_BUCKETS && total; b++) {
+        seen += atomic_load(&hist[b]);
+        if (seen >= total * p)
+            return b ? 1UL << b : 0;
+    }
+    return 0;
+}
+
+/*
+ * lockprof_stats - Print counters, wait and hold percentiles, and call
+ * sites for every lock used so far, as "name value" lines.
+ */
+void lockprof_stats(FILE *out) {
+    lockprof_site_t *site;
+    const char *name;
+
+    fprintf(out, "lock_profile %d\n", profiling);
+    pthread_mutex_lock(&registry_mutex);
+    for (lockstat_t *s = registry; s; s = s->next) {
+        fprintf(out, "lock_%s_acquisitions %lu\n", s->name, atomic_load(&s->acquisitions));
+        fprintf(out, "lock_%s_contended %lu\n", s->name, atomic_load(&s->contended));
+        fprintf(out, "lock_%s_wait_ns %lu\n", s->name, atomic_load(&s->wait_ns));
+        fprintf(out, "lock_%s_wait_p50_ns %lu\n", s->name, percentile(s->wait_hist, 0.5));
+        fprintf(out, "lock_%s_wait_p99_ns %lu\n", s->name, percentile(s->wait_hist, 0.99));
+        fprintf(out, "lock_%s_wait_max_ns %lu\n", s->name, atomic_load(&s->wait_max));
+        fprintf(out, "lock_%s_hold_ns %lu\n", s->name, atomic_load(&s->hold_ns));
+        fprintf(out, "lock_%s_hold_p50_ns %lu\n", s->name, percentile(s->hold_hist, 0.5));
+        fprintf(out, "lock_%s_hold_p99_ns %lu\n", s->name, percentile(s->hold_hist, 0.99));
+        fprintf(out, "lock_%s_hold_max_ns %lu\n", s->name, atomic_load(&s->hold_max));
+        for (int i = 0; i < LOCKPROF_SITES; i++) {
+            site = &s->sites[i];
+            if (!(name = atomic_load(&site->site)))
+                break;
+            fprintf(out, "lock_%s_site_%s_acquisitions %lu\n", s->name, name, atomic_load(&site->acquisitions));
+            fprintf(out, "lock_%s_site_%s_contended %lu\n", s->name, name, atomic_load(&site->contended));
+            fprintf(out, "lock_%s_site_%s_wait_ns %lu\n", s->name, name, atomic_load(&site->wait_ns));
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
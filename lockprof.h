@@ -0,0 +1,58 @@
+/*
+ * lockprof.h - Mutexes that can profile their own contention
+ */
+#ifndef __LOCKPROF_H__
+#define __LOCKPROF_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define LOCKPROF_BUCKETS 32     /* Log2 histogram buckets of nanoseconds */
+#define LOCKPROF_SITES 8        /* Call sites told apart per lock */
+
+/* Acquisitions of a lock from one place in the source */
+typedef struct {
+    _Atomic(const char *) site;     /* "file.c:123", NULL while unused */
+    atomic_ulong acquisitions;
+    atomic_ulong contended;         /* Had to wait */
+    atomic_ulong wait_ns;
+} lockprof_site_t;
+
+/* Statistics for a named lock, or a family of locks such as cache shards */
+typedef struct lockstat {
+    const char *name;
+    atomic_ulong acquisitions, contended, wait_ns, hold_ns, wait_max, hold_max;
+    atomic_ulong wait_hist[LOCKPROF_BUCKETS];
+    atomic_ulong hold_hist[LOCKPROF_BUCKETS];
+    lockprof_site_t sites[LOCKPROF_SITES];
+    atomic_int registered;
+    struct lockstat *next;
+} lockstat_t;
+
+/* A mutex whose waits and holds are recorded in stat while profiling is on */
+typedef struct {
+    pthread_mutex_t mutex;
+    lockstat_t *stat;
+    uint64_t since;                 /* When the holder acquired it, in ns */
+} lockprof_t;
+
+#define LOCKSTAT_INITIALIZER(name) { name }
+#define LOCKPROF_INITIALIZER(stat) { PTHREAD_MUTEX_INITIALIZER, stat, 0 }
+
+#define LOCKPROF_STR(x) #x
+#define LOCKPROF_SITE(line) __FILE__ ":" LOCKPROF_STR(line)
+
+/* Lock l, tagging the acquisition with the calling file and line */
+#define lockprof_lock(l) lockprof_acquire((l), LOCKPROF_SITE(__LINE__))
+
+void lockprof_enable(int on);
+void lockprof_init(lockprof_t *l, lockstat_t *stat);
+void lockprof_acquire(lockprof_t *l, const char *site);
+void lockprof_unlock(lockprof_t *l);
+void lockprof_wait(pthread_cond_t *cond, lockprof_t *l);
+int lockprof_timedwait(pthread_cond_t *cond, lockprof_t *l, const struct timespec *abstime);
+void lockprof_stats(FILE *out);
+
+#endif /* __LOCKPROF_H__ */
@@ -0,0 +1,170 @@
+/*
+ * lz4.c - Minimal LZ4 block format codec used to compress cached bodies
+ *
+ * Produces and consumes the standard LZ4 block format (a sequence of
+ * token, literals, 16-bit offset, match length) so output is readable by
+ * any LZ4 implementation. The compressor is a single-pass greedy
+ * matcher with a 4K-entry hash table; it favours speed over ratio, the
+ * same trade-off the reference "fast" mode makes.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define HASH_BITS 12
+#define MINMATCH 4
+#define LASTLITERALS 5    /* The last 5 bytes are always literals */
+#define MFLIMIT 12        /* The last match must start 12 bytes before the end */
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * put_length - Emit the 255-continued extension of a length whose token
+ * nibble is saturated at 15.
+ */
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * put_sequence - Emit one sequence: token, literals and, unless this is
+ * the final literal-only sequence (mlen == 0), the match. Returns NULL
+ * if it would overflow oend.
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t llen,
+                             size_t offset, size_t mlen) {
+    uint8_t *token = op;
+
+    if ((size_t)(oend - op) < 1 + llen + llen / 255 + 1 + 2 + mlen / 255 + 1)
+        return NULL;
+    op++;
+    *token = (uint8_t)((llen >= 15 ? 15 : llen) << 4);
+    if (llen >= 15)
+        op = put_length(op, llen);
+    memcpy(op, lit, llen);
+    op += llen;
+    if (mlen == 0)
+        return op;
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= MINMATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15)
+        op = put_length(op, mlen);
+    return op;
+}
+
+/*
+ * lz4_compress - Compress srclen bytes of src into dst. Returns the
+ * compressed length, or 0 if the result does not fit in dstcap bytes
+ * (callers then keep the data uncompressed).
+ */
+size_t lz4_compress(const char *src, size_t srclen, char *dst, size_t dstcap) {
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base, *anchor = base, *end = base + srclen;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dstcap;
+    uint32_t table[1 << HASH_BITS];
+
+    if (srclen > MFLIMIT) {
+        const uint8_t *mflimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+
+        memset(table, 0, sizeof(table));
+        for (ip++; ip < mflimit; ) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash4(seq);
+            const uint8_t *ref = base + table[h];
+            const uint8_t *m, *r;
+
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                /* Skip faster through data that is not compressing */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            /* Extend the match backwards over pending literals, then forwards */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+                ip--, ref--;
+            for (m = ip + MINMATCH, r = ref + MINMATCH; m < matchlimit && *m == *r; m++, r++)
+                ;
+
+            if (!(op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip)))
+                return 0;
+            ip = anchor = m;
+        }
+    }
+
+    if (!(op = put_sequence(op, oend, anchor, end - anchor, 0, 0)))
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+/*
+ * lz4_decompress - Decompress an LZ4 block into dst. Every length and
+ * offset is bounds checked, so corrupt input yields -1 rather than an
+ * overrun. Returns the decompressed length.
+ */
+ssize_t lz4_decompress(const char *src, size_t srclen, char *dst, size_t dstcap) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + srclen;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dstcap;
+    size_t len, offset;
+    uint8_t token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= iend) return -1;
+                len += (b = *ip++);
+            } while (b == 255);
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend)
+            break;  /* Final literal-only sequence */
+
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return -1;
+
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= iend) return -1;
+                len += (b = *ip++);
+            } while (b == 255);
+        }
+        len += MINMATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+        if (offset >= len) {
+            memcpy(op, op - offset, len);
+            op += len;
+        } else {
+            /* Overlapping match repeats the last offset bytes */
+            for (const uint8_t *r = op - offset; len; len--)
+                *op++ = *r++;
+        }
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,13 @@
+/*
+ * lz4.h - Minimal LZ4 block format codec used to compress cached bodies
+ */
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t lz4_compress(const char *src, size_t srclen, char *dst, size_t dstcap);
+ssize_t lz4_decompress(const char *src, size_t srclen, char *dst, size_t dstcap);
+
+#endif /* __LZ4_H__ */
@@ -0,0 +1,314 @@
+/*
+ * memwatch.c - Sizing the cache to the memory the proxy may use
+ *
+ * At startup the memory limit of the proxy's cgroup is read (memory.max
+ * under cgroup v2, the hierarchical limit from memory.stat under v1) and
+ * the cache ceiling becomes share percent of it, or the configured cache
+ * size if one was set and is smaller; without a limit it is the
+ * configured cache size. A background thread then samples, every
+ * interval seconds, the cgroup's working set (use minus inactive page
+ * cache), its memory pressure stall information (PSI: the share of the
+ * last ten seconds that tasks spent waiting for memory) and how often it
+ * hit its limit (memory.events, or memory.failcnt under v1), and moves
+ * the cache capacity between min and the ceiling:
+ *
+ *   critical  limit hit, or working set above 95% of it    halve
+ *   pressure  PSI at psi_threshold or more, or above 85%   cut an eighth
+ *   calm      PSI under half the threshold, below 70%      grow by 1/32
+ *
+ * PSI is read from the cgroup's memory.pressure. The host-wide
+ * /proc/pressure/memory reflects other tenants as much as the proxy, so
+ * it stands in only when asked for (host_psi); otherwise a proxy without
+ * cgroup PSI reacts to its limit alone.
+ *
+ * A shrink is carried out here, not by requests: TRIM_BATCH objects are
+ * evicted at a time with a pause in between, so lookups and inserts never
+ * wait behind a large eviction. Under critical pressure idle upstream
+ * connections are closed as well, and the proxy shrinks relay buffers
+ * for new responses while memwatch_level is above MEM_CALM.
+ */
+#include "csapp.h"
+#include "memwatch.h"
+#include "cache.h"
+#include "upstream.h"
+#include <limits.h>
+#include <malloc.h>
+#include <stdatomic.h>
+
+#define TRIM_BATCH 64           /* Evictions between pauses */
+#define TRIM_PAUSE_US 1000
+
+static char v2_dir[PATH_MAX + 32]; /* Our cgroup v2 directory, if any */
+static char v1_dir[PATH_MAX + 32]; /* Our cgroup v1 memory directory, if any */
+static char psi_file[PATH_MAX + 64];
+static size_t limit;            /* 0 if unlimited */
+static size_t ceiling, floor_size, capacity;
+static int interval;
+static double psi_threshold;
+
+static atomic_int level;
+static atomic_ulong shrinks, grows, evicted, idle_closed, limit_events;
+static atomic_size_t working_set;
+static _Atomic double psi_avg10;
+
+/*
+ * read_number - Read the number at the start of dir/name. Returns 0 on
+ * success; "max" (no limit) reads as 0.
+ */
+static int read_number(const char *dir, const char *name, unsigned long long *value) {
+    char path[PATH_MAX + 128], buf[64];
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(f = fopen(path, "r")))
+        return -1;
+    ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return -1;
+    *value = strncmp(buf, "max", 3) == 0 ? 0 : strtoull(buf, NULL, 10);
+    return 0;
+}
+
+/*
+ * read_field - Sum the values of the "key value" lines named key in
+ * dir/name (memory.stat, memory.events). Returns 0 on success.
+ */
+static int read_field(const char *dir, const char *name, const char *key, unsigned long long *value) {
+    char path[PATH_MAX + 128], line[256];
+    size_t len = strlen(key);
+    FILE *f;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(f = fopen(path, "r")))
+        return -1;
+    *value = 0;
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+            *value += strtoull(line + len + 1, NULL, 10);
+            found = 1;
+        }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+/*
+ * find_cgroups - Locate our cgroup directories from /proc/self/cgroup.
+ * Inside a container the path may not exist below the mount, which then
+ * is our own cgroup.
+ */
+static void find_cgroups(void) {
+    char line[PATH_MAX], *ctl, *path, dir[PATH_MAX + 32];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    struct stat st;
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!(ctl = strchr(line, ':')) || !(path = strchr(ctl + 1, ':')))
+            continue;
+        *path++ = '\0';
+        ctl++;
+        if (strcmp(line, "0") == 0 && *ctl == '\0') {
+            /* Unified hierarchy: /sys/fs/cgroup, or beside v1 in hybrid setups */
+            const char *mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+            for (int i = 0; i < 2 && !v2_dir[0]; i++) {
+                snprintf(dir, sizeof(dir), "%s/cgroup.controllers", mounts[i]);
+                if (stat(dir, &st) < 0)
+                    continue;
+                snprintf(dir, sizeof(dir), "%s%s", mounts[i], strcmp(path, "/") == 0 ? "" : path);
+                snprintf(v2_dir, sizeof(v2_dir), "%s", stat(dir, &st) == 0 ? dir : mounts[i]);
+            }
+        } else if (snprintf(dir, sizeof(dir), ",%s,", ctl) > 0 && strstr(dir, ",memory,")) {
+            snprintf(dir, sizeof(dir), "/sys/fs/cgroup/memory%s", strcmp(path, "/") == 0 ? "" : path);
+            if (stat(dir, &st) < 0)
+                snprintf(dir, sizeof(dir), "/sys/fs/cgroup/memory");
+            if (stat(dir, &st) == 0)
+                snprintf(v1_dir, sizeof(v1_dir), "%s", dir);
+        }
+    }
+    fclose(f);
+}
+
+/*
+ * find_limit - The tightest memory limit over our cgroup and its
+ * ancestors, or 0 if there is none.
+ */
+static size_t find_limit(void) {
+    unsigned long long v, best = 0;
+    char dir[PATH_MAX + 32], *slash;
+
+    if (v2_dir[0]) {
+        snprintf(dir, sizeof(dir), "%s", v2_dir);
+        for (;;) {
+            if (read_number(dir, "memory.max", &v) == 0 && v && (!best || v < best))
+                best = v;
+            if (!(slash = strrchr(dir, '/')) || slash == dir || strcmp(dir, "/sys/fs/cgroup") == 0)
+                break;
+            *slash = '\0';
+        }
+    }
+    if (v1_dir[0] && read_field(v1_dir, "memory.stat", "hierarchical_memory_limit", &v) == 0
+        && v < (1ULL << 62) && (!best || v < best))
+        best = v;
+    return best;
+}
+
+/*
+ * sample - Read the working set, the PSI avg10 and the number of limit
+ * events so far. Missing sources read as 0.
+ */
+static void sample(size_t *ws, double *psi, unsigned long long *events) {
+    unsigned long long use = 0, inactive = 0, v;
+    char line[256];
+    FILE *f;
+
+    *ws = 0;
+    *psi = 0;
+    *events = 0;
+    if (v2_dir[0] && read_number(v2_dir, "memory.current", &use) == 0) {
+        read_field(v2_dir, "memory.stat", "inactive_file", &inactive);
+        if (read_field(v2_dir, "memory.events", "high", &v) == 0)
+            *events += v;
+        if (read_field(v2_dir, "memory.events", "max", &v) == 0)
+            *events += v;
+    } else if (v1_dir[0] && read_number(v1_dir, "memory.usage_in_bytes", &use) == 0) {
+        read_field(v1_dir, "memory.stat", "total_inactive_file", &inactive);
+        if (read_number(v1_dir, "memory.failcnt", &v) == 0)
+            *events += v;
+    }
+    *ws = use > inactive ? use - inactive : 0;
+
+    if (psi_file[0] && (f = fopen(psi_file, "r")) != NULL) {
+        if (fgets(line, sizeof(line), f) && strncmp(line, "some avg10=", 11) == 0)
+            *psi = atof(line + 11);
+        fclose(f);
+    }
+}
+
+/*
+ * trim - Evict down to the capacity a batch at a time.
+ */
+static void trim(void) {
+    int n, total = 0;
+
+    while ((n = cache_trim(TRIM_BATCH)) > 0) {
+        total += n;
+        usleep(TRIM_PAUSE_US);
+    }
+    if (total) {
+        atomic_fetch_add(&evicted, total);
+        malloc_trim(0);
+    }
+}
+
+/*
+ * memwatch_thread - Sample every interval and move the cache capacity.
+ */
+static void *memwatch_thread(void *vargp) {
+    unsigned long long events, last_events;
+    size_t ws, next;
+    double psi;
+    int lvl;
+
+    Pthread_detach(pthread_self());
+    sample(&ws, &psi, &last_events);
+    for (;;) {
+        sleep(interval);
+        sample(&ws, &psi, &events);
+        atomic_store(&working_set, ws);
+        atomic_store(&psi_avg10, psi);
+        if (events > last_events)
+            atomic_fetch_add(&limit_events, events - last_events);
+
+        if (events > last_events || (limit && ws > limit / 100 * 95))
+            lvl = MEM_CRITICAL;
+        else if (psi >= psi_threshold || (limit && ws > limit / 100 * 85))
+            lvl = MEM_PRESSURE;
+        else
+            lvl = MEM_CALM;
+        last_events = events;
+        atomic_store(&level, lvl);
+
+        next = capacity;
+        if (lvl == MEM_CRITICAL)
+            next = capacity / 2;
+        else if (lvl == MEM_PRESSURE)
+            next = capacity - capacity / 8;
+        else if (psi < psi_threshold / 2 && (!limit || ws < limit / 100 * 70))
+            next = capacity + ceiling / 32;
+        if (next < floor_size)
+            next = floor_size;
+        if (next > ceiling)
+            next = ceiling;
+        if (next == capacity)
+            continue;
+
+        atomic_fetch_add(next < capacity ? &shrinks : &grows, 1);
+        capacity = next;
+        cache_resize(capacity);
+        if (lvl == MEM_CRITICAL)
+            atomic_fetch_add(&idle_closed, upstream_drain_idle());
+        trim();
+    }
+    return NULL;
+}
+
+/*
+ * memwatch_init - Size the cache from the cgroup memory limit (share
+ * percent of it, but no more than configured if that was set explicitly,
+ * or configured if there is no limit), never below min, and start
+ * adjusting it to memory pressure every interval seconds.
+ */
+void memwatch_init(size_t configured, int explicit, size_t min, int share, int interval_secs, double threshold,
+                   int host_psi) {
+    pthread_t tid;
+    char path[PATH_MAX + 64];
+    struct stat st;
+
+    find_cgroups();
+    limit = find_limit();
+    ceiling = limit ? limit / 100 * (share > 0 && share <= 100 ? share : 50) : configured;
+    if (explicit && configured < ceiling)
+        ceiling = configured;
+    floor_size = min < ceiling ? min : ceiling;
+    capacity = ceiling;
+    interval = interval_secs > 0 ? interval_secs : 1;
+    psi_threshold = threshold;
+
+    /* The cgroup's own PSI if it has one, else the system's if asked for */
+    snprintf(path, sizeof(path), "%s/memory.pressure", v2_dir);
+    if (v2_dir[0] && stat(path, &st) == 0)
+        snprintf(psi_file, sizeof(psi_file), "%s", path);
+    else if (host_psi)
+        snprintf(psi_file, sizeof(psi_file), "/proc/pressure/memory");
+
+    cache_resize(capacity);
+    Pthread_create(&tid, NULL, memwatch_thread, NULL);
+}
+
+/*
+ * memwatch_level - The memory pressure seen at the last sample: MEM_CALM,
+ * MEM_PRESSURE or MEM_CRITICAL.
+ */
+int memwatch_level(void) {
+    return atomic_load(&level);
+}
+
+/*
+ * memwatch_stats - Print memory sizing counters as "name value" lines.
+ */
+void memwatch_stats(FILE *out) {
+    fprintf(out, "memory_limit %zu\n", limit);
+    fprintf(out, "memory_working_set %zu\n", atomic_load(&working_set));
+    fprintf(out, "memory_psi_avg10 %.2f\n", atomic_load(&psi_avg10));
+    fprintf(out, "memory_level %d\n", atomic_load(&level));
+    fprintf(out, "memory_limit_events %lu\n", atomic_load(&limit_events));
+    fprintf(out, "memory_cache_shrinks %lu\n", atomic_load(&shrinks));
+    fprintf(out, "memory_cache_grows %lu\n", atomic_load(&grows));
+    fprintf(out, "memory_cache_evicted %lu\n", atomic_load(&evicted));
+    fprintf(out, "memory_idle_upstreams_closed %lu\n", atomic_load(&idle_closed));
+}
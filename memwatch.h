@@ -0,0 +1,20 @@
+/*
+ * memwatch.h - Sizing the cache to the memory the proxy may use
+ */
+#ifndef __MEMWATCH_H__
+#define __MEMWATCH_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* memwatch_level values */
+#define MEM_CALM 0
+#define MEM_PRESSURE 1
+#define MEM_CRITICAL 2
+
+void memwatch_init(size_t configured, int explicit, size_t min, int share, int interval, double psi_threshold,
+                   int host_psi);
+int memwatch_level(void);
+void memwatch_stats(FILE *out);
+
+#endif /* __MEMWATCH_H__ */
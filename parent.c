@@ -0,0 +1,158 @@
+/*
+ * parent.c - Routing requests through parent proxies by destination domain
+ *
+ * Each "parent" setting is a rule: a comma-separated list of domains,
+ * then the parents to use for them in order of preference, or "direct"
+ * to connect to the origin. A domain matches itself and its subdomains,
+ * with or without a leading dot, and "*" matches every host. The first
+ * matching rule wins; hosts that match none are fetched directly.
+ *
+ *     parent .corp.example.com proxy1.example.com:3128 proxy2.example.com:3128
+ *     parent intranet.example.com direct
+ *     parent * gateway.example.com:8080
+ *
+ * A parent that cannot be reached is tried last, after the others of
+ * its rule, for retry_secs; the same parent named by several rules
+ * shares its state.
+ */
+#include "csapp.h"
+#include "parent.h"
+
+#define MAX_PARENT_HOSTS 64
+
+typedef struct {
+    char domains[MAXLINE];          /* Comma-separated */
+    parent_t *parents[MAX_PARENTS]; /* In order of preference */
+    int count;                      /* 0 for direct */
+} rule_t;
+
+static rule_t rules[MAX_PARENT_RULES];
+static int rule_count;
+static parent_t hosts[MAX_PARENT_HOSTS];
+static int host_count;
+static int retry_after;
+
+/*
+ * parent_find - The parent named host:port, added on first use. NULL if
+ * the name is malformed or there are too many parents.
+ */
+static parent_t *parent_find(const char *name) {
+    parent_t *p;
+    char *colon;
+
+    for (int i = 0; i < host_count; i++)
+        if (strcmp(hosts[i].name, name) == 0)
+            return &hosts[i];
+    if (host_count == MAX_PARENT_HOSTS)
+        return NULL;
+    p = &hosts[host_count];
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    snprintf(p->host, sizeof(p->host), "%s", name);
+    if (!(colon = strrchr(p->host, ':')) || (p->port = atoi(colon + 1)) <= 0)
+        return NULL;
+    *colon = '\0';
+    atomic_init(&p->down_until, 0);
+    host_count++;
+    return p;
+}
+
+/*
+ * parent_init - Parse count rule strings. Returns the number of rules
+ * kept; malformed ones are reported and skipped.
+ */
+int parent_init(const char **specs, int count, int retry_secs) {
+    char copy[MAXLINE], *tok, *save;
+    rule_t *r;
+    parent_t *p;
+
+    retry_after = retry_secs;
+    for (int i = 0; i < count && rule_count < MAX_PARENT_RULES; i++) {
+        r = &rules[rule_count];
+        snprintf(copy, sizeof(copy), "%s", specs[i]);
+        if (!(tok = strtok_r(copy, " \t", &save)))
+            continue;
+        snprintf(r->domains, sizeof(r->domains), "%s", tok);
+        r->count = 0;
+        while ((tok = strtok_r(NULL, " \t", &save)) != NULL && r->count < MAX_PARENTS) {
+            if (strcasecmp(tok, "direct") == 0)
+                continue;
+            if (!(p = parent_find(tok))) {
+                fprintf(stderr, "parent: bad parent %s\n", tok);
+                continue;
+            }
+            r->parents[r->count++] = p;
+        }
+        rule_count++;
+    }
+    return rule_count;
+}
+
+/*
+ * domain_match - Returns 1 if hostname is domain or one of its
+ * subdomains. A leading dot on domain is optional; "*" matches all.
+ */
+static int domain_match(const char *hostname, const char *domain, size_t len) {
+    size_t hlen = strlen(hostname);
+
+    if (len == 1 && domain[0] == '*')
+        return 1;
+    if (len > 0 && domain[0] == '.') {
+        domain++;
+        len--;
+    }
+    if (len == 0 || hlen < len || strncasecmp(hostname + hlen - len, domain, len) != 0)
+        return 0;
+    return hlen == len || hostname[hlen - len - 1] == '.';
+}
+
+/*
+ * parent_route - Fill parents with the parents to try for hostname, in
+ * order: those believed up by preference, then those recently down.
+ * Returns how many; 0 means connect to the origin directly.
+ */
+int parent_route(const char *hostname, parent_t **parents) {
+    const char *d, *end;
+    long now = time(NULL);
+    rule_t *r;
+    int n = 0, down[MAX_PARENTS];
+
+    for (int i = 0; i < rule_count; i++) {
+        r = &rules[i];
+        for (d = r->domains; *d; d = *end ? end + 1 : end) {
+            end = d + strcspn(d, ",");
+            if (!domain_match(hostname, d, end - d))
+                continue;
+            for (int j = 0; j < r->count; j++)
+                down[j] = atomic_load(&r->parents[j]->down_until) > now;
+            for (int pass = 0; pass < 2; pass++)
+                for (int j = 0; j < r->count; j++)
+                    if (down[j] == pass)
+                        parents[n++] = r->parents[j];
+            return n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * parent_result - Record a request sent through p (ok), or a failure to
+ * reach it, which sends it to the back of the line for a while.
+ */
+void parent_result(parent_t *p, int ok) {
+    if (ok) {
+        atomic_fetch_add(&p->requests, 1);
+    } else {
+        atomic_fetch_add(&p->failures, 1);
+        atomic_store(&p->down_until, (long)time(NULL) + retry_after);
+    }
+}
+
+/*
+ * parent_stats - Write per-parent counters, one per line.
+ */
+void parent_stats(FILE *out) {
+    for (int i = 0; i < host_count; i++) {
+        fprintf(out, "parent_requests_%s %lu\n", hosts[i].name, atomic_load(&hosts[i].requests));
+        fprintf(out, "parent_failures_%s %lu\n", hosts[i].name, atomic_load(&hosts[i].failures));
+    }
+}
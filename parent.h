@@ -0,0 +1,28 @@
+/*
+ * parent.h - Routing requests through parent proxies by destination domain
+ */
+#ifndef __PARENT_H__
+#define __PARENT_H__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define MAX_PARENTS 8           /* Parents per rule; more are ignored */
+#define MAX_PARENT_RULES 32     /* Rules beyond this are ignored */
+
+/* An upstream proxy that requests can be chained through */
+typedef struct {
+    char name[256];             /* host:port, as configured */
+    char host[256];
+    int port;
+    atomic_long down_until;     /* Tried only as a last resort before this time */
+    atomic_ulong requests;      /* Requests sent through it */
+    atomic_ulong failures;      /* Connections to it that failed */
+} parent_t;
+
+int parent_init(const char **specs, int count, int retry_secs);
+int parent_route(const char *hostname, parent_t **parents);
+void parent_result(parent_t *p, int ok);
+void parent_stats(FILE *out);
+
+#endif /* __PARENT_H__ */
@@ -0,0 +1,183 @@
+/*
+ * peer.c - Sibling cache peering over a consistent-hash ring
+ *
+ * Every instance in a fleet is configured with the same member list, so
+ * every instance builds the same ring: each member is placed at
+ * PEER_VNODES points by hashing "host:port#i", and a URI belongs to the
+ * member at the first point clockwise from the URI's hash. Cache misses
+ * for URIs owned by another member are fetched through that member, so
+ * each object is fetched from its origin and cached once fleet-wide, and
+ * adding or removing a member only moves the URIs next to its points.
+ *
+ * Routing has bounded loads: a member may not carry more than
+ * load_factor times the average of the requests this instance has in
+ * flight across the fleet, and a busier owner passes the URI on to the
+ * next member clockwise. The bound never drops below PEER_MIN_BOUND, so
+ * a few concurrent requests are not mistaken for skew. A member whose
+ * connection fails is skipped for retry_secs, and its requests go to
+ * the origin meanwhile.
+ */
+#include "csapp.h"
+#include "peer.h"
+#include <stdint.h>
+
+#define PEER_VNODES 160     /* Ring points per member */
+#define PEER_MIN_BOUND 4    /* In-flight requests any member may always take */
+
+typedef struct {
+    uint64_t hash;
+    int member;
+} vnode_t;
+
+static peer_t members[MAX_PEERS];
+static int member_count;
+static peer_t *self;
+static vnode_t *ring;
+static int ring_size;
+static double max_load;
+static int retry_after;
+static atomic_int total_load;
+
+/*
+ * hash64 - 64-bit FNV-1a of s with a final avalanche, so that similar
+ * keys ("host:port#1", "host:port#2") land far apart on the ring.
+ */
+static uint64_t hash64(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int vnode_cmp(const void *a, const void *b) {
+    const vnode_t *x = a, *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/*
+ * peer_init - Build the ring from count "host:port" members, one of
+ * which must be self (this instance). Returns 0, or -1 (peering stays
+ * off) if a member cannot be parsed or self is not among them.
+ */
+int peer_init(const char *self_name, const char **names, int count, double load_factor, int retry_secs) {
+    char key[300], *colon;
+    peer_t *m;
+
+    if (count > MAX_PEERS)
+        count = MAX_PEERS;
+    for (int i = 0; i < count; i++) {
+        m = &members[i];
+        snprintf(m->name, sizeof(m->name), "%s", names[i]);
+        snprintf(m->host, sizeof(m->host), "%s", names[i]);
+        if (!(colon = strrchr(m->host, ':')) || (m->port = atoi(colon + 1)) <= 0) {
+            fprintf(stderr, "peer: bad member %s\n", names[i]);
+            return -1;
+        }
+        *colon = '\0';
+        m->self = strcmp(m->name, self_name) == 0;
+        if (m->self)
+            self = m;
+        atomic_init(&m->load, 0);
+        atomic_init(&m->down_until, 0);
+    }
+    if (!self) {
+        fprintf(stderr, "peer: peer_self %s is not a peer\n", self_name);
+        return -1;
+    }
+
+    ring = Malloc(count * PEER_VNODES * sizeof(vnode_t));
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < PEER_VNODES; v++) {
+            snprintf(key, sizeof(key), "%s#%d", members[i].name, v);
+            ring[i * PEER_VNODES + v].hash = hash64(key);
+            ring[i * PEER_VNODES + v].member = i;
+        }
+    }
+    qsort(ring, count * PEER_VNODES, sizeof(vnode_t), vnode_cmp);
+    ring_size = count * PEER_VNODES;
+    member_count = count;
+    max_load = load_factor < 1 ? 1 : load_factor;
+    retry_after = retry_secs;
+    return 0;
+}
+
+/*
+ * peer_route - Pick the member that should serve uri: its owner on the
+ * ring, or the next member clockwise that is up and within the load
+ * bound. Returns NULL when peering is off. Every member returned,
+ * including self, must be handed back with peer_release.
+ */
+peer_t *peer_route(const char *uri) {
+    uint64_t h;
+    double limit;
+    int lo, hi, mid, bound;
+    long now = time(NULL);
+    peer_t *m, *pick = self;
+
+    if (!member_count)
+        return NULL;
+
+    /* First ring point at or after the URI's hash, wrapping around */
+    h = hash64(uri);
+    for (lo = 0, hi = ring_size; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    limit = max_load * (atomic_load(&total_load) + 1) / member_count;
+    bound = (int)limit < limit ? (int)limit + 1 : (int)limit;
+    if (bound < PEER_MIN_BOUND)
+        bound = PEER_MIN_BOUND;
+    for (int k = 0; k < ring_size; k++) {
+        m = &members[ring[(lo + k) % ring_size].member];
+        if ((m->self || atomic_load(&m->down_until) <= now) && atomic_load(&m->load) < bound) {
+            pick = m;
+            break;
+        }
+    }
+    atomic_fetch_add(&pick->load, 1);
+    atomic_fetch_add(&pick->routed, 1);
+    atomic_fetch_add(&total_load, 1);
+    return pick;
+}
+
+/*
+ * peer_release - The request routed to p is finished. If ok is 0 the
+ * peer could not be reached, and it is skipped for a while.
+ */
+void peer_release(peer_t *p, int ok) {
+    atomic_fetch_sub(&p->load, 1);
+    atomic_fetch_sub(&total_load, 1);
+    if (!ok && !p->self) {
+        atomic_fetch_add(&p->failures, 1);
+        atomic_store(&p->down_until, (long)time(NULL) + retry_after);
+    }
+}
+
+/*
+ * peer_self - This instance's host:port, as the other members know it.
+ */
+const char *peer_self(void) {
+    return self ? self->name : "";
+}
+
+/*
+ * peer_stats - Write per-member routing counters, one per line.
+ */
+void peer_stats(FILE *out) {
+    for (int i = 0; i < member_count; i++) {
+        fprintf(out, "peer_routed_%s %lu\n", members[i].name, atomic_load(&members[i].routed));
+        if (!members[i].self)
+            fprintf(out, "peer_failures_%s %lu\n", members[i].name, atomic_load(&members[i].failures));
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * peer.h - Sibling cache peering over a consistent-hash ring
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define PEER_HEADER "X-Proxy-Peer"    /* Marks requests sent by a peer */
+#define MAX_PEERS 32                  /* Members beyond this are ignored */
+
+/* A member of the proxy fleet, this instance included */
+typedef struct {
+    char name[256];             /* host:port, as configured */
+    char host[256];
+    int port;
+    int self;                   /* This instance */
+    atomic_int load;            /* Requests routed to it and still in flight */
+    atomic_long down_until;     /* Not routed to before this time */
+    atomic_ulong routed;        /* Requests routed to it */
+    atomic_ulong failures;      /* Connections to it that failed */
+} peer_t;
+
+int peer_init(const char *self, const char **members, int count, double load_factor, int retry_secs);
+peer_t *peer_route(const char *uri);
+void peer_release(peer_t *p, int ok);
+const char *peer_self(void);
+void peer_stats(FILE *out);
+
+#endif /* __PEER_H__ */
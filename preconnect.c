@@ -0,0 +1,473 @@
+/*
+ * preconnect.c - Cached name resolution and warm connections to hot origins
+ *
+ * Upstream connections are made through preconnect_connect, which looks
+ * the host up in a small direct-mapped cache before calling getaddrinfo.
+ * getaddrinfo does not report record TTLs, so an entry is trusted for
+ * dns_ttl seconds. A name the resolver says does not exist is remembered
+ * for DNS_NEGATIVE_TTL seconds only, and other failures (a timeout, a
+ * resolver that is down) not at all, so a passing outage does not make
+ * an origin unreachable for a whole dns_ttl. If every
+ * cached address refuses, the entry is dropped and the next connect
+ * resolves afresh.
+ *
+ * Each pooled request to an origin is noted in a table of hot origins,
+ * which tracks how many connections to it are in use at once. Every
+ * interval a background thread updates the origin's demand: the peak of
+ * that count, falling to about a third every idle_secs / 4 seconds
+ * unless a higher peak replaces it, so bursts a few seconds apart are
+ * remembered between them. Then, for each origin
+ * requested in the last idle_secs seconds, it:
+ *
+ *   - resolves its name again once three quarters of dns_ttl have
+ *     passed, so requests never wait for an expired entry;
+ *   - tops the upstream idle pool up to as many connections as its
+ *     demand (at most max_per_origin), opened and, for https, handshaken
+ *     ahead of the requests that will take them.
+ *
+ * Origins unused for idle_secs get no more warm connections, and their
+ * idle ones time out as any pooled connection does. The table can be
+ * seeded at startup from the origins most frequent in an access log.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "sockopt.h"
+#include "upstream.h"
+#include "preconnect.h"
+#include "slowlog.h"
+#include <stdatomic.h>
+
+#define DNS_ENTRIES 256         /* Cached names, direct-mapped */
+#define DNS_ADDRS 4             /* Addresses kept per name */
+#define DNS_NEGATIVE_TTL 5      /* Seconds a nonexistent name is remembered */
+#define RESOLVE_NONAME -2       /* resolve: the name does not exist */
+#define HOST_LEN 256
+#define SEED_BYTES (1 << 20)    /* Tail of the seed log that is read */
+
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} addr_t;
+
+typedef struct {
+    char host[HOST_LEN];
+    addr_t addr[DNS_ADDRS];
+    int naddr;
+    time_t resolved;            /* 0 if the entry is empty */
+    int ttl;                    /* Seconds it is trusted */
+} dns_entry_t;
+
+typedef struct {
+    char host[HOST_LEN];
+    int port, tls;
+    int used;                   /* The slot holds an origin */
+    int in_use;                 /* Connections handed out now */
+    int peak;                   /* Most in use at once this interval */
+    unsigned demand;            /* Decaying peak, in 1/256ths */
+    time_t last;                /* Last request */
+} origin_t;
+
+static int dns_ttl;
+static dns_entry_t dns[DNS_ENTRIES];
+static lockstat_t dns_stat = LOCKSTAT_INITIALIZER("dns");
+static lockprof_t dns_lock = LOCKPROF_INITIALIZER(&dns_stat);
+
+static int enabled, origin_max, warm_max, idle_secs;
+static long interval_us;
+static unsigned decay;          /* Demand kept per interval, in 1/256ths */
+static origin_t origins[MAX_HOT_ORIGINS];
+static lockstat_t origin_stat = LOCKSTAT_INITIALIZER("preconnect");
+static lockprof_t origin_lock = LOCKPROF_INITIALIZER(&origin_stat);
+
+static atomic_ulong lookups, hits, resolves, resolve_us, refreshes, refresh_us, failures, invalidated;
+static atomic_ulong rounds, opened, seeded;
+
+/*
+ * dns_slot - The cache entry for host (FNV-1a, direct-mapped).
+ */
+static dns_entry_t *dns_slot(const char *host) {
+    unsigned h = 2166136261u;
+
+    for (const char *p = host; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return &dns[h % DNS_ENTRIES];
+}
+
+/*
+ * resolve - Look host up with getaddrinfo into addr. Returns the number
+ * of addresses, RESOLVE_NONAME if the name does not exist or -1 if it
+ * cannot be resolved now. Adds the time taken to *us.
+ */
+static int resolve(const char *host, addr_t *addr, atomic_ulong *us) {
+    struct addrinfo hints, *listp, *p;
+    struct timespec start, end;
+    int n = 0, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = getaddrinfo(host, NULL, &hints, &listp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atomic_fetch_add(us, (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s): %s\n", host, gai_strerror(rc));
+        atomic_fetch_add(&failures, 1);
+        return rc == EAI_NONAME ? RESOLVE_NONAME : -1;
+    }
+    for (p = listp; p && n < DNS_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(addr_t))
+            continue;
+        memset(&addr[n], 0, sizeof(addr_t));
+        memcpy(&addr[n++], p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(listp);
+    return n;
+}
+
+/*
+ * dns_store - Cache the n addresses just resolved for host, or that it
+ * does not exist (n is RESOLVE_NONAME). Other failures are not cached.
+ */
+static void dns_store(const char *host, addr_t *addr, int n) {
+    dns_entry_t *e = dns_slot(host);
+
+    if (strlen(host) >= HOST_LEN || (n <= 0 && n != RESOLVE_NONAME))
+        return;
+    lockprof_lock(&dns_lock);
+    strcpy(e->host, host);
+    if (n > 0)
+        memcpy(e->addr, addr, n * sizeof(addr_t));
+    e->naddr = n > 0 ? n : 0;
+    e->ttl = n > 0 || dns_ttl < DNS_NEGATIVE_TTL ? dns_ttl : DNS_NEGATIVE_TTL;
+    e->resolved = time(NULL);
+    lockprof_unlock(&dns_lock);
+}
+
+/*
+ * dns_lookup - Copy the addresses of host into addr, from the cache if
+ * it has a fresh entry. Returns their number, or -1.
+ */
+static int dns_lookup(const char *host, addr_t *addr) {
+    dns_entry_t *e = dns_slot(host);
+    int n = -1;
+
+    atomic_fetch_add(&lookups, 1);
+    if (dns_ttl > 0) {
+        lockprof_lock(&dns_lock);
+        if (e->resolved && time(NULL) - e->resolved < e->ttl && strcmp(e->host, host) == 0) {
+            n = e->naddr;
+            memcpy(addr, e->addr, n * sizeof(addr_t));
+        }
+        lockprof_unlock(&dns_lock);
+        if (n >= 0) {
+            atomic_fetch_add(&hits, 1);
+            return n > 0 ? n : -1;
+        }
+    }
+    atomic_fetch_add(&resolves, 1);
+    n = resolve(host, addr, &resolve_us);
+    if (dns_ttl > 0)
+        dns_store(host, addr, n);
+    return n > 0 ? n : -1;
+}
+
+/*
+ * dns_refresh - Resolve host again if its entry has addresses and is
+ * past three quarters of its lifetime, so it is replaced before it
+ * expires. A failure leaves the old entry to expire.
+ */
+static void dns_refresh(const char *host) {
+    dns_entry_t *e = dns_slot(host);
+    addr_t addr[DNS_ADDRS];
+    int due, n;
+
+    lockprof_lock(&dns_lock);
+    due = e->resolved && e->naddr > 0 && strcmp(e->host, host) == 0 &&
+          (time(NULL) - e->resolved) * 4 >= dns_ttl * 3;
+    lockprof_unlock(&dns_lock);
+    if (!due)
+        return;
+    atomic_fetch_add(&refreshes, 1);
+    if ((n = resolve(host, addr, &refresh_us)) > 0)
+        dns_store(host, addr, n);
+}
+
+/*
+ * preconnect_connect - Connect to host:port, trying each of its cached
+ * or resolved addresses in turn, with sockopt_connect_addr. Returns the
+ * descriptor, or a negative value as open_clientfd.
+ */
+int preconnect_connect(const char *host, const char *port, int fastopen) {
+    addr_t addr[DNS_ADDRS];
+    dns_entry_t *e;
+    int n, fd;
+
+    if ((n = dns_lookup(host, addr)) < 0)
+        return -2;
+    slowlog_mark(SLOW_DNS);
+    for (int i = 0; i < n; i++) {
+        if (addr[i].sa.sa_family == AF_INET6)
+            addr[i].in6.sin6_port = htons(atoi(port));
+        else
+            addr[i].in.sin_port = htons(atoi(port));
+        if ((fd = sockopt_connect_addr(&addr[i].sa, addr[i].sa.sa_family == AF_INET6 ?
+                                       sizeof(addr[i].in6) : sizeof(addr[i].in), fastopen)) >= 0)
+            return fd;
+    }
+
+    /* The host may have moved; look it up again next time */
+    if (dns_ttl > 0) {
+        e = dns_slot(host);
+        lockprof_lock(&dns_lock);
+        if (e->resolved && strcmp(e->host, host) == 0) {
+            e->resolved = 0;
+            atomic_fetch_add(&invalidated, 1);
+        }
+        lockprof_unlock(&dns_lock);
+    }
+    return -1;
+}
+
+/*
+ * find_origin - The slot of host:port (tls), taking a free or the
+ * coldest idle one if add is set. -1 if there is none. Caller holds
+ * origin_lock.
+ */
+static int find_origin(const char *host, int port, int tls, int add) {
+    int free_slot = -1;
+
+    for (int i = 0; i < origin_max; i++) {
+        origin_t *o = &origins[i];
+        if (!o->used) {
+            if (free_slot < 0 || origins[free_slot].used)
+                free_slot = i;
+        } else if (o->port == port && o->tls == tls && strcmp(o->host, host) == 0) {
+            return i;
+        } else if (o->in_use == 0 && (free_slot < 0 || (origins[free_slot].used && o->last < origins[free_slot].last))) {
+            free_slot = i;
+        }
+    }
+    if (!add || free_slot < 0 || strlen(host) >= HOST_LEN)
+        return -1;
+    memset(&origins[free_slot], 0, sizeof(origin_t));
+    strcpy(origins[free_slot].host, host);
+    origins[free_slot].port = port;
+    origins[free_slot].tls = tls;
+    origins[free_slot].used = 1;
+    return free_slot;
+}
+
+/*
+ * preconnect_note - Count a pooled connection to host:port handed to a
+ * request. Returns the origin's slot, to be passed to preconnect_done
+ * when the connection is given back, or -1 if origins are not tracked.
+ * A slot with connections in use is never given to another origin.
+ */
+int preconnect_note(const char *host, int port, int tls) {
+    origin_t *o;
+    int i;
+
+    if (!enabled)
+        return -1;
+    lockprof_lock(&origin_lock);
+    if ((i = find_origin(host, port, tls, 1)) >= 0) {
+        o = &origins[i];
+        o->last = time(NULL);
+        if (++o->in_use > o->peak)
+            o->peak = o->in_use;
+    }
+    lockprof_unlock(&origin_lock);
+    return i;
+}
+
+/*
+ * preconnect_done - A connection noted in slot is no longer in use.
+ */
+void preconnect_done(int slot) {
+    if (slot < 0)
+        return;
+    lockprof_lock(&origin_lock);
+    origins[slot].in_use--;
+    lockprof_unlock(&origin_lock);
+}
+
+/*
+ * seed - Add the origins most requested in the last SEED_BYTES of the
+ * access log path, as if each had just been used by one request.
+ */
+static void seed(const char *path) {
+    static struct { char host[HOST_LEN]; int port, tls, count; } seen[4 * MAX_HOT_ORIGINS];
+    char line[MAXLINE], *uri, *host, *end;
+    int nseen = 0, port, tls, best, i;
+    FILE *f = fopen(path, "r");
+    size_t hlen;
+
+    if (!f) {
+        fprintf(stderr, "preconnect_seed: cannot open %s\n", path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) > SEED_BYTES) {
+        fseek(f, -SEED_BYTES, SEEK_END);
+        if (!fgets(line, sizeof(line), f))  /* Skip the partial line */
+            line[0] = '\0';
+    } else {
+        rewind(f);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        /* "[time] client uri size ..." */
+        if (!(uri = strchr(line, ']')) || !(uri = strchr(uri + 2, ' ')))
+            continue;
+        uri++;
+        tls = strncmp(uri, "https://", 8) == 0;
+        if (!tls && strncmp(uri, "http://", 7) != 0)
+            continue;
+        host = uri + 7 + tls;
+        hlen = strcspn(host, ":/ \n");
+        if (hlen == 0 || hlen >= HOST_LEN)
+            continue;
+        port = host[hlen] == ':' ? (int)strtol(host + hlen + 1, &end, 10) : tls ? 443 : 80;
+        host[hlen] = '\0';
+        for (i = 0; i < nseen; i++)
+            if (seen[i].port == port && seen[i].tls == tls && strcmp(seen[i].host, host) == 0)
+                break;
+        if (i == nseen) {
+            if (nseen == (int)(sizeof(seen) / sizeof(seen[0])))
+                continue;
+            strcpy(seen[nseen].host, host);
+            seen[nseen].port = port;
+            seen[nseen].tls = tls;
+            seen[nseen++].count = 0;
+        }
+        seen[i].count++;
+    }
+    fclose(f);
+
+    lockprof_lock(&origin_lock);
+    for (int n = 0; n < origin_max; n++) {
+        best = -1;
+        for (i = 0; i < nseen; i++)
+            if (seen[i].count > 1 && (best < 0 || seen[i].count > seen[best].count))
+                best = i;
+        if (best < 0)
+            break;
+        if ((i = find_origin(seen[best].host, seen[best].port, seen[best].tls, 1)) >= 0) {
+            origins[i].demand = 256;
+            origins[i].last = time(NULL);
+            atomic_fetch_add(&seeded, 1);
+        }
+        seen[best].count = 0;
+    }
+    lockprof_unlock(&origin_lock);
+}
+
+/*
+ * preconnect_thread - Every interval, update each hot origin's demand,
+ * refresh its name and top up its warm connections.
+ */
+static void *preconnect_thread(void *vargp) {
+    static origin_t hot[MAX_HOT_ORIGINS];
+    int nhot, target;
+    time_t now;
+
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    for (;;) {
+        usleep(interval_us);
+        atomic_fetch_add(&rounds, 1);
+        now = time(NULL);
+        nhot = 0;
+        lockprof_lock(&origin_lock);
+        for (int i = 0; i < origin_max; i++) {
+            origin_t *o = &origins[i];
+            if (!o->used)
+                continue;
+            o->demand = o->demand * decay / 256;
+            if (o->demand < (unsigned)o->peak * 256)
+                o->demand = o->peak * 256;
+            o->peak = o->in_use;
+            if (now - o->last > idle_secs) {
+                if (o->in_use == 0)
+                    o->used = 0;
+                continue;
+            }
+            hot[nhot++] = *o;
+        }
+        lockprof_unlock(&origin_lock);
+
+        upstream_reap_idle();
+        for (int i = 0; i < nhot; i++) {
+            if (dns_ttl > 0)
+                dns_refresh(hot[i].host);
+            /* Enough connections for the usual peak, counting those in use */
+            target = (hot[i].demand + 255) / 256;
+            if (target > warm_max)
+                target = warm_max;
+            target -= hot[i].in_use;
+            if (target > 0)
+                atomic_fetch_add(&opened, upstream_preconnect(hot[i].host, hot[i].port, hot[i].tls, target));
+        }
+    }
+    return NULL;
+}
+
+/*
+ * preconnect_init - Cache resolved names for dns_ttl seconds (0 for
+ * none). If max_origins is positive, track that many hot origins,
+ * keeping up to max_per_origin warm connections to each, checked every
+ * interval_ms; an origin cools after idle_secs without requests. Seed
+ * the hot origins from the access log seed_log unless it is NULL.
+ */
+void preconnect_init(int ttl, int max_origins, int max_per_origin, int interval_ms, int idle, const char *seed_log) {
+    pthread_t tid;
+
+    dns_ttl = ttl > 0 ? ttl : 0;
+    if (max_origins <= 0)
+        return;
+    origin_max = max_origins < MAX_HOT_ORIGINS ? max_origins : MAX_HOT_ORIGINS;
+    warm_max = max_per_origin;
+    interval_us = (interval_ms > 0 ? interval_ms : 1000) * 1000L;
+    idle_secs = idle > 0 ? idle : 1;
+    /* Roughly exp(-interval / (idle_secs / 4)), to first order */
+    decay = interval_us / 1000 < idle_secs * 250L ? 256 - 256 * (interval_us / 1000) / (idle_secs * 250L) : 0;
+    enabled = 1;
+    if (seed_log)
+        seed(seed_log);
+    Pthread_create(&tid, NULL, preconnect_thread, NULL);
+}
+
+/*
+ * preconnect_stats - Print name cache and hot origin counters as
+ * "name value" lines.
+ */
+void preconnect_stats(FILE *out) {
+    int hot = 0, in_use = 0;
+    unsigned demand = 0;
+
+    lockprof_lock(&origin_lock);
+    for (int i = 0; i < origin_max; i++) {
+        if (origins[i].used) {
+            hot++;
+            in_use += origins[i].in_use;
+            demand += origins[i].demand;
+        }
+    }
+    lockprof_unlock(&origin_lock);
+    fprintf(out, "dns_cache_ttl %d\n", dns_ttl);
+    fprintf(out, "dns_lookups %lu\n", atomic_load(&lookups));
+    fprintf(out, "dns_cache_hits %lu\n", atomic_load(&hits));
+    fprintf(out, "dns_resolves %lu\n", atomic_load(&resolves));
+    fprintf(out, "dns_resolve_us %lu\n", atomic_load(&resolve_us));
+    fprintf(out, "dns_refreshes %lu\n", atomic_load(&refreshes));
+    fprintf(out, "dns_refresh_us %lu\n", atomic_load(&refresh_us));
+    fprintf(out, "dns_failures %lu\n", atomic_load(&failures));
+    fprintf(out, "dns_invalidated %lu\n", atomic_load(&invalidated));
+    fprintf(out, "preconnect_origins %d\n", hot);
+    fprintf(out, "preconnect_in_use %d\n", in_use);
+    fprintf(out, "preconnect_demand %.2f\n", demand / 256.0);
+    fprintf(out, "preconnect_seeded %lu\n", atomic_load(&seeded));
+    fprintf(out, "preconnect_rounds %lu\n", atomic_load(&rounds));
+    fprintf(out, "preconnect_opened %lu\n", atomic_load(&opened));
+}
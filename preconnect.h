@@ -0,0 +1,18 @@
+/*
+ * preconnect.h - Cached name resolution and warm connections to hot origins
+ */
+#ifndef __PRECONNECT_H__
+#define __PRECONNECT_H__
+
+#include <stdio.h>
+
+#define MAX_HOT_ORIGINS 64
+
+void preconnect_init(int dns_ttl, int max_origins, int max_per_origin, int interval_ms, int idle_secs,
+                     const char *seed_log);
+int preconnect_connect(const char *host, const char *port, int fastopen);
+int preconnect_note(const char *host, int port, int tls);
+void preconnect_done(int slot);
+void preconnect_stats(FILE *out);
+
+#endif /* __PRECONNECT_H__ */
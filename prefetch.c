@@ -0,0 +1,421 @@
+/*
+ * prefetch.c - Background prefetching of objects linked from HTML pages
+ *
+ * While a cacheable text/html response is relayed, its body is fed
+ * through a small streaming scanner that picks out src= and href=
+ * attribute values, whatever the chunk boundaries. Once the page is
+ * complete, same-origin links are queued for a single low-priority
+ * worker thread that fetches them into the cache, so the follow-up
+ * requests a browser makes for images and scripts can be cache hits.
+ *
+ * Budgets: at most max_queued prefetches may be queued or in flight in
+ * total, and at most max_per_origin for any one origin. Links beyond a
+ * budget are dropped, never delayed.
+ *
+ * A client that misses on a link before the worker gets to it would
+ * otherwise fetch it alongside the prefetch, which is then wasted. So a
+ * miss claims its URI first (prefetch_claim): a queued prefetch is
+ * dropped and the client fetches it, and one in flight is waited for,
+ * up to wait_ms, and then served from the cache.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "prefetch.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define MAX_PAGE_LINKS 32
+#define MAX_ORIGINS 64
+
+enum { S_TEXT, S_TAG, S_NAME, S_AFTER_NAME, S_VALUE_START, S_VALUE };
+
+struct prefetch_scan {
+    char origin[MAXLINE];      /* "http://host[:port]" of the page */
+    char dir[MAXLINE];         /* Page path up to and including the last '/' */
+    int state;
+    char name[8];              /* Current attribute name, truncated */
+    int nlen;
+    int capture;               /* Current value belongs to src or href */
+    char quote;                /* Quote around the current value, or 0 */
+    char value[MAXLINE];
+    int vlen;
+    int nlinks;
+    char *links[MAX_PAGE_LINKS];
+};
+
+typedef struct {
+    char origin[MAXLINE];
+    int pending;               /* Queued plus in flight */
+} origin_budget_t;
+
+static int prefetch_on = 0;
+static prefetch_fetch_t fetch_fn;
+static int queue_max, origin_max, wait_ms;
+
+static lockstat_t prefetch_stat = LOCKSTAT_INITIALIZER("prefetch");
+static lockprof_t prefetch_mutex = LOCKPROF_INITIALIZER(&prefetch_stat);
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fetched_cond = PTHREAD_COND_INITIALIZER;  /* current is done */
+static char **queue;            /* Ring of queued URIs */
+static int queue_head, queue_len, inflight;
+static const char *current;     /* URI the worker is fetching, or NULL */
+static origin_budget_t origins[MAX_ORIGINS];
+
+/* Statistics */
+static atomic_ulong scheduled, dropped, fetched, failed, used, claimed, joined;
+
+/*
+ * origin_of - Copy the "http://host[:port]" prefix of uri into origin.
+ * Returns -1 if uri is not an absolute http URI.
+ */
+static int origin_of(const char *uri, char *origin) {
+    size_t len;
+
+    if (strncasecmp(uri, "http://", 7) != 0)
+        return -1;
+    len = 7 + strcspn(uri + 7, "/?#");
+    if (len >= MAXLINE)
+        return -1;
+    memcpy(origin, uri, len);
+    origin[len] = '\0';
+    return 0;
+}
+
+/*
+ * origin_slot - Find the budget entry for origin, creating it if needed.
+ * Caller holds prefetch_mutex. Returns NULL if the table is full.
+ */
+static origin_budget_t *origin_slot(const char *origin) {
+    origin_budget_t *free_slot = NULL;
+
+    for (int i = 0; i < MAX_ORIGINS; i++) {
+        if (origins[i].pending && strcasecmp(origins[i].origin, origin) == 0)
+            return &origins[i];
+        if (!origins[i].pending && !free_slot)
+            free_slot = &origins[i];
+    }
+    if (free_slot)
+        strcpy(free_slot->origin, origin);
+    return free_slot;
+}
+
+/*
+ * release_budget - Give back the origin budget taken by uri. Caller holds
+ * prefetch_mutex.
+ */
+static void release_budget(const char *uri) {
+    char origin[MAXLINE];
+
+    origin_of(uri, origin);
+    for (int i = 0; i < MAX_ORIGINS; i++)
+        if (origins[i].pending && strcasecmp(origins[i].origin, origin) == 0)
+            origins[i].pending--;
+}
+
+/*
+ * prefetch_schedule - Queue uri for prefetching unless it is already
+ * queued or either budget is exhausted.
+ */
+static void prefetch_schedule(const char *origin, const char *uri) {
+    origin_budget_t *ob;
+
+    lockprof_lock(&prefetch_mutex);
+    for (int i = 0; i < queue_len; i++) {
+        if (strcmp(queue[(queue_head + i) % queue_max], uri) == 0) {
+            lockprof_unlock(&prefetch_mutex);
+            return;
+        }
+    }
+    if (queue_len + inflight >= queue_max || !(ob = origin_slot(origin)) || ob->pending >= origin_max) {
+        lockprof_unlock(&prefetch_mutex);
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    ob->pending++;
+    queue[(queue_head + queue_len++) % queue_max] = strdup(uri);
+    pthread_cond_signal(&prefetch_cond);
+    lockprof_unlock(&prefetch_mutex);
+    atomic_fetch_add(&scheduled, 1);
+}
+
+/*
+ * prefetch_worker - Fetch queued URIs one at a time at reduced CPU
+ * priority, skipping any that a client request has cached meanwhile.
+ */
+static void *prefetch_worker(void *vargp) {
+    char *uri;
+    cache_obj_t *obj;
+
+    pthread_detach(pthread_self());
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+    while (1) {
+        lockprof_lock(&prefetch_mutex);
+        while (queue_len == 0)
+            lockprof_wait(&prefetch_cond, &prefetch_mutex);
+        uri = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_max;
+        queue_len--;
+        inflight++;
+        current = uri;
+        lockprof_unlock(&prefetch_mutex);
+
+        if ((obj = cache_lookup(uri)) != NULL)
+            cache_release(obj);
+        else if (fetch_fn(uri) == 0)
+            atomic_fetch_add(&fetched, 1);
+        else
+            atomic_fetch_add(&failed, 1);
+
+        lockprof_lock(&prefetch_mutex);
+        inflight--;
+        current = NULL;
+        release_budget(uri);
+        pthread_cond_broadcast(&fetched_cond);
+        lockprof_unlock(&prefetch_mutex);
+        free(uri);
+    }
+    return NULL;
+}
+
+/*
+ * prefetch_init - Enable prefetching through fetch with the given
+ * budgets, and misses waiting up to wait for a prefetch of the same URI
+ * in flight, and start the worker thread. Until this is called,
+ * prefetch_scan_start returns NULL and nothing is scanned.
+ */
+void prefetch_init(prefetch_fetch_t fetch, int max_queued, int max_per_origin, int wait) {
+    pthread_t tid;
+
+    fetch_fn = fetch;
+    queue_max = max_queued > 0 ? max_queued : 1;
+    origin_max = max_per_origin > 0 ? max_per_origin : 1;
+    wait_ms = wait > 0 ? wait : 0;
+    queue = Calloc(queue_max, sizeof(char *));
+    Pthread_create(&tid, NULL, prefetch_worker, NULL);
+    prefetch_on = 1;
+}
+
+/*
+ * prefetch_scan_start - Begin scanning the body of the page at page_uri.
+ * Returns NULL when prefetching is off or the URI is not http.
+ */
+prefetch_scan_t *prefetch_scan_start(const char *page_uri) {
+    prefetch_scan_t *scan;
+    const char *path, *slash;
+
+    if (!prefetch_on)
+        return NULL;
+    scan = Calloc(1, sizeof(prefetch_scan_t));
+    if (origin_of(page_uri, scan->origin) < 0) {
+        free(scan);
+        return NULL;
+    }
+    path = page_uri + strlen(scan->origin);
+    slash = strrchr(path, '/');
+    if (*path == '/' && slash && (size_t)(slash - path + 1) < MAXLINE) {
+        memcpy(scan->dir, path, slash - path + 1);
+        scan->dir[slash - path + 1] = '\0';
+    } else {
+        strcpy(scan->dir, "/");
+    }
+    scan->state = S_TEXT;
+    return scan;
+}
+
+/*
+ * add_link - Resolve the attribute value just scanned against the page
+ * and keep it if it names another object on the same origin.
+ */
+static void add_link(prefetch_scan_t *scan) {
+    char link[MAXLINE], *v = scan->value;
+    size_t olen = strlen(scan->origin);
+    int n;
+
+    scan->value[scan->vlen] = '\0';
+    v[strcspn(v, "#")] = '\0';
+    if (*v == '\0' || scan->nlinks == MAX_PAGE_LINKS)
+        return;
+
+    if (strncasecmp(v, "http://", 7) == 0) {
+        n = snprintf(link, MAXLINE, "%s", v);
+    } else if (v[0] == '/' && v[1] == '/') {
+        n = snprintf(link, MAXLINE, "http:%s", v);
+    } else if (v[0] == '/') {
+        n = snprintf(link, MAXLINE, "%s%s", scan->origin, v);
+    } else if (v[strcspn(v, ":/")] == ':') {
+        return;  /* Another scheme: https:, mailto:, javascript:, data: ... */
+    } else {
+        n = snprintf(link, MAXLINE, "%s%s%s", scan->origin, scan->dir, v);
+    }
+    if (n < 0 || n >= MAXLINE)
+        return;
+    if (strncasecmp(link, scan->origin, olen) != 0 || (link[olen] != '/' && link[olen] != '\0'))
+        return;  /* Not same-origin */
+
+    for (int i = 0; i < scan->nlinks; i++)
+        if (strcmp(scan->links[i], link) == 0)
+            return;
+    scan->links[scan->nlinks++] = strdup(link);
+}
+
+static int name_is(prefetch_scan_t *scan, const char *name) {
+    return scan->nlen == (int)strlen(name) && strncasecmp(scan->name, name, scan->nlen) == 0;
+}
+
+/*
+ * prefetch_scan_feed - Advance the scanner over the next len bytes of
+ * the page body. State carries over between calls, so attribute values
+ * split across buffers are still found.
+ */
+void prefetch_scan_feed(prefetch_scan_t *scan, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+
+        switch (scan->state) {
+        case S_TEXT:
+            if (c == '<')
+                scan->state = S_TAG;
+            break;
+        case S_AFTER_NAME:
+            if (c == '=') {
+                scan->capture = name_is(scan, "src") || name_is(scan, "href");
+                scan->state = S_VALUE_START;
+                break;
+            }
+            if (isspace((unsigned char)c))
+                break;
+            /* Fall through: a new attribute or the end of the tag */
+        case S_TAG:
+            if (c == '>') {
+                scan->state = S_TEXT;
+            } else if (isalpha((unsigned char)c)) {
+                scan->name[0] = c;
+                scan->nlen = 1;
+                scan->state = S_NAME;
+            } else {
+                scan->state = S_TAG;
+            }
+            break;
+        case S_NAME:
+            if (isalnum((unsigned char)c) || c == '-') {
+                if (scan->nlen < (int)sizeof(scan->name))
+                    scan->name[scan->nlen] = c;
+                scan->nlen++;
+            } else if (c == '=') {
+                scan->capture = name_is(scan, "src") || name_is(scan, "href");
+                scan->state = S_VALUE_START;
+            } else if (c == '>') {
+                scan->state = S_TEXT;
+            } else {
+                scan->state = isspace((unsigned char)c) ? S_AFTER_NAME : S_TAG;
+            }
+            break;
+        case S_VALUE_START:
+            if (isspace((unsigned char)c))
+                break;
+            if (c == '>') {
+                scan->state = S_TEXT;
+                break;
+            }
+            scan->vlen = 0;
+            scan->state = S_VALUE;
+            if (c == '"' || c == '\'') {
+                scan->quote = c;
+                break;
+            }
+            scan->quote = 0;
+            /* Fall through: first character of an unquoted value */
+        case S_VALUE:
+            if (scan->quote ? c == scan->quote : (isspace((unsigned char)c) || c == '>')) {
+                if (scan->capture && scan->vlen < MAXLINE)
+                    add_link(scan);
+                scan->state = c == '>' ? S_TEXT : S_TAG;
+            } else if (scan->vlen < MAXLINE) {
+                /* A value that fills the buffer is too long to be a URI we want */
+                if (scan->vlen < MAXLINE - 1)
+                    scan->value[scan->vlen] = c;
+                scan->vlen++;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * prefetch_scan_finish - Queue the links found if schedule is set (the
+ * page turned out to be cacheable), then free the scanner.
+ */
+void prefetch_scan_finish(prefetch_scan_t *scan, int schedule) {
+    for (int i = 0; i < scan->nlinks; i++) {
+        if (schedule)
+            prefetch_schedule(scan->origin, scan->links[i]);
+        free(scan->links[i]);
+    }
+    free(scan);
+}
+
+/*
+ * prefetch_claim - Called on a client miss for uri. If uri is queued
+ * for prefetching, drop it, as the client's own fetch will cache it. If
+ * it is being prefetched, wait for that to finish, up to wait_ms.
+ * Returns 1 if it waited, so the caller should look in the cache again.
+ */
+int prefetch_claim(const char *uri) {
+    struct timespec deadline;
+    int i, waited = 0;
+
+    if (!prefetch_on)
+        return 0;
+    lockprof_lock(&prefetch_mutex);
+    for (i = 0; i < queue_len; i++)
+        if (strcmp(queue[(queue_head + i) % queue_max], uri) == 0)
+            break;
+    if (i < queue_len) {
+        free(queue[(queue_head + i) % queue_max]);
+        for (; i < queue_len - 1; i++)
+            queue[(queue_head + i) % queue_max] = queue[(queue_head + i + 1) % queue_max];
+        queue_len--;
+        release_budget(uri);
+        atomic_fetch_add(&claimed, 1);
+    } else if (current && strcmp(current, uri) == 0 && wait_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (current && strcmp(current, uri) == 0 &&
+               lockprof_timedwait(&fetched_cond, &prefetch_mutex, &deadline) == 0)
+            ;
+        atomic_fetch_add(&joined, 1);
+        waited = 1;
+    }
+    lockprof_unlock(&prefetch_mutex);
+    return waited;
+}
+
+/*
+ * prefetch_hit - Count the first client hit on a prefetched object.
+ */
+void prefetch_hit(cache_obj_t *obj) {
+    if (atomic_exchange(&obj->prefetched, 0))
+        atomic_fetch_add(&used, 1);
+}
+
+/*
+ * prefetch_stats - Print prefetch counters as "name value" lines. The
+ * wasted ratio counts fetched objects no client has asked for yet.
+ */
+void prefetch_stats(FILE *out) {
+    unsigned long nfetched = atomic_load(&fetched), nused = atomic_load(&used);
+
+    fprintf(out, "prefetch_scheduled %lu\n", atomic_load(&scheduled));
+    fprintf(out, "prefetch_dropped %lu\n", atomic_load(&dropped));
+    fprintf(out, "prefetch_fetched %lu\n", nfetched);
+    fprintf(out, "prefetch_failed %lu\n", atomic_load(&failed));
+    fprintf(out, "prefetch_used %lu\n", nused);
+    fprintf(out, "prefetch_claimed %lu\n", atomic_load(&claimed));
+    fprintf(out, "prefetch_joined %lu\n", atomic_load(&joined));
+    fprintf(out, "prefetch_wasted_ratio %.4f\n", nfetched ? 1.0 - (double)nused / nfetched : 0.0);
+}
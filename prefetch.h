@@ -0,0 +1,24 @@
+/*
+ * prefetch.h - Background prefetching of objects linked from HTML pages
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include "cache.h"
+
+/* Fetch uri from its origin into the cache; returns 0 on success */
+typedef int (*prefetch_fetch_t)(const char *uri);
+
+typedef struct prefetch_scan prefetch_scan_t;
+
+void prefetch_init(prefetch_fetch_t fetch, int max_queued, int max_per_origin, int wait_ms);
+prefetch_scan_t *prefetch_scan_start(const char *page_uri);
+void prefetch_scan_feed(prefetch_scan_t *scan, const char *buf, size_t len);
+void prefetch_scan_finish(prefetch_scan_t *scan, int schedule);
+int prefetch_claim(const char *uri);
+void prefetch_hit(cache_obj_t *obj);
+void prefetch_stats(FILE *out);
+
+#endif /* __PREFETCH_H__ */
@@ -29,7 +29,7 @@ int blocklist_count = 0;
  * Function prototypes
  */
 int parse_uri(char *uri, char *target_addr, char *path, int *port);
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size);
+void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, long long size);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 void read_blocklist(const char *filename);
 void proxy(int connfd, FILE *log, struct sockaddr_in clientaddr);
@@ -78,7 +78,8 @@ int main(int argc, char **argv) {
  * server if not blocked, and returning the response to the client. It also logs the request.
  */
 void proxy(int connfd, FILE *log, struct sockaddr_in clientaddr) {
-    int clientfd, port, size = 0;
+    int clientfd, port, tls;
+    long long size = 0;
     ssize_t n;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char hostname[MAXLINE], pathname[MAXLINE], port_str[6];
@@ -95,10 +96,15 @@ void proxy(int connfd, FILE *log, struct sockaddr_in clientaddr) {
     }
 
     // Enhanced URI parsing and blocklist checking
-    if (parse_uri(uri, hostname, pathname, &port) < 0) {
+    if ((tls = parse_uri(uri, hostname, pathname, &port)) < 0) {
         clienterror(connfd, uri, "400", "Bad Request", "Cannot parse the request");
         return;
     }
+    if (tls) {
+        // Only the concurrent proxy speaks TLS to origins
+        clienterror(connfd, uri, "501", "Not Implemented", "HTTPS origins are not supported by this proxy");
+        return;
+    }
 
     for (int i = 0; i < blocklist_count; i++) {
         if (strcasecmp(hostname, blocklist[i]) == 0) { // Case-insensitive comparison of hostname and blocklist
@@ -171,15 +177,17 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
  * Given a URI from an HTTP proxy GET request (i.e., a URL), extract
  * the host name, path name, and port.  The memory for hostname and
  * pathname must already be allocated and should be at least MAXLINE
- * bytes. Return -1 if there are any problems.
+ * bytes. Return 1 for an https URI, 0 for http, or -1 if there are any problems.
  */
 int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
     char *hostbegin, *hostend, *pathbegin;
-    int len;
+    int len, tls;
 
     if (strncasecmp(uri, "http://", 7) == 0) {
+        tls = 0;
         hostbegin = uri + 7;
     } else if (strncasecmp(uri, "https://", 8) == 0) {
+        tls = 1;
         hostbegin = uri + 8;
     } else {
         hostname[0] = '\0';
@@ -187,7 +195,6 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
     }
 
     /* Extract the host name */
-    hostbegin = uri + 7;  // Move past "http://"
     hostend = strpbrk(hostbegin, " :/\r\n\0");
     if (!hostend) {
         hostname[0] = '\0';
@@ -198,7 +205,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
     hostname[len] = '\0';
 
     /* Extract the port number */
-    *port = 80; // Default HTTP port
+    *port = tls ? 443 : 80; // Default HTTPS or HTTP port
     if (*hostend == ':') {
         *port = atoi(hostend + 1);
     }
@@ -211,7 +218,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
         strcpy(pathname, "/");  // Default to root path if none is specified
     }
 
-    return 0;
+    return tls;
 }
 
 /*
@@ -221,7 +228,7 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port) {
  * (sockaddr), the URI from the request (uri), and the size in bytes
  * of the response from the server (size).
  */
-void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size) {
+void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, long long size) {
     time_t now;
     char time_str[MAXLINE];
     char host_ip[INET_ADDRSTRLEN];
@@ -234,5 +241,5 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri,
     inet_ntop(AF_INET, &(sockaddr->sin_addr), host_ip, INET_ADDRSTRLEN);
 
     /* Create the log entry */
-    sprintf(logstring, "[%s] %s %s %d", time_str, host_ip, uri, size);
+    sprintf(logstring, "[%s] %s %s %lld", time_str, host_ip, uri, size);
 }
\ No newline at end of file
@@ -0,0 +1,704 @@
+/*
+ * proxystat.c - Summarize proxy access logs
+ *
+ * usage: proxystat [-k top] [-j threads] [-d day] [-m] log...
+ *
+ * Reads the access logs the proxies write (proxy.log) and prints the
+ * top URLs, origin hosts and clients by requests and by bytes, request
+ * and byte rates per minute, and the distribution of response sizes.
+ * "aggregate" lines (log_mode aggregate or sampled) count towards the
+ * hosts and rates; they name no URL, client or single size. The full
+ * lines those modes still write (samples, errors, slow requests) are
+ * marked aggregated=1, as their requests are in the aggregates too, and
+ * count towards the URLs and clients only. Hosts are keyed as host:port
+ * in both kinds of line.
+ *
+ *   -k top      entries in each top list (default 10)
+ *   -j threads  parsing threads (default one per online CPU)
+ *   -d day      only lines from day: "today", "yesterday" or as logged,
+ *               e.g. "02 May 2024"
+ *   -m          print every minute's requests and bytes
+ *
+ * The logs are mapped into memory and cut into blocks, which the threads
+ * take in turn. Each thread parses lines in place, counting into hash
+ * tables keyed by pointers into the mapping, so nothing is copied. Every
+ * table is split into as many parts as there are threads by the key's
+ * hash; once parsing is done, thread p merges part p of every thread's
+ * table and keeps its top entries, and the main thread only combines
+ * those short lists.
+ */
+#include "csapp.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define BLOCK_SIZE (16 << 20)   /* Bytes of log a thread takes at a time */
+#define MAX_THREADS 64
+#define MAX_TOP 1000
+#define SIZE_BUCKETS 42         /* 0, then powers of two up to 2^40 */
+#define HOST_KEY 300            /* Room for a host name and ":port" */
+
+/* What a key counts */
+#define KIND_URL 0
+#define KIND_HOST 1
+#define KIND_CLIENT 2
+#define KINDS 3
+
+typedef struct {
+    const char *key;            /* In the mapped log or copied; NULL if the slot is free */
+    uint32_t len;
+    uint32_t hash;
+    uint64_t count, bytes;
+} entry_t;
+
+typedef struct {
+    entry_t *slots;
+    size_t mask, used;
+} table_t;
+
+/* Requests and bytes in one minute, keyed by minutes since the epoch */
+typedef struct {
+    int64_t minute;             /* -1 if the slot is free */
+    uint64_t count, bytes;
+} minute_t;
+
+typedef struct {
+    minute_t *slots;
+    size_t mask, used;
+} minutes_t;
+
+typedef struct {
+    int id;
+    table_t *parts[KINDS];      /* One table per merge thread */
+    minutes_t minutes;
+    uint64_t sizes[SIZE_BUCKETS];
+    uint64_t lines, requests, aggregated, bytes, skipped;
+    entry_t *top[KINDS][2];     /* After merging: best by count, by bytes */
+    int ntop[KINDS][2];
+} worker_t;
+
+typedef struct {
+    const char *data;
+    size_t len;
+} logfile_t;
+
+typedef struct {
+    int file;
+    size_t start, end;
+} block_t;
+
+static const char *kind_names[KINDS] = { "URLs", "hosts", "clients" };
+
+static int nthreads, top_k = 10;
+static char day[16];            /* "DD Mon YYYY" to keep, or "" for all */
+static logfile_t *files;
+static block_t *blocks;
+static int nblocks;
+static atomic_int next_block;
+static worker_t workers[MAX_THREADS];
+static pthread_barrier_t parsed;
+
+/*
+ * hash_bytes - Hash len bytes at s, eight at a time.
+ */
+static uint32_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return (uint32_t)(h ^ (h >> 29));
+}
+
+static void table_init(table_t *t, size_t size) {
+    t->slots = Calloc(size, sizeof(entry_t));
+    t->mask = size - 1;
+    t->used = 0;
+}
+
+static void table_grow(table_t *t);
+
+/*
+ * table_add - Add count requests and bytes to key (len bytes, hash h).
+ * A key that does not point into the mapping (copy set) is copied when
+ * it is first added.
+ */
+static void table_add(table_t *t, const char *key, uint32_t len, uint32_t h, uint64_t count, uint64_t bytes,
+                      int copy) {
+    entry_t *e;
+    size_t i;
+
+    for (i = h & t->mask;; i = (i + 1) & t->mask) {
+        e = &t->slots[i];
+        if (!e->key)
+            break;
+        if (e->hash == h && e->len == len && memcmp(e->key, key, len) == 0) {
+            e->count += count;
+            e->bytes += bytes;
+            return;
+        }
+    }
+    if (copy) {
+        char *k = Malloc(len);
+        memcpy(k, key, len);
+        key = k;
+    }
+    e->key = key;
+    e->len = len;
+    e->hash = h;
+    e->count = count;
+    e->bytes = bytes;
+    if (++t->used * 2 > t->mask)
+        table_grow(t);
+}
+
+static void table_grow(table_t *t) {
+    table_t old = *t;
+
+    table_init(t, (old.mask + 1) * 2);
+    for (size_t i = 0; i <= old.mask; i++) {
+        entry_t *e = &old.slots[i];
+        if (e->key)
+            table_add(t, e->key, e->len, e->hash, e->count, e->bytes, 0);
+    }
+    free(old.slots);
+}
+
+static void minutes_init(minutes_t *m, size_t size) {
+    m->slots = Malloc(size * sizeof(minute_t));
+    for (size_t i = 0; i < size; i++)
+        m->slots[i].minute = -1;
+    m->mask = size - 1;
+    m->used = 0;
+}
+
+/*
+ * minutes_add - Add count requests and bytes to minute.
+ */
+static void minutes_add(minutes_t *m, int64_t minute, uint64_t count, uint64_t bytes) {
+    minute_t *s;
+    size_t i;
+
+    for (i = (uint64_t)minute * 0x9e3779b97f4a7c15ULL >> 20 & m->mask;; i = (i + 1) & m->mask) {
+        s = &m->slots[i];
+        if (s->minute == minute || s->minute < 0)
+            break;
+    }
+    if (s->minute < 0) {
+        s->minute = minute;
+        s->count = 0;
+        s->bytes = 0;
+        if (++m->used * 2 > m->mask) {
+            minutes_t old = *m;
+            minutes_init(m, (old.mask + 1) * 2);
+            for (i = 0; i <= old.mask; i++)
+                if (old.slots[i].minute >= 0)
+                    minutes_add(m, old.slots[i].minute, old.slots[i].count, old.slots[i].bytes);
+            free(old.slots);
+            minutes_add(m, minute, count, bytes);
+            return;
+        }
+    }
+    s->count += count;
+    s->bytes += bytes;
+}
+
+/*
+ * days_from_civil - Days from 1970-01-01 to y-m-d (proleptic Gregorian).
+ */
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+static int month_of(const char *s) {
+    static const char *names = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    for (int i = 0; i < 12; i++)
+        if (memcmp(names + 3 * i, s, 3) == 0)
+            return i + 1;
+    return 0;
+}
+
+static int two(const char *s) {
+    return (s[0] - '0') * 10 + (s[1] - '0');
+}
+
+/*
+ * minute_of - Minutes since the epoch of a timestamp "Www DD Mon YYYY
+ * HH:MM:SS TZ" (the zone is ignored), or -1 if it is not one.
+ */
+static int64_t minute_of(const char *s, size_t len) {
+    int mon;
+
+    if (len < 22 || s[3] != ' ' || s[6] != ' ' || s[10] != ' ' || s[15] != ' ' || s[18] != ':' ||
+        !(mon = month_of(s + 7)))
+        return -1;
+    return (days_from_civil(two(s + 11) * 100 + two(s + 13), mon, two(s + 4)) * 24 + two(s + 16)) * 60 +
+           two(s + 19);
+}
+
+static int size_bucket(uint64_t bytes) {
+    int b = 0;
+
+    while (bytes && b < SIZE_BUCKETS - 1) {
+        bytes >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/*
+ * count - Count one request (or count aggregated ones) for the key of
+ * a kind. copy is set if key is not in the mapping.
+ */
+static void count(worker_t *w, int kind, const char *key, size_t len, uint64_t n, uint64_t bytes, int copy) {
+    uint32_t h = hash_bytes(key, len);
+
+    /* The part by the hash's high bits, as the slot is by its low ones */
+    table_add(&w->parts[kind][(uint64_t)h * nthreads >> 32], key, len, h, n, bytes, copy);
+}
+
+/*
+ * host_of - The host[:port] of a URI, absolute or as an authority.
+ */
+static const char *host_of(const char *uri, size_t len, size_t *hlen) {
+    const char *p = memchr(uri, ':', len > 8 ? 8 : len);
+
+    if (p && p + 2 < uri + len && p[1] == '/' && p[2] == '/') {
+        len -= p + 3 - uri;
+        uri = p + 3;
+    }
+    p = memchr(uri, '/', len);
+    *hlen = p ? (size_t)(p - uri) : len;
+    return uri;
+}
+
+/*
+ * host_key - The host:port of a URI, as host_of, with the scheme's
+ * default port (80, or 443 for https) written into buf (HOST_KEY bytes)
+ * if the URI has none, so that it matches the origin= of aggregates.
+ */
+static const char *host_key(const char *uri, size_t len, char *buf, size_t *hlen) {
+    const char *host = host_of(uri, len, hlen), *start = memchr(host, ']', *hlen);
+
+    if (!start)
+        start = host;
+    if (memchr(start, ':', *hlen - (start - host)) || *hlen + 5 > HOST_KEY)
+        return host;
+    memcpy(buf, host, *hlen);
+    *hlen += sprintf(buf + *hlen, ":%d", len > 8 && memcmp(uri, "https://", 8) == 0 ? 443 : 80);
+    return buf;
+}
+
+/*
+ * field - The value of name= among the fields in [s, end), or NULL.
+ */
+static const char *field(const char *s, const char *end, const char *name, size_t nlen) {
+    for (; s + nlen < end; s++)
+        if (s[0] == name[0] && s[-1] == ' ' && memcmp(s, name, nlen) == 0)
+            return s + nlen;
+    return NULL;
+}
+
+/*
+ * number - The decimal number at s, reading no further than end.
+ */
+static uint64_t number(const char *s, const char *end) {
+    uint64_t n = 0;
+
+    for (; s < end && *s >= '0' && *s <= '9'; s++)
+        n = n * 10 + (*s - '0');
+    return n;
+}
+
+/*
+ * parse_line - Count one log line, [s, end) without its newline:
+ *   [Www DD Mon YYYY HH:MM:SS TZ] client uri bytes [name=value ...]
+ *   [Www DD Mon YYYY HH:MM:SS TZ] aggregate origin=host:port ... count=n bytes=n ...
+ */
+static void parse_line(worker_t *w, const char *s, const char *end) {
+    const char *close, *client, *uri, *num, *v;
+    char key[HOST_KEY];
+    size_t clen, ulen, hlen;
+    uint64_t bytes = 0, n = 1;
+    int64_t minute;
+
+    w->lines++;
+    if (end - s < 24 || s[0] != '[' || !(close = memchr(s, ']', end - s)) || close + 2 >= end) {
+        w->skipped++;
+        return;
+    }
+    if (day[0] && memcmp(s + 5, day, 11) != 0)
+        return;
+    minute = minute_of(s + 1, close - s - 1);
+    client = close + 2;
+
+    if (end - client > 10 && memcmp(client, "aggregate ", 10) == 0) {
+        if (!(v = field(client, end, "origin=", 7)) || !(num = field(client, end, "count=", 6))) {
+            w->skipped++;
+            return;
+        }
+        n = number(num, end);
+        for (hlen = 0; v + hlen < end && v[hlen] != ' '; hlen++)
+            ;
+        if ((num = field(client, end, "bytes=", 6)) != NULL)
+            bytes = number(num, end);
+        count(w, KIND_HOST, v, hlen, n, bytes, 0);
+        w->aggregated += n;
+    } else {
+        if (!(uri = memchr(client, ' ', end - client))) {
+            w->skipped++;
+            return;
+        }
+        clen = uri - client;
+        uri++;
+        if (!(num = memchr(uri, ' ', end - uri)))
+            num = end;
+        ulen = num - uri;
+        bytes = number(num + 1, end);
+        count(w, KIND_URL, uri, ulen, 1, bytes, 0);
+        count(w, KIND_CLIENT, client, clen, 1, bytes, 0);
+        /* Already counted in an aggregate line for everything else */
+        for (num++; num < end && *num >= '0' && *num <= '9'; num++)
+            ;
+        if (end - num >= 13 && memcmp(num, " aggregated=1", 13) == 0)
+            return;
+        v = host_key(uri, ulen, key, &hlen);
+        count(w, KIND_HOST, v, hlen, 1, bytes, v == key);
+        w->sizes[size_bucket(bytes)]++;
+    }
+    w->requests += n;
+    w->bytes += bytes;
+    if (minute >= 0)
+        minutes_add(&w->minutes, minute, n, bytes);
+}
+
+/*
+ * parse_block - Count the lines that start in block b. A block that
+ * starts mid-line leaves that line to the block before it, which reads
+ * on past its end to finish its last line.
+ */
+static void parse_block(worker_t *w, block_t *b) {
+    const char *data = files[b->file].data, *file_end = data + files[b->file].len;
+    const char *s = data + b->start, *end = data + b->end, *nl;
+
+    if (b->start > 0 && s[-1] != '\n') {
+        if (!(nl = memchr(s, '\n', file_end - s)))
+            return;
+        s = nl + 1;
+    }
+    while (s < end) {
+        if (!(nl = memchr(s, '\n', file_end - s)))
+            nl = file_end;
+        if (nl > s)
+            parse_line(w, s, nl);
+        s = nl + 1;
+    }
+}
+
+/*
+ * keep_top - Offer e to a list of the k best entries by count (by_bytes
+ * clear) or bytes, kept as a min-heap in top (*n entries so far).
+ */
+static void keep_top(entry_t *top, int *n, int k, const entry_t *e, int by_bytes) {
+#define KEY(x) (by_bytes ? (x).bytes : (x).count)
+    int i, c;
+
+    if (*n < k) {
+        /* Sift up */
+        for (i = (*n)++; i > 0 && KEY(top[(i - 1) / 2]) > KEY(*e); i = (i - 1) / 2)
+            top[i] = top[(i - 1) / 2];
+        top[i] = *e;
+        return;
+    }
+    if (k == 0 || KEY(*e) <= KEY(top[0]))
+        return;
+    /* Replace the smallest and sift down */
+    for (i = 0; (c = 2 * i + 1) < k; i = c) {
+        if (c + 1 < k && KEY(top[c + 1]) < KEY(top[c]))
+            c++;
+        if (KEY(top[c]) >= KEY(*e))
+            break;
+        top[i] = top[c];
+    }
+    top[i] = *e;
+#undef KEY
+}
+
+/*
+ * merge - Merge part p of every worker's tables for each kind, keeping
+ * the top entries in workers[p].
+ */
+static void merge(int p) {
+    worker_t *w = &workers[p];
+    table_t all;
+
+    for (int kind = 0; kind < KINDS; kind++) {
+        size_t total = 0, size = 16;
+        for (int t = 0; t < nthreads; t++)
+            total += workers[t].parts[kind][p].used;
+        while (size < total * 2 + 2)
+            size <<= 1;
+        table_init(&all, size);
+        for (int t = 0; t < nthreads; t++) {
+            table_t *part = &workers[t].parts[kind][p];
+            for (size_t i = 0; i <= part->mask; i++) {
+                entry_t *e = &part->slots[i];
+                if (e->key)
+                    table_add(&all, e->key, e->len, e->hash, e->count, e->bytes, 0);
+            }
+        }
+        for (int by = 0; by < 2; by++) {
+            w->top[kind][by] = Malloc(top_k * sizeof(entry_t));
+            w->ntop[kind][by] = 0;
+        }
+        for (size_t i = 0; i <= all.mask; i++) {
+            if (all.slots[i].key) {
+                keep_top(w->top[kind][0], &w->ntop[kind][0], top_k, &all.slots[i], 0);
+                keep_top(w->top[kind][1], &w->ntop[kind][1], top_k, &all.slots[i], 1);
+            }
+        }
+        free(all.slots);
+    }
+}
+
+static void *worker(void *vargp) {
+    worker_t *w = vargp;
+    int b;
+
+    while ((b = atomic_fetch_add(&next_block, 1)) < nblocks)
+        parse_block(w, &blocks[b]);
+    pthread_barrier_wait(&parsed);
+    merge(w->id);
+    return NULL;
+}
+
+static int by_count(const void *a, const void *b) {
+    const entry_t *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int by_bytes(const void *a, const void *b) {
+    const entry_t *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static int by_minute(const void *a, const void *b) {
+    const minute_t *x = a, *y = b;
+    return x->minute < y->minute ? -1 : x->minute > y->minute;
+}
+
+/*
+ * print_minute - Print minute as "YYYY-MM-DD HH:MM".
+ */
+static void print_minute(int64_t minute) {
+    time_t t = minute * 60;
+    struct tm tm;
+    char buf[32];
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+    printf("%s", buf);
+}
+
+/*
+ * human - Format bytes with a binary unit.
+ */
+static const char *human(uint64_t bytes, char *buf) {
+    static const char *units = "BKMGTP";
+    double v = bytes;
+    int u = 0;
+
+    while (v >= 1024 && u < 5) {
+        v /= 1024;
+        u++;
+    }
+    sprintf(buf, u ? "%.1f%c" : "%.0f%c", v, units[u]);
+    return buf;
+}
+
+static void report(int print_minutes, double secs, size_t input) {
+    uint64_t lines = 0, requests = 0, aggregated = 0, bytes = 0, skipped = 0, sizes[SIZE_BUCKETS] = { 0 };
+    entry_t *top = Malloc((size_t)nthreads * top_k * sizeof(entry_t));
+    minutes_t all;
+    minute_t *list, *peak = NULL;
+    size_t nmin = 0;
+    int n;
+    char h1[16], h2[16];
+
+    minutes_init(&all, 1024);
+    for (int t = 0; t < nthreads; t++) {
+        worker_t *w = &workers[t];
+        lines += w->lines;
+        requests += w->requests;
+        aggregated += w->aggregated;
+        bytes += w->bytes;
+        skipped += w->skipped;
+        for (int i = 0; i < SIZE_BUCKETS; i++)
+            sizes[i] += w->sizes[i];
+        for (size_t i = 0; i <= w->minutes.mask; i++)
+            if (w->minutes.slots[i].minute >= 0)
+                minutes_add(&all, w->minutes.slots[i].minute, w->minutes.slots[i].count, w->minutes.slots[i].bytes);
+    }
+
+    printf("%llu lines, %llu requests (%llu from aggregates), %s, %llu lines skipped\n",
+           (unsigned long long)lines, (unsigned long long)requests, (unsigned long long)aggregated,
+           human(bytes, h1), (unsigned long long)skipped);
+    printf("read %s in %.3f s with %d threads (%.0f MB/s)\n", human(input, h2), secs, nthreads,
+           input / secs / 1e6);
+
+    for (int kind = 0; kind < KINDS; kind++) {
+        for (int by = 0; by < 2; by++) {
+            n = 0;
+            for (int t = 0; t < nthreads; t++) {
+                memcpy(top + n, workers[t].top[kind][by], workers[t].ntop[kind][by] * sizeof(entry_t));
+                n += workers[t].ntop[kind][by];
+            }
+            qsort(top, n, sizeof(entry_t), by ? by_bytes : by_count);
+            printf("\nTop %s by %s\n", kind_names[kind], by ? "bytes" : "requests");
+            for (int i = 0; i < n && i < top_k; i++)
+                printf("%12llu %10s  %.*s\n", (unsigned long long)top[i].count, human(top[i].bytes, h1),
+                       (int)top[i].len, top[i].key);
+        }
+    }
+
+    list = Malloc((all.used + 1) * sizeof(minute_t));
+    for (size_t i = 0; i <= all.mask; i++)
+        if (all.slots[i].minute >= 0)
+            list[nmin++] = all.slots[i];
+    qsort(list, nmin, sizeof(minute_t), by_minute);
+    printf("\nPer minute\n");
+    for (size_t i = 0; i < nmin; i++)
+        if (!peak || list[i].count > peak->count)
+            peak = &list[i];
+    if (peak) {
+        int64_t span = list[nmin - 1].minute - list[0].minute + 1;
+        printf("%lld minutes with requests over %lld; mean %.1f requests, %s per active minute\n",
+               (long long)nmin, (long long)span, (double)requests / nmin, human(bytes / nmin, h1));
+        printf("peak ");
+        print_minute(peak->minute);
+        printf(": %llu requests, %s\n", (unsigned long long)peak->count, human(peak->bytes, h1));
+    }
+    if (print_minutes) {
+        for (size_t i = 0; i < nmin; i++) {
+            print_minute(list[i].minute);
+            printf(" %10llu %10s\n", (unsigned long long)list[i].count, human(list[i].bytes, h1));
+        }
+    }
+
+    printf("\nResponse sizes\n");
+    for (int i = 0; i < SIZE_BUCKETS; i++) {
+        if (!sizes[i])
+            continue;
+        if (i == 0)
+            printf("%10s ", "0");
+        else
+            printf("%10s ", human(1ULL << (i - 1), h1));
+        printf("%12llu %5.1f%%\n", (unsigned long long)sizes[i], 100.0 * sizes[i] / (requests - aggregated));
+    }
+    free(list);
+    free(top);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-k top] [-j threads] [-d today|yesterday|\"DD Mon YYYY\"] [-m] log...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, print_minutes = 0, nfiles;
+    struct timespec start, end;
+    pthread_t tids[MAX_THREADS];
+    struct stat st;
+    size_t input = 0;
+    time_t now;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "k:j:d:m")) != -1) {
+        switch (opt) {
+        case 'k':
+            top_k = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            now = time(NULL);
+            if (strcmp(optarg, "today") == 0 || strcmp(optarg, "yesterday") == 0) {
+                if (optarg[0] == 'y')
+                    now -= 86400;
+                strftime(day, sizeof(day), "%d %b %Y", localtime(&now));
+            } else {
+                snprintf(day, sizeof(day), "%s", optarg);
+            }
+            if (strlen(day) != 11)
+                usage(argv[0]);
+            break;
+        case 'm':
+            print_minutes = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc)
+        usage(argv[0]);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    if (top_k < 1 || top_k > MAX_TOP)
+        top_k = 10;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nfiles = argc - optind;
+    files = Calloc(nfiles, sizeof(logfile_t));
+    for (int f = 0; f < nfiles; f++) {
+        int fd = Open(argv[optind + f], O_RDONLY, 0);
+        Fstat(fd, &st);
+        files[f].len = st.st_size;
+        if (st.st_size > 0) {
+            files[f].data = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            madvise((void *)files[f].data, st.st_size, MADV_WILLNEED);
+        }
+        Close(fd);
+        input += st.st_size;
+        nblocks += (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    blocks = Calloc(nblocks + 1, sizeof(block_t));
+    nblocks = 0;
+    for (int f = 0; f < nfiles; f++) {
+        for (size_t off = 0; off < files[f].len; off += BLOCK_SIZE) {
+            blocks[nblocks].file = f;
+            blocks[nblocks].start = off;
+            blocks[nblocks++].end = off + BLOCK_SIZE < files[f].len ? off + BLOCK_SIZE : files[f].len;
+        }
+    }
+
+    pthread_barrier_init(&parsed, NULL, nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].id = t;
+        for (int kind = 0; kind < KINDS; kind++) {
+            workers[t].parts[kind] = Malloc(nthreads * sizeof(table_t));
+            for (int p = 0; p < nthreads; p++)
+                table_init(&workers[t].parts[kind][p], 1024);
+        }
+        minutes_init(&workers[t].minutes, 1024);
+        Pthread_create(&tids[t], NULL, worker, &workers[t]);
+    }
+    for (int t = 0; t < nthreads; t++)
+        Pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(print_minutes, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, input);
+    return 0;
+}
@@ -0,0 +1,587 @@
+/*
+ * relay.c - Bounded-memory relay from one socket to another
+ *
+ * Upstream reads and client writes are decoupled through a per-relay
+ * ring buffer. The upstream side reads ahead while the buffer holds less
+ * than the read-ahead limit and then stops reading, so a slow client
+ * pushes back on the origin through TCP flow control instead of growing
+ * the proxy's memory. The buffer is allocated lazily and only grows (up
+ * to the limit) when the client falls behind.
+ *
+ * The upstream descriptor is closed as soon as it reaches EOF, even if
+ * the client is still draining the buffer, so an origin connection is
+ * held no longer than it takes to read the response.
+ *
+ * The same relay carries request bodies the other way (client to
+ * origin); there the source is not closed and reading stops after a
+ * known number of bytes rather than at EOF. Either end may be an origin
+ * connection (upstream.c), read or written through it so that TLS
+ * connections are relayed like plain ones.
+ *
+ * CONNECT tunnels use relay_tunnel instead, which moves bytes in both
+ * directions with splice through a pipe per direction, so tunnel
+ * payload never enters user space. A one-way relay with zero_copy set
+ * does the same when nothing needs to see the bytes (no filter, no tap,
+ * plain sockets at both ends): large uncacheable bodies then stream at
+ * socket speed in the pipe's fixed 64 KB, whatever their length.
+ * relay_set_splice(0), or running out of descriptors for the pipes,
+ * makes both copy through user space instead (a 64 KB buffer per tunnel
+ * direction).
+ */
+#include "csapp.h"
+#include "relay.h"
+#include "upstream.h"
+#include <poll.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+
+/* splice is a GNU extension, and csapp.h cannot be built with
+ * _GNU_SOURCE (its gai_error clashes with glibc's), so declare it here. */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+ssize_t splice(int fd_in, long long *off_in, int fd_out, long long *off_out, size_t len, unsigned int flags);
+#endif
+
+#define RELAY_MIN_BUF 4096
+#define TUNNEL_PIPE 65536    /* Default pipe capacity on Linux */
+
+static atomic_long buffer_bytes;        /* Ring memory currently allocated */
+static atomic_long buffer_peak;         /* High-water mark of buffer_bytes */
+static atomic_ulong relays;             /* Completed relays */
+static atomic_ulong early_releases;     /* Source released before the client drained */
+static atomic_ulong backpressure;       /* Times reading paused on a full buffer */
+static atomic_ulong aborts;             /* Relays cut off by a filter or tap */
+static atomic_ulong spliced;            /* Relays run with splice (zero_copy) */
+static atomic_ulong spliced_bytes;      /* Bytes they moved */
+static atomic_ulong tunnels;            /* Completed tunnels */
+static atomic_ulong tunnel_bytes;       /* Bytes moved through them, both directions */
+static atomic_ulong tunnel_timeouts;    /* Tunnels closed for idleness */
+static atomic_ulong tunnel_copies;      /* Tunnels copied through user space */
+static int use_splice = 1;              /* relay_set_splice */
+
+/* One direction of a tunnel */
+typedef struct {
+    int src, dst;
+    int pipefd[2];
+    char *buf;              /* Copy buffer, when not splicing */
+    size_t off;             /* Offset of the first pending byte in buf */
+    size_t pending;         /* Bytes sitting in the pipe (or buf) */
+    size_t moved;           /* Bytes delivered to dst */
+    int eof;                /* src has reached EOF */
+    int done;               /* eof and drained; dst shut down for writing */
+} half_t;
+
+static void account(long delta) {
+    long now = atomic_fetch_add(&buffer_bytes, delta) + delta;
+    long peak = atomic_load(&buffer_peak);
+
+    while (now > peak && !atomic_compare_exchange_weak(&buffer_peak, &peak, now))
+        ;
+}
+
+/*
+ * resize - Reallocate the ring to size bytes, moving the unsent bytes to
+ * the start of the new buffer. size must be at least r->len.
+ */
+static void resize(relay_t *r, size_t size) {
+    char *buf = Malloc(size);
+    size_t first = r->len < r->size - r->head ? r->len : r->size - r->head;
+
+    if (r->len) {
+        memcpy(buf, r->buf + r->head, first);
+        memcpy(buf + first, r->buf, r->len - first);
+    }
+    free(r->buf);
+    account((long)size - (long)r->size);
+    r->buf = buf;
+    r->size = size;
+    r->head = 0;
+}
+
+static void set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+/*
+ * relay_init - Prepare a relay from descriptor from to descriptor to
+ * that buffers at most limit unsent bytes. By default the relay reads
+ * until EOF and then closes from; set own_from and remaining to change
+ * that. A filter or tap that sees the end of a message before EOF can
+ * set remaining to 0 to finish the relay there; a tap with no further
+ * use for the bytes can clear r->tap and set zero_copy. A source the
+ * relay does not own is handed back through the finished hook as soon
+ * as it is done, so it can be released while the sink still drains.
+ */
+void relay_init(relay_t *r, int from, int to, size_t limit) {
+    memset(r, 0, sizeof(relay_t));
+    r->from = from;
+    r->to = to;
+    r->own_from = 1;
+    r->remaining = -1;
+    r->limit = limit < RELAY_MIN_BUF ? RELAY_MIN_BUF : limit;
+}
+
+/*
+ * finish_source - The source is done, with unsent bytes still on their
+ * way to the sink: close it, or give it back through the finished hook.
+ */
+static void finish_source(relay_t *r, size_t unsent) {
+    if (unsent > 0 && (r->own_from || r->finished))
+        atomic_fetch_add(&early_releases, 1);
+    if (r->own_from) {
+        Close(r->from);
+    } else {
+        set_nonblocking(r->from, 0);
+        if (r->finished)
+            r->finished(r);
+    }
+    r->from = -1;
+    r->from_up = NULL;
+}
+
+/*
+ * relay_set_limit - Change the read-ahead limit. Lowering it below the
+ * current fill pauses upstream reads until the client catches up; the
+ * buffer is shrunk to the new limit once it fits.
+ */
+void relay_set_limit(relay_t *r, size_t limit) {
+    r->limit = limit < RELAY_MIN_BUF ? RELAY_MIN_BUF : limit;
+}
+
+/*
+ * relay_push - Queue upstream bytes that were read before the relay
+ * started (e.g. left in a Rio buffer). May exceed the limit briefly.
+ */
+void relay_push(relay_t *r, const char *data, size_t len) {
+    char *filtered = NULL;
+    size_t tail, first;
+
+    if (len > 0 && r->filter) {
+        filtered = Malloc(len);
+        len = r->filter(r, data, len, filtered);
+        data = filtered;
+    }
+    if (len > 0 && r->tap)
+        r->tap(r, data, len);
+    if (len > 0 && !r->aborted) {
+        if (r->size - r->len < len)
+            resize(r, r->len + len > RELAY_MIN_BUF ? r->len + len : RELAY_MIN_BUF);
+        tail = (r->head + r->len) % r->size;
+        first = len < r->size - tail ? len : r->size - tail;
+        memcpy(r->buf + tail, data, first);
+        memcpy(r->buf, data + first, len - first);
+        r->len += len;
+    }
+    free(filtered);
+}
+
+/*
+ * relay_abort - Called from a filter or tap to cut the relay off: the
+ * bytes being tapped and every other unsent byte are dropped, and
+ * relay_run fails.
+ */
+void relay_abort(relay_t *r) {
+    if (!r->aborted)
+        atomic_fetch_add(&aborts, 1);
+    r->aborted = 1;
+    r->len = 0;
+}
+
+/*
+ * fill - Read once from upstream into the free space of the ring.
+ * Returns bytes read, 0 at EOF, or -1 (EAGAIN included).
+ */
+static ssize_t fill(relay_t *r) {
+    struct iovec iov[2];
+    size_t tail, space, kept;
+    ssize_t n;
+    int cnt = 1;
+
+    if (r->size > r->limit && r->len <= r->limit)
+        resize(r, r->limit);
+    else if (r->len == r->size && r->size < r->limit)
+        resize(r, r->size * 2 < r->limit ? (r->size * 2 > RELAY_MIN_BUF ? r->size * 2 : RELAY_MIN_BUF) : r->limit);
+
+    space = r->limit - r->len;
+    if (space > r->size - r->len)
+        space = r->size - r->len;
+    if (r->remaining >= 0 && space > (size_t)r->remaining)
+        space = r->remaining;
+    tail = (r->head + r->len) % r->size;
+    iov[0].iov_base = r->buf + tail;
+    iov[0].iov_len = space < r->size - tail ? space : r->size - tail;
+    if (iov[0].iov_len < space && !r->filter && !r->from_up) {
+        /* A filter rewrites in place, so it only gets contiguous reads */
+        iov[1].iov_base = r->buf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        cnt = 2;
+    }
+    n = r->from_up ? upstream_recv(r->from_up, iov[0].iov_base, iov[0].iov_len) : readv(r->from, iov, cnt);
+    if (n > 0) {
+        if (r->remaining > 0)
+            r->remaining -= n;
+        kept = r->filter ? r->filter(r, iov[0].iov_base, n, iov[0].iov_base) : (size_t)n;
+        if (r->tap && kept > 0) {
+            size_t first = kept < iov[0].iov_len ? kept : iov[0].iov_len;
+            r->tap(r, iov[0].iov_base, first);
+            if (kept > first && r->tap && !r->aborted)
+                r->tap(r, r->buf, kept - first);
+        }
+        r->len = r->aborted ? 0 : r->len + kept;
+    }
+    return n;
+}
+
+/*
+ * drain - Write once from the ring to the client. Returns bytes written
+ * or -1 (EAGAIN included).
+ */
+static ssize_t drain(relay_t *r) {
+    size_t first = r->len < r->size - r->head ? r->len : r->size - r->head;
+    ssize_t n = r->to_up ? upstream_send(r->to_up, r->buf + r->head, first)
+                         : send(r->to, r->buf + r->head, first, MSG_NOSIGNAL);
+
+    if (n > 0) {
+        r->head = (r->head + n) % r->size;
+        r->len -= n;
+        r->sent += n;
+    }
+    return n;
+}
+
+/*
+ * splice_run - The rest of relay_run for a zero_copy relay: source bytes
+ * go to the sink through a pipe and never enter user space. Bytes queued
+ * in the ring, and any the origin connection read ahead, are sent
+ * first. The pipe is closed on return. Returns the bytes written to the
+ * sink, or -1 on error.
+ */
+static ssize_t splice_run(relay_t *r, int pipefd[2]) {
+    struct pollfd pfd[2];
+    int in, out, nfds;
+    size_t pending = 0, want;
+    ssize_t n, rc = 0;
+
+    if (r->from_up && r->from_up->cnt > 0) {
+        want = r->from_up->cnt;
+        if (r->remaining >= 0 && want > (size_t)r->remaining)
+            want = r->remaining;
+        relay_push(r, r->from_up->bufptr, want);
+        r->from_up->bufptr += want;
+        r->from_up->cnt -= want;
+        if (r->remaining > 0)
+            r->remaining -= want;
+    }
+
+    while (r->from >= 0 || r->len > 0 || pending > 0) {
+        if (r->from >= 0 && r->remaining == 0) {
+            finish_source(r, r->len + pending);
+            continue;
+        }
+        nfds = 0;
+        in = out = -1;
+        if (r->from >= 0 && pending < TUNNEL_PIPE) {
+            pfd[in = nfds].fd = r->from;
+            pfd[nfds++].events = POLLIN;
+        }
+        if (r->len > 0 || pending > 0) {
+            pfd[out = nfds].fd = r->to;
+            pfd[nfds++].events = POLLOUT;
+        }
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+
+        if (in >= 0 && pfd[in].revents) {
+            want = TUNNEL_PIPE - pending;
+            if (r->remaining >= 0 && want > (size_t)r->remaining)
+                want = r->remaining;
+            n = splice(r->from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                pending += n;
+                if (r->remaining > 0)
+                    r->remaining -= n;
+            } else if (n == 0 && r->remaining > 0) {
+                rc = -1;  /* Source ended before the expected length */
+            } else if (n == 0) {
+                finish_source(r, r->len + pending);
+            } else if (errno != EAGAIN && errno != EINTR) {
+                rc = -1;
+            }
+        }
+        if (out >= 0 && pfd[out].revents && rc == 0) {
+            if (r->len > 0) {
+                n = drain(r);  /* The ring goes first: it holds earlier bytes */
+            } else if ((n = splice(pipefd[0], NULL, r->to, NULL, pending,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+                pending -= n;
+                r->sent += n;
+                atomic_fetch_add(&spliced_bytes, n);
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                rc = -1;
+        }
+        if (rc < 0)
+            break;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    atomic_fetch_add(&spliced, 1);
+    return rc < 0 ? -1 : (ssize_t)r->sent;
+}
+
+/*
+ * relay_run - Relay until the source is finished (EOF, or remaining
+ * bytes read) and every buffered byte has been written to the sink.
+ * Returns the bytes written to the sink, or -1 if either side fails.
+ */
+ssize_t relay_run(relay_t *r) {
+    struct pollfd pfd[2];
+    ssize_t n, rc = 0;
+    int nfds, ready, paused = 0, pipefd[2];
+
+    set_nonblocking(r->to, 1);
+    if (r->from >= 0)
+        set_nonblocking(r->from, 1);
+
+    while (r->from >= 0 || r->len > 0) {
+        if (r->aborted) {
+            rc = -1;
+            break;
+        }
+        if (r->zero_copy && r->from >= 0) {
+            /* Set up front, or by a tap that has seen all it needs to */
+            if (use_splice && !r->filter && !r->tap && !r->to_up && !(r->from_up && r->from_up->ssl) &&
+                pipe(pipefd) == 0) {
+                rc = splice_run(r, pipefd);
+                break;
+            }
+            r->zero_copy = 0;  /* Copy through the ring after all */
+        }
+        if (r->from >= 0 && r->remaining == 0) {
+            /* Read everything that was asked for */
+            finish_source(r, r->len);
+            continue;
+        }
+        nfds = ready = 0;
+        if (r->from >= 0 && r->len < r->limit) {
+            pfd[nfds].fd = r->from;
+            pfd[nfds++].events = POLLIN;
+            paused = 0;
+            /* TLS may hold decrypted bytes the socket no longer shows */
+            ready = r->from_up && upstream_pending(r->from_up);
+        } else if (r->from >= 0 && !paused) {
+            paused = 1;
+            atomic_fetch_add(&backpressure, 1);
+        }
+        if (r->len > 0) {
+            pfd[nfds].fd = r->to;
+            pfd[nfds++].events = POLLOUT;
+        }
+        if (poll(pfd, nfds, ready ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+        if (ready)
+            pfd[0].revents |= POLLIN;
+
+        for (int i = 0; i < nfds; i++) {
+            if (!pfd[i].revents)
+                continue;
+            if (pfd[i].fd == r->from) {
+                if ((n = fill(r)) == 0 && r->remaining > 0) {
+                    rc = -1;  /* Source ended before the expected length */
+                } else if (n == 0) {
+                    /* Release the origin now; the client may still be draining */
+                    finish_source(r, r->len);
+                } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                    rc = -1;
+                }
+            } else if ((n = drain(r)) < 0 && errno != EAGAIN && errno != EINTR) {
+                rc = -1;
+            }
+        }
+        if (rc < 0)
+            break;
+    }
+
+    set_nonblocking(r->to, 0);
+    if (!r->own_from && r->from >= 0)
+        set_nonblocking(r->from, 0);
+    atomic_fetch_add(&relays, 1);
+    return rc < 0 ? -1 : (ssize_t)r->sent;
+}
+
+/*
+ * relay_set_splice - Use splice for tunnels and zero_copy relays (on by
+ * default), or copy through user space when on is 0.
+ */
+void relay_set_splice(int on) {
+    use_splice = on;
+}
+
+/* Bytes one direction of a tunnel can take in from its source */
+static size_t room(const half_t *h) {
+    return TUNNEL_PIPE - h->off - h->pending;
+}
+
+/*
+ * pump - Move what is possible in one direction of a tunnel: from the
+ * source socket into the pipe (or copy buffer) if the source is ready,
+ * and from there into the destination socket if it is ready. Returns -1
+ * on error.
+ */
+static int pump(half_t *h, short src_ready, short dst_ready) {
+    ssize_t n;
+
+    if (src_ready && !h->eof && room(h) > 0) {
+        if (h->buf)
+            n = read(h->src, h->buf + h->off + h->pending, room(h));
+        else
+            n = splice(h->src, NULL, h->pipefd[1], NULL, room(h), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            h->eof = 1;
+        else if (n > 0)
+            h->pending += n;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (dst_ready && h->pending > 0) {
+        if (h->buf)
+            n = write(h->dst, h->buf + h->off, h->pending);
+        else
+            n = splice(h->pipefd[0], NULL, h->dst, NULL, h->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            h->pending -= n;
+            h->moved += n;
+            h->off = h->pending > 0 && h->buf ? h->off + n : 0;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+    }
+    if (h->eof && h->pending == 0 && !h->done) {
+        shutdown(h->dst, SHUT_WR);
+        h->done = 1;
+    }
+    return 0;
+}
+
+/*
+ * relay_tunnel - Carry bytes both ways between sockets a and b until
+ * both sides have closed, either side fails, or nothing moves for
+ * idle_ms milliseconds (-1 waits forever). EOF on one side is passed on
+ * as a half-close. The byte counts for each direction are stored in
+ * *a_to_b and *b_to_a. Returns 0, or -1 on error or idle timeout.
+ */
+int relay_tunnel(int a, int b, int idle_ms, size_t *a_to_b, size_t *b_to_a) {
+    half_t h[2] = {
+        { .src = a, .dst = b, .pipefd = { -1, -1 } },
+        { .src = b, .dst = a, .pipefd = { -1, -1 } },
+    };
+    struct pollfd pfd[2];
+    int rc = 0;
+
+    if (!use_splice || pipe(h[0].pipefd) < 0 || pipe(h[1].pipefd) < 0) {
+        /* Copy through user space instead */
+        for (int i = 0; i < 2; i++) {
+            if (h[i].pipefd[0] >= 0) {
+                close(h[i].pipefd[0]);
+                close(h[i].pipefd[1]);
+                h[i].pipefd[0] = h[i].pipefd[1] = -1;
+            }
+            if ((h[i].buf = malloc(TUNNEL_PIPE)) == NULL) {
+                rc = -1;
+                goto out;
+            }
+        }
+        atomic_fetch_add(&tunnel_copies, 1);
+    }
+    set_nonblocking(a, 1);
+    set_nonblocking(b, 1);
+
+    while (!(h[0].done && h[1].done)) {
+        /* pfd[0] watches a, pfd[1] watches b; each serves both directions */
+        pfd[0].fd = a;
+        pfd[1].fd = b;
+        pfd[0].events = pfd[1].events = 0;
+        for (int i = 0; i < 2; i++) {
+            if (!h[i].eof && room(&h[i]) > 0)
+                pfd[i].events |= POLLIN;
+            if (h[i].pending > 0)
+                pfd[1 - i].events |= POLLOUT;
+        }
+
+        if ((rc = poll(pfd, 2, idle_ms)) == 0) {
+            atomic_fetch_add(&tunnel_timeouts, 1);
+            rc = -1;
+            break;
+        } else if (rc < 0) {
+            if (errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            break;
+        }
+        rc = 0;
+
+        for (int i = 0; i < 2; i++) {
+            short src_ready = pfd[i].revents & (POLLIN | POLLHUP | POLLERR);
+            short dst_ready = pfd[1 - i].revents & (POLLOUT | POLLERR);
+            if (pump(&h[i], src_ready, dst_ready) < 0)
+                rc = -1;
+        }
+        if (rc < 0)
+            break;
+    }
+
+out:
+    for (int i = 0; i < 2; i++) {
+        if (h[i].pipefd[0] >= 0) {
+            close(h[i].pipefd[0]);
+            close(h[i].pipefd[1]);
+        }
+        free(h[i].buf);
+    }
+    *a_to_b = h[0].moved;
+    *b_to_a = h[1].moved;
+    atomic_fetch_add(&tunnels, 1);
+    atomic_fetch_add(&tunnel_bytes, h[0].moved + h[1].moved);
+    return rc;
+}
+
+/*
+ * relay_free - Release the ring buffer. The caller still owns r->from
+ * if it has not been closed (r->from >= 0).
+ */
+void relay_free(relay_t *r) {
+    free(r->buf);
+    account(-(long)r->size);
+    r->buf = NULL;
+    r->size = r->len = 0;
+}
+
+/*
+ * relay_stats - Print relay counters as "name value" lines.
+ */
+void relay_stats(FILE *out) {
+    fprintf(out, "relay_count %lu\n", atomic_load(&relays));
+    fprintf(out, "relay_buffer_bytes %ld\n", atomic_load(&buffer_bytes));
+    fprintf(out, "relay_buffer_peak %ld\n", atomic_load(&buffer_peak));
+    fprintf(out, "relay_backpressure_pauses %lu\n", atomic_load(&backpressure));
+    fprintf(out, "relay_early_upstream_release %lu\n", atomic_load(&early_releases));
+    fprintf(out, "relay_aborted %lu\n", atomic_load(&aborts));
+    fprintf(out, "relay_spliced %lu\n", atomic_load(&spliced));
+    fprintf(out, "relay_spliced_bytes %lu\n", atomic_load(&spliced_bytes));
+    fprintf(out, "tunnel_count %lu\n", atomic_load(&tunnels));
+    fprintf(out, "tunnel_bytes %lu\n", atomic_load(&tunnel_bytes));
+    fprintf(out, "tunnel_idle_timeouts %lu\n", atomic_load(&tunnel_timeouts));
+    fprintf(out, "tunnel_copied %lu\n", atomic_load(&tunnel_copies));
+}
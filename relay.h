@@ -0,0 +1,56 @@
+/*
+ * relay.h - Bounded-memory relay from one socket to another
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct relay relay_t;
+struct upstream;
+
+/* Called with each run of bytes read from the source, before it is sent */
+typedef void (*relay_tap_t)(relay_t *r, const char *data, size_t len);
+
+/* Rewrites len source bytes from in to out (which may equal in) before
+ * they are buffered, returning the bytes written; never more than len */
+typedef size_t (*relay_filter_t)(relay_t *r, const char *in, size_t len, char *out);
+
+/* Called once a source the relay does not own is finished, possibly
+ * while buffered bytes are still on their way to the sink */
+typedef void (*relay_done_t)(relay_t *r);
+
+struct relay {
+    int from;               /* Source; set to -1 once finished */
+    int to;                 /* Sink */
+    int own_from;           /* Close the source once finished (default) */
+    ssize_t remaining;      /* Bytes left to read from the source, or -1 for EOF */
+    char *buf;              /* Ring buffer of unsent bytes */
+    size_t size;            /* Allocated size of buf */
+    size_t head;            /* Offset of the oldest unsent byte */
+    size_t len;             /* Unsent bytes */
+    size_t limit;           /* Read-ahead limit; reading pauses at this fill */
+    size_t sent;            /* Bytes written to the sink */
+    struct upstream *from_up;   /* Read from through this origin connection */
+    struct upstream *to_up;     /* Write to through this origin connection */
+    relay_filter_t filter;  /* Optional in-place rewrite of source bytes */
+    relay_tap_t tap;        /* Optional observer of (filtered) source bytes */
+    relay_done_t finished;  /* Optional hook for a source it does not own */
+    void *arg;              /* For the filter, tap and finished hook */
+    int aborted;            /* Set by relay_abort */
+    int zero_copy;          /* Splice source to sink when nothing looks at the bytes */
+};
+
+void relay_init(relay_t *r, int from, int to, size_t limit);
+void relay_set_limit(relay_t *r, size_t limit);
+void relay_push(relay_t *r, const char *data, size_t len);
+void relay_abort(relay_t *r);
+ssize_t relay_run(relay_t *r);
+void relay_free(relay_t *r);
+void relay_set_splice(int on);
+int relay_tunnel(int a, int b, int idle_ms, size_t *a_to_b, size_t *b_to_a);
+void relay_stats(FILE *out);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,313 @@
+/*
+ * rewrite.c - Rule-driven rewriting of outbound request headers
+ *
+ * Each "header_rule" setting is an action and a header:
+ *
+ *     header_rule drop X-Forwarded-For           client's header is removed
+ *     header_rule set Via: 1.1 proxy             replaced by (or added as) this
+ *     header_rule add X-Trace: on                added after the client's
+ *     header_rule default Accept-Language: en    added unless the client sent one
+ *     header_rule rename X-Old-Name X-New-Name   forwarded under the new name
+ *
+ * Rules apply in file order; a later drop or set for a header replaces
+ * what earlier rules for it did. Built in are drops of the hop-by-hop
+ * headers and of Host, which the proxy writes itself, and a set of the
+ * proxy's User-Agent; rules may replace the User-Agent but not touch
+ * the hop-by-hop headers.
+ *
+ * At startup the header names are compiled into a perfect hash: a seed
+ * and table size are searched for under which no two names collide, so
+ * looking up a client header is one hash of its name, one probe and one
+ * comparison, however many rules there are. rewrite_header applies the
+ * result while copying the header into the outbound buffer, and
+ * rewrite_finish appends the headers that rules add.
+ */
+#include "csapp.h"
+#include "rewrite.h"
+#include <stdatomic.h>
+
+#define MAX_EMITS MAX_REWRITE_RULES
+#define NAME_LEN 64
+
+/* What happens to a client's header of some name */
+#define CLIENT_KEEP 0
+#define CLIENT_DROP 1
+#define CLIENT_RENAME 2
+
+/* A header name that rules (or the built-in drops) mention */
+typedef struct {
+    char name[NAME_LEN];
+    size_t len;
+    int client;                 /* CLIENT_ action */
+    char rename[NAME_LEN];
+    size_t rename_len;
+    int fixed;                  /* Hop-by-hop: rules may not change it */
+} name_t;
+
+/* A header line the proxy adds */
+typedef struct {
+    int name;                   /* Index in names */
+    int only_default;           /* Only if the client did not send one */
+    char *line;                 /* "Name: value\r\n" */
+    size_t len;
+} emit_t;
+
+static const char *hop_by_hop[] = {
+    "Host", "Connection", "Proxy-Connection", "Keep-Alive",
+    "Proxy-Authorization", "TE", "Upgrade", "Expect", NULL
+};
+
+static name_t names[MAX_REWRITE_NAMES];
+static int name_count;
+static emit_t emits[MAX_EMITS];
+static int emit_count;
+static short *table;            /* Perfect hash: slot to name index, or -1 */
+static unsigned table_mask, table_seed;
+static atomic_ulong requests, dropped, renamed, added;
+
+static unsigned name_hash(const char *s, size_t len, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+
+    /* Header names are case-insensitive; | 0x20 folds letters and leaves
+     * the digits and '-' of real names alone */
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)(s[i] | 0x20)) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+/*
+ * name_index - The index of header name (len bytes), added if new and
+ * add is set. -1 if unknown or there are too many names.
+ */
+static int name_index(const char *name, size_t len, int add) {
+    for (int i = 0; i < name_count; i++)
+        if (names[i].len == len && strncasecmp(names[i].name, name, len) == 0)
+            return i;
+    if (!add || name_count == MAX_REWRITE_NAMES || len == 0 || len >= NAME_LEN)
+        return -1;
+    memcpy(names[name_count].name, name, len);
+    names[name_count].name[len] = '\0';
+    names[name_count].len = len;
+    return name_count++;
+}
+
+/*
+ * clear_emits - Forget the headers earlier rules added for name i.
+ */
+static void clear_emits(int i) {
+    int kept = 0;
+
+    for (int j = 0; j < emit_count; j++) {
+        if (emits[j].name == i)
+            free(emits[j].line);
+        else
+            emits[kept++] = emits[j];
+    }
+    emit_count = kept;
+}
+
+/*
+ * add_rule - Apply one rule to the tables. Returns 0, or -1 if it is
+ * malformed or not allowed.
+ */
+static int add_rule(const char *spec) {
+    char action[16], header[MAXLINE], *colon, *value;
+    const char *rest;
+    size_t len;
+    int i, only_default = 0;
+    emit_t *e;
+
+    if (sscanf(spec, "%15s", action) != 1)
+        return -1;
+    rest = spec + strlen(action);
+    rest += strspn(rest, " \t");
+    snprintf(header, sizeof(header), "%s", rest);
+    if (strcasecmp(action, "drop") == 0 || strcasecmp(action, "rename") == 0) {
+        len = strcspn(header, " \t");
+        colon = NULL;
+    } else {
+        if (!(colon = strchr(header, ':')))
+            return -1;
+        len = colon - header;
+        while (len > 0 && (header[len - 1] == ' ' || header[len - 1] == '\t'))
+            len--;
+    }
+    if ((i = name_index(header, len, 1)) < 0 || names[i].fixed)
+        return -1;
+
+    if (strcasecmp(action, "drop") == 0) {
+        clear_emits(i);
+        names[i].client = CLIENT_DROP;
+    } else if (strcasecmp(action, "rename") == 0) {
+        value = header + len + strspn(header + len, " \t");
+        names[i].rename_len = strcspn(value, " \t");
+        if (names[i].rename_len == 0 || names[i].rename_len >= NAME_LEN)
+            return -1;
+        memcpy(names[i].rename, value, names[i].rename_len);
+        names[i].client = CLIENT_RENAME;
+    } else if (strcasecmp(action, "set") == 0 || strcasecmp(action, "add") == 0 ||
+               (only_default = strcasecmp(action, "default") == 0)) {
+        if (emit_count == MAX_EMITS)
+            return -1;
+        if (strcasecmp(action, "set") == 0) {
+            clear_emits(i);
+            names[i].client = CLIENT_DROP;
+        }
+        value = colon + 1 + strspn(colon + 1, " \t");
+        e = &emits[emit_count++];
+        e->name = i;
+        e->only_default = only_default;
+        e->len = strlen(names[i].name) + strlen(value) + 4;
+        e->line = Malloc(e->len + 1);
+        sprintf(e->line, "%s: %s\r\n", names[i].name, value);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * build_table - Find a table size and seed under which the names hash
+ * to distinct slots.
+ */
+static void build_table(void) {
+    unsigned size = 16, seed, slot;
+    int i;
+
+    while (size < 2u * name_count)
+        size <<= 1;
+    for (;; size <<= 1) {
+        table = Realloc(table, size * sizeof(*table));
+        for (seed = 1; seed <= 1000; seed++) {
+            memset(table, -1, size * sizeof(*table));
+            for (i = 0; i < name_count; i++) {
+                slot = name_hash(names[i].name, names[i].len, seed) & (size - 1);
+                if (table[slot] >= 0)
+                    break;
+                table[slot] = i;
+            }
+            if (i == name_count) {
+                table_mask = size - 1;
+                table_seed = seed;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * rewrite_init - Compile count rule strings, after the built-in rules
+ * and a set of user_agent (a whole "User-Agent: ...\r\n" line). Returns
+ * the number of rules kept; malformed ones are reported and skipped.
+ */
+int rewrite_init(const char **specs, int count, const char *user_agent) {
+    char ua[MAXLINE];
+    int kept = 0, i;
+
+    for (i = 0; hop_by_hop[i]; i++) {
+        int n = name_index(hop_by_hop[i], strlen(hop_by_hop[i]), 1);
+        names[n].client = CLIENT_DROP;
+        names[n].fixed = 1;
+    }
+    snprintf(ua, sizeof(ua), "set %.*s", (int)strcspn(user_agent, "\r\n"), user_agent);
+    add_rule(ua);
+    for (i = 0; i < count && i < MAX_REWRITE_RULES; i++) {
+        if (add_rule(specs[i]) < 0)
+            fprintf(stderr, "header_rule: bad rule %s\n", specs[i]);
+        else
+            kept++;
+    }
+    build_table();
+    return kept;
+}
+
+/*
+ * rewrite_start - Begin rewriting one request's headers.
+ */
+void rewrite_start(rewrite_t *rw) {
+    memset(rw, 0, sizeof(*rw));
+}
+
+/*
+ * rewrite_header - Copy the client header line (len bytes) into out as
+ * the rules say. Returns the bytes written, 0 if the header is dropped,
+ * or -1 if it does not fit in outlen.
+ */
+ssize_t rewrite_header(rewrite_t *rw, const char *line, size_t len, char *out, size_t outlen) {
+    const char *colon = memchr(line, ':', len);
+    size_t nlen = colon ? (size_t)(colon - line) : 0;
+    int i = -1;
+    name_t *n;
+
+    if (colon) {
+        i = table[name_hash(line, nlen, table_seed) & table_mask];
+        if (i >= 0 && (names[i].len != nlen || strncasecmp(names[i].name, line, nlen) != 0))
+            i = -1;
+    }
+    if (i < 0) {
+        if (len > outlen)
+            return -1;
+        memcpy(out, line, len);
+        return len;
+    }
+
+    n = &names[i];
+    rw->seen[i / 64] |= 1ULL << (i % 64);
+    switch (n->client) {
+    case CLIENT_DROP:
+        rw->dropped++;
+        return 0;
+    case CLIENT_RENAME:
+        if (n->rename_len + len - nlen > outlen)
+            return -1;
+        memcpy(out, n->rename, n->rename_len);
+        memcpy(out + n->rename_len, colon, len - nlen);
+        rw->renamed++;
+        return n->rename_len + len - nlen;
+    default:
+        if (len > outlen)
+            return -1;
+        memcpy(out, line, len);
+        return len;
+    }
+}
+
+/*
+ * rewrite_finish - Write the headers the rules add into out. Returns the
+ * bytes written, or -1 if they do not fit in outlen.
+ */
+ssize_t rewrite_finish(rewrite_t *rw, char *out, size_t outlen) {
+    size_t total = 0;
+    unsigned n = 0;
+    emit_t *e;
+
+    for (int j = 0; j < emit_count; j++) {
+        e = &emits[j];
+        if (e->only_default && (rw->seen[e->name / 64] >> (e->name % 64) & 1))
+            continue;
+        if (total + e->len > outlen)
+            return -1;
+        memcpy(out + total, e->line, e->len);
+        total += e->len;
+        n++;
+    }
+    atomic_fetch_add_explicit(&requests, 1, memory_order_relaxed);
+    if (rw->dropped)
+        atomic_fetch_add_explicit(&dropped, rw->dropped, memory_order_relaxed);
+    if (rw->renamed)
+        atomic_fetch_add_explicit(&renamed, rw->renamed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&added, n, memory_order_relaxed);
+    return total;
+}
+
+/*
+ * rewrite_stats - Print rule and rewrite counters as "name value" lines.
+ */
+void rewrite_stats(FILE *out) {
+    fprintf(out, "header_names %d\n", name_count);
+    fprintf(out, "header_table_slots %u\n", table_mask + 1);
+    fprintf(out, "header_requests %lu\n", atomic_load(&requests));
+    fprintf(out, "header_dropped %lu\n", atomic_load(&dropped));
+    fprintf(out, "header_renamed %lu\n", atomic_load(&renamed));
+    fprintf(out, "header_added %lu\n", atomic_load(&added));
+}
@@ -0,0 +1,26 @@
+/*
+ * rewrite.h - Rule-driven rewriting of outbound request headers
+ */
+#ifndef __REWRITE_H__
+#define __REWRITE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAX_REWRITE_RULES 128   /* Rules beyond this are ignored */
+#define MAX_REWRITE_NAMES (MAX_REWRITE_RULES + 16)
+
+/* Per request: which header names the client sent */
+typedef struct {
+    uint64_t seen[(MAX_REWRITE_NAMES + 63) / 64];
+    unsigned dropped, renamed;     /* Client headers, for the stats */
+} rewrite_t;
+
+int rewrite_init(const char **specs, int count, const char *user_agent);
+void rewrite_start(rewrite_t *rw);
+ssize_t rewrite_header(rewrite_t *rw, const char *line, size_t len, char *out, size_t outlen);
+ssize_t rewrite_finish(rewrite_t *rw, char *out, size_t outlen);
+void rewrite_stats(FILE *out);
+
+#endif /* __REWRITE_H__ */
@@ -0,0 +1,281 @@
+/*
+ * sched.c - Priority classes for admitting requests to the proxy
+ *
+ * Every connection has its own thread, so there is no worker pool to
+ * reorder. Instead, once a request is parsed it is classified and must
+ * take one of sched_slots slots before it is served; while all slots
+ * are busy, waiting requests queue per class and each slot that frees
+ * up goes to the most urgent class with a waiter (strict priority),
+ * first come first served within a class. A waiter is promoted one
+ * class for every aging_ms it has waited, so a steady stream of
+ * interactive requests cannot starve the others for long. Bulk
+ * requests may hold at most bulk_share percent of the slots, which
+ * keeps slots free for interactive requests however many downloads
+ * are running.
+ *
+ * A request is bulk if its client is listed, if its path has a bulk
+ * extension, or if it is expected to be large: a cached object's size,
+ * a request body's Content-Length, or the size this URI's response had
+ * last time, remembered in a small lossy table. GET and HEAD requests
+ * for pages (no extension) and interactive extensions are interactive;
+ * the rest are normal. With no slots configured everything is admitted
+ * at once and only the classes are counted.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "sched.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SIZE_HINTS 4096         /* Remembered response sizes, direct-mapped */
+#define SIZE_BITS 40            /* Low bits of a hint hold the size */
+#define MAX_BULK_CLIENTS 16
+
+/* A request waiting for a slot, on its thread's stack */
+typedef struct waiter {
+    int cls;
+    uint64_t since;             /* When it started waiting, in us */
+    int granted;
+    pthread_cond_t cond;
+    struct waiter *next;
+} waiter_t;
+
+typedef struct {
+    waiter_t *head, *tail;
+    int queued;
+    int active;
+    unsigned long requests, waited;
+    unsigned long long wait_us;
+    unsigned long wait_max_us;
+} class_t;
+
+static const char *class_names[SCHED_CLASSES] = { "interactive", "normal", "bulk" };
+
+static int slots, bulk_slots, active;
+static uint64_t aging_us;
+static long long bulk_size;
+static char interactive_exts[MAXLINE], bulk_exts[MAXLINE];
+static char bulk_client[MAX_BULK_CLIENTS][64];
+static int bulk_client_count;
+static class_t classes[SCHED_CLASSES];
+static lockstat_t sched_stat = LOCKSTAT_INITIALIZER("sched");
+static lockprof_t sched_mutex = LOCKPROF_INITIALIZER(&sched_stat);
+static _Atomic uint64_t size_hints[SIZE_HINTS];
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * sched_init - Admit at most slots requests at a time (0 for no limit),
+ * bulk ones to bulk_share percent of them, promoting waiters a class
+ * every aging_ms. Requests expected to be bulk_bytes or more, with an
+ * extension in the comma-separated bulk_ext, or from a client address
+ * starting with one of bulk_clients are bulk; pages and interactive_ext
+ * extensions are interactive.
+ */
+void sched_init(int nslots, int bulk_share, int aging_ms, long long bulk_bytes,
+                const char *interactive_ext, const char *bulk_ext, const char **bulk_clients, int nclients) {
+    slots = nslots > 0 ? nslots : 0;
+    bulk_slots = slots * bulk_share / 100;
+    if (slots && bulk_slots < 1)
+        bulk_slots = 1;
+    aging_us = aging_ms > 0 ? (uint64_t)aging_ms * 1000 : UINT64_MAX;
+    bulk_size = bulk_bytes;
+    snprintf(interactive_exts, sizeof(interactive_exts), ",%s,", interactive_ext);
+    snprintf(bulk_exts, sizeof(bulk_exts), ",%s,", bulk_ext);
+    for (int i = 0; i < nclients && bulk_client_count < MAX_BULK_CLIENTS; i++)
+        snprintf(bulk_client[bulk_client_count++], sizeof(bulk_client[0]), "%s", bulk_clients[i]);
+}
+
+/*
+ * has_ext - Returns 1 if ext (len bytes) is in the list ",a,b,c,".
+ */
+static int has_ext(const char *list, const char *ext, size_t len) {
+    char key[34];
+
+    if (len == 0 || len > 31)
+        return 0;
+    key[0] = ',';
+    for (size_t i = 0; i < len; i++)
+        key[i + 1] = tolower((unsigned char)ext[i]);
+    key[len + 1] = ',';
+    key[len + 2] = '\0';
+    return strstr(list, key) != NULL;
+}
+
+/*
+ * sched_classify - The class of a request for path from client, whose
+ * response or body is expected to be expected bytes (-1 if unknown).
+ */
+int sched_classify(const char *method, const char *path, const char *client, long long expected) {
+    size_t end = strcspn(path, "?#"), seg = end, len = 0;
+
+    for (int i = 0; i < bulk_client_count; i++)
+        if (strncmp(client, bulk_client[i], strlen(bulk_client[i])) == 0)
+            return SCHED_BULK;
+    if (bulk_size > 0 && expected >= bulk_size)
+        return SCHED_BULK;
+
+    /* The extension of the last path segment, if it has one */
+    while (seg > 0 && path[seg - 1] != '/')
+        seg--;
+    for (size_t i = end; i > seg; i--) {
+        if (path[i - 1] == '.') {
+            len = end - i;
+            break;
+        }
+    }
+    if (has_ext(bulk_exts, path + end - len, len))
+        return SCHED_BULK;
+    if ((strcasecmp(method, "GET") == 0 || strcasecmp(method, "HEAD") == 0) &&
+        (len == 0 || has_ext(interactive_exts, path + end - len, len)))
+        return SCHED_INTERACTIVE;
+    return SCHED_NORMAL;
+}
+
+static uint64_t uri_hash(const char *uri) {
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*uri)
+        h = (h ^ (unsigned char)*uri++) * 1099511628211ULL;
+    return h ^ (h >> 29);
+}
+
+/*
+ * sched_expected - The size uri's response had last time, or -1 if it
+ * is not remembered.
+ */
+long long sched_expected(const char *uri) {
+    uint64_t h = uri_hash(uri), hint = atomic_load_explicit(&size_hints[h % SIZE_HINTS], memory_order_relaxed);
+
+    if (!hint || hint >> SIZE_BITS != h >> SIZE_BITS)
+        return -1;
+    return hint & ((1ULL << SIZE_BITS) - 1);
+}
+
+/*
+ * sched_learn - Remember that uri's response was bytes long. A hint is
+ * one word, tagged with the top bits of the URI's hash, so it can be
+ * read and replaced without a lock.
+ */
+void sched_learn(const char *uri, size_t bytes) {
+    uint64_t h = uri_hash(uri), max = (1ULL << SIZE_BITS) - 1;
+
+    atomic_store_explicit(&size_hints[h % SIZE_HINTS],
+                          (h >> SIZE_BITS << SIZE_BITS) | (bytes < max ? bytes : max), memory_order_relaxed);
+}
+
+/*
+ * dispatch - Hand free slots to waiters. Each goes to the head of the
+ * most urgent class after aging, skipping bulk while it holds its share.
+ * Caller holds sched_mutex.
+ */
+static void dispatch(void) {
+    uint64_t now = now_us(), age;
+    waiter_t *w;
+    int best, prio, best_prio;
+
+    while (active < slots) {
+        best = -1;
+        best_prio = SCHED_CLASSES;
+        for (int c = 0; c < SCHED_CLASSES; c++) {
+            if (!(w = classes[c].head) || (c == SCHED_BULK && classes[c].active >= bulk_slots))
+                continue;
+            age = (now - w->since) / aging_us;
+            prio = age >= (uint64_t)c ? 0 : c - (int)age;
+            if (prio < best_prio || (prio == best_prio && w->since < classes[best].head->since)) {
+                best = c;
+                best_prio = prio;
+            }
+        }
+        if (best < 0)
+            return;
+        w = classes[best].head;
+        if (!(classes[best].head = w->next))
+            classes[best].tail = NULL;
+        classes[best].queued--;
+        classes[best].active++;
+        active++;
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+/*
+ * sched_acquire - Wait for a slot for a request of class cls.
+ */
+void sched_acquire(int cls) {
+    class_t *c = &classes[cls];
+    waiter_t w;
+    uint64_t waited;
+
+    lockprof_lock(&sched_mutex);
+    c->requests++;
+    if (!slots) {
+        c->active++;
+        lockprof_unlock(&sched_mutex);
+        return;
+    }
+    w.cls = cls;
+    w.since = now_us();
+    w.granted = 0;
+    w.next = NULL;
+    pthread_cond_init(&w.cond, NULL);
+    if (c->tail)
+        c->tail->next = &w;
+    else
+        c->head = &w;
+    c->tail = &w;
+    c->queued++;
+    dispatch();
+    while (!w.granted)
+        lockprof_wait(&w.cond, &sched_mutex);
+    if ((waited = now_us() - w.since) > 50) {
+        c->waited++;
+        c->wait_us += waited;
+        if (waited > c->wait_max_us)
+            c->wait_max_us = waited;
+    }
+    lockprof_unlock(&sched_mutex);
+    pthread_cond_destroy(&w.cond);
+}
+
+/*
+ * sched_release - Give back the slot of a request of class cls.
+ */
+void sched_release(int cls) {
+    lockprof_lock(&sched_mutex);
+    classes[cls].active--;
+    if (slots) {
+        active--;
+        dispatch();
+    }
+    lockprof_unlock(&sched_mutex);
+}
+
+/*
+ * sched_stats - Print slot use and per-class queueing as "name value"
+ * lines.
+ */
+void sched_stats(FILE *out) {
+    class_t *c;
+
+    lockprof_lock(&sched_mutex);
+    fprintf(out, "sched_slots %d\n", slots);
+    fprintf(out, "sched_bulk_slots %d\n", bulk_slots);
+    fprintf(out, "sched_active %d\n", active);
+    for (int i = 0; i < SCHED_CLASSES; i++) {
+        c = &classes[i];
+        fprintf(out, "sched_%s_requests %lu\n", class_names[i], c->requests);
+        fprintf(out, "sched_%s_active %d\n", class_names[i], c->active);
+        fprintf(out, "sched_%s_queued %d\n", class_names[i], c->queued);
+        fprintf(out, "sched_%s_waited %lu\n", class_names[i], c->waited);
+        fprintf(out, "sched_%s_wait_us %llu\n", class_names[i], c->wait_us);
+        fprintf(out, "sched_%s_wait_max_us %lu\n", class_names[i], c->wait_max_us);
+    }
+    lockprof_unlock(&sched_mutex);
+}
@@ -0,0 +1,25 @@
+/*
+ * sched.h - Priority classes for admitting requests to the proxy
+ */
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Priority classes, most urgent first */
+#define SCHED_INTERACTIVE 0     /* Pages and their small assets */
+#define SCHED_NORMAL 1
+#define SCHED_BULK 2            /* Large downloads and uploads */
+#define SCHED_CLASSES 3
+
+void sched_init(int slots, int bulk_share, int aging_ms, long long bulk_bytes,
+                const char *interactive_ext, const char *bulk_ext, const char **bulk_clients, int nclients);
+int sched_classify(const char *method, const char *path, const char *client, long long expected);
+long long sched_expected(const char *uri);
+void sched_learn(const char *uri, size_t bytes);
+void sched_acquire(int cls);
+void sched_release(int cls);
+void sched_stats(FILE *out);
+
+#endif /* __SCHED_H__ */
@@ -0,0 +1,295 @@
+/*
+ * slowlog.c - Stage timelines of requests over a latency threshold
+ *
+ * Averages and quantiles say that the tail is slow, not why. Each
+ * request therefore carries a small timeline: the time it reached each
+ * stage (accept, thread start, headers parsed, blocklist, scheduler slot
+ * granted, DNS, connect, first response byte, relay done, logged),
+ * stamped with one
+ * clock_gettime each. Stages inside upstream.c and preconnect.c are
+ * marked through a thread-local pointer to the current request's
+ * timeline, so nothing in between has to pass it along.
+ *
+ * A request that takes threshold_ms or longer from accept to log gets
+ * one line in the slow log:
+ *
+ *   [time] slow 1234567us tid=... client=... uri status=200 bytes=...
+ *       origin=host:port upstream=ip:port queue_us=... sched_us=... parse=...
+ *       blocklist=... admit=... dns=... connect=... ttfb=... relay=... log=...
+ *       up_rtt=... cl_rtt=...
+ *
+ * A request queues twice: for a thread (queue_us, accept to thread
+ * start) and, once parsed, for a scheduler slot of its priority class
+ * (sched_us, blocklist to admit, nearly all of it spent in
+ * sched_acquire). Stage times are microseconds since accept, "-" for
+ * stages the request never reached (a cache hit has no dns, connect or
+ * ttfb; a tunnel is never admitted). The TCP_INFO
+ * snapshot of the origin socket is taken when the connection is released
+ * (which can be before the client has the whole body) and that of the
+ * client socket when the response has been relayed, each only if the
+ * request is already over the threshold by then, so fast requests never
+ * pay for the getsockopt calls.
+ *
+ * Request threads only copy the record into a bounded queue; a writer
+ * thread formats and writes it. When the queue is full the record is
+ * dropped and counted rather than making a request wait for the disk.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "slowlog.h"
+#include <sys/syscall.h>
+
+#define SLOWLOG_URI 1024
+
+/* A slow request waiting to be written */
+typedef struct {
+    slowlog_t t;
+    time_t when;
+    int status;
+    unsigned long long bytes;
+    char client[INET6_ADDRSTRLEN];
+    char uri[SLOWLOG_URI];
+    char origin[SLOWLOG_URI];
+} record_t;
+
+static const char *stage_names[SLOW_STAGES] = {
+    "accept", "queue", "parse", "blocklist", "admit", "dns", "connect", "ttfb", "relay", "log"
+};
+
+static int slowlog_on = 0;
+static unsigned long threshold_us;
+static FILE *slow_file;
+static __thread slowlog_t *current;     /* The request this thread is serving */
+
+static lockstat_t slowlog_stat = LOCKSTAT_INITIALIZER("slowlog");
+static lockprof_t slowlog_mutex = LOCKPROF_INITIALIZER(&slowlog_stat);
+static pthread_cond_t slowlog_cond = PTHREAD_COND_INITIALIZER;
+static record_t *queue;                 /* Ring of records to write */
+static int queue_max, queue_head, queue_len;
+
+/* Statistics */
+static atomic_ulong logged, dropped, written;
+static atomic_ulong stage_us[SLOW_STAGES];  /* Time slow requests spent reaching each stage */
+
+static unsigned long since(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * format_record - Write r as a slow log line (without the newline) into
+ * buf. Returns the length written.
+ */
+static size_t format_record(char *buf, size_t len, const record_t *r) {
+    const slowlog_t *t = &r->t;
+    char time_str[64];
+    size_t n;
+    int m;
+
+    strftime(time_str, sizeof(time_str), "%a %d %b %Y %H:%M:%S %Z", localtime(&r->when));
+    m = snprintf(buf, len, "[%s] slow %luus tid=%ld client=%s %s status=%d bytes=%llu origin=%s upstream=%s queue_us=%lu",
+                 time_str, since(&t->at[SLOW_ACCEPT], &t->at[SLOW_LOG]), t->tid, r->client, r->uri, r->status,
+                 r->bytes, r->origin[0] ? r->origin : "-", t->upstream[0] ? t->upstream : "-",
+                 since(&t->at[SLOW_ACCEPT], &t->at[SLOW_START]));
+    n = m < 0 ? 0 : (size_t)m < len ? (size_t)m : len - 1;
+    if (t->at[SLOW_ADMIT].tv_sec && t->at[SLOW_BLOCKLIST].tv_sec)
+        m = snprintf(buf + n, len - n, " sched_us=%lu", since(&t->at[SLOW_BLOCKLIST], &t->at[SLOW_ADMIT]));
+    else
+        m = snprintf(buf + n, len - n, " sched_us=-");
+    n += m < 0 ? 0 : (size_t)m < len - n ? (size_t)m : len - n - 1;
+    for (int i = SLOW_PARSE; i < SLOW_STAGES && n < len; i++) {
+        if (t->at[i].tv_sec)
+            m = snprintf(buf + n, len - n, " %s=%lu", stage_names[i], since(&t->at[SLOW_ACCEPT], &t->at[i]));
+        else
+            m = snprintf(buf + n, len - n, " %s=-", stage_names[i]);
+        n += m < 0 ? 0 : (size_t)m < len - n ? (size_t)m : len - n - 1;
+    }
+    if (t->have_up)
+        n += tcpinfo_format(buf + n, len - n, "up", &t->up);
+    if (t->have_client)
+        n += tcpinfo_format(buf + n, len - n, "cl", &t->client);
+    return n;
+}
+
+/*
+ * slowlog_writer - Write queued records to the slow log, flushing
+ * whenever the queue runs empty.
+ */
+static void *slowlog_writer(void *vargp) {
+    char line[MAXLINE];
+    record_t r;
+    size_t n;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        lockprof_lock(&slowlog_mutex);
+        while (queue_len == 0) {
+            fflush(slow_file);
+            lockprof_wait(&slowlog_cond, &slowlog_mutex);
+        }
+        r = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_max;
+        queue_len--;
+        lockprof_unlock(&slowlog_mutex);
+
+        n = format_record(line, sizeof(line) - 1, &r);
+        line[n++] = '\n';
+        fwrite(line, 1, n, slow_file);
+        atomic_fetch_add(&written, 1);
+    }
+    return NULL;
+}
+
+/*
+ * slowlog_init - Log requests taking threshold_ms or longer to filename,
+ * with at most queue_len records waiting for the writer thread. Until
+ * this is called (or with threshold_ms 0) nothing is timed.
+ */
+void slowlog_init(long threshold_ms, const char *filename, int queue_len) {
+    pthread_t tid;
+
+    if (threshold_ms <= 0)
+        return;
+    if ((slow_file = fopen(filename, "a")) == NULL) {
+        fprintf(stderr, "Cannot open slow log %s: %s\n", filename, strerror(errno));
+        return;
+    }
+    threshold_us = threshold_ms * 1000;
+    queue_max = queue_len > 0 ? queue_len : 1;
+    queue = Calloc(queue_max, sizeof(record_t));
+    Pthread_create(&tid, NULL, slowlog_writer, NULL);
+    slowlog_on = 1;
+}
+
+/*
+ * slowlog_accept - Start t's timeline at accept, before its thread runs.
+ */
+void slowlog_accept(slowlog_t *t) {
+    memset(t, 0, sizeof(slowlog_t));
+    if (slowlog_on)
+        clock_gettime(CLOCK_MONOTONIC, &t->at[SLOW_ACCEPT]);
+}
+
+/*
+ * slowlog_begin - Make t the calling thread's current timeline.
+ */
+void slowlog_begin(slowlog_t *t) {
+    if (!slowlog_on)
+        return;
+    current = t;
+    t->tid = (long)syscall(SYS_gettid);
+    clock_gettime(CLOCK_MONOTONIC, &t->at[SLOW_START]);
+}
+
+/*
+ * slowlog_mark - Note that the current request has reached stage. A
+ * stage reached again (a retried connection) keeps the later time.
+ */
+void slowlog_mark(int stage) {
+    if (current)
+        clock_gettime(CLOCK_MONOTONIC, &current->at[stage]);
+}
+
+/*
+ * over_threshold - Returns 1 if the current request t has already
+ * taken threshold_ms or longer.
+ */
+static int over_threshold(const slowlog_t *t) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return since(&t->at[SLOW_ACCEPT], &now) >= threshold_us;
+}
+
+/*
+ * slowlog_upstream - Note the current request's origin socket upfd as it
+ * is released: its peer address, and its TCP_INFO if the request is
+ * already over the threshold.
+ */
+void slowlog_upstream(int upfd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN];
+    slowlog_t *t = current;
+
+    if (!t)
+        return;
+    if (over_threshold(t))
+        t->have_up = tcpinfo_read(upfd, &t->up) == 0;
+    if (getpeername(upfd, (struct sockaddr *)&addr, &len) < 0)
+        return;
+    if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, host, sizeof(host));
+        snprintf(t->upstream, SLOWLOG_ADDR, "[%s]:%d", host, ntohs(((struct sockaddr_in6 *)&addr)->sin6_port));
+    } else if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, host, sizeof(host));
+        snprintf(t->upstream, SLOWLOG_ADDR, "%s:%d", host, ntohs(((struct sockaddr_in *)&addr)->sin_port));
+    }
+}
+
+/*
+ * slowlog_client - If the current request is already over the threshold
+ * once its response has been relayed, save TCP_INFO for the client
+ * socket connfd.
+ */
+void slowlog_client(int connfd) {
+    slowlog_t *t = current;
+
+    if (t && over_threshold(t))
+        t->have_client = tcpinfo_read(connfd, &t->client) == 0;
+}
+
+/*
+ * slowlog_finish - End the current request's timeline once it has been
+ * logged, and queue it for the slow log if it took threshold_ms or more.
+ */
+void slowlog_finish(const char *client, const char *uri, const char *origin, int status,
+                    unsigned long long bytes) {
+    slowlog_t *t = current;
+    record_t *r;
+    int prev = SLOW_ACCEPT;
+
+    if (!t)
+        return;
+    current = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &t->at[SLOW_LOG]);
+    if (since(&t->at[SLOW_ACCEPT], &t->at[SLOW_LOG]) < threshold_us)
+        return;
+
+    for (int i = SLOW_START; i < SLOW_STAGES; i++) {
+        if (t->at[i].tv_sec) {
+            atomic_fetch_add(&stage_us[i], since(&t->at[prev], &t->at[i]));
+            prev = i;
+        }
+    }
+    lockprof_lock(&slowlog_mutex);
+    if (queue_len == queue_max) {
+        lockprof_unlock(&slowlog_mutex);
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    r = &queue[(queue_head + queue_len++) % queue_max];
+    r->t = *t;
+    r->when = time(NULL);
+    r->status = status;
+    r->bytes = bytes;
+    snprintf(r->client, sizeof(r->client), "%s", client);
+    snprintf(r->uri, sizeof(r->uri), "%s", uri);
+    snprintf(r->origin, sizeof(r->origin), "%s", origin);
+    pthread_cond_signal(&slowlog_cond);
+    lockprof_unlock(&slowlog_mutex);
+    atomic_fetch_add(&logged, 1);
+}
+
+/*
+ * slowlog_stats - Print slow log counters as "name value" lines, with
+ * the time slow requests spent getting to each stage from the one
+ * before, in total.
+ */
+void slowlog_stats(FILE *out) {
+    fprintf(out, "slowlog_threshold_ms %lu\n", threshold_us / 1000);
+    fprintf(out, "slowlog_logged %lu\n", atomic_load(&logged));
+    fprintf(out, "slowlog_written %lu\n", atomic_load(&written));
+    fprintf(out, "slowlog_dropped %lu\n", atomic_load(&dropped));
+    for (int i = SLOW_START; i < SLOW_STAGES; i++)
+        fprintf(out, "slowlog_%s_us %lu\n", stage_names[i], atomic_load(&stage_us[i]));
+}
@@ -0,0 +1,45 @@
+/*
+ * slowlog.h - Stage timelines of requests over a latency threshold
+ */
+#ifndef __SLOWLOG_H__
+#define __SLOWLOG_H__
+
+#include <stdio.h>
+#include <time.h>
+#include "tcpinfo.h"
+
+/* Stages of a request, in the order they are reached */
+#define SLOW_ACCEPT 0           /* Connection accepted */
+#define SLOW_START 1            /* Its thread started; the gap is queueing delay */
+#define SLOW_PARSE 2            /* Request line and headers read */
+#define SLOW_BLOCKLIST 3        /* Blocklist checked */
+#define SLOW_ADMIT 4            /* Scheduler slot granted; the gap is queueing too */
+#define SLOW_DNS 5              /* Origin name resolved, for a new connection */
+#define SLOW_CONNECT 6          /* Origin connection ready, pooled or new */
+#define SLOW_TTFB 7             /* First response line from the origin */
+#define SLOW_RELAY 8            /* Response delivered to the client */
+#define SLOW_LOG 9              /* Access log written */
+#define SLOW_STAGES 10
+
+#define SLOWLOG_ADDR 64
+
+/* A request's timeline; stages not reached stay zero */
+typedef struct {
+    struct timespec at[SLOW_STAGES];
+    long tid;                   /* Kernel id of the thread serving it */
+    int have_up, have_client;   /* Snapshots below were taken */
+    tcpinfo_t up, client;
+    char upstream[SLOWLOG_ADDR];    /* Origin (or parent) address, as ip:port */
+} slowlog_t;
+
+void slowlog_init(long threshold_ms, const char *filename, int queue_len);
+void slowlog_accept(slowlog_t *t);
+void slowlog_begin(slowlog_t *t);
+void slowlog_mark(int stage);
+void slowlog_upstream(int upfd);
+void slowlog_client(int connfd);
+void slowlog_finish(const char *client, const char *uri, const char *origin, int status,
+                    unsigned long long bytes);
+void slowlog_stats(FILE *out);
+
+#endif /* __SLOWLOG_H__ */
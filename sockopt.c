@@ -0,0 +1,182 @@
+/*
+ * sockopt.c - Named socket tuning profiles
+ *
+ * The socket_profile setting picks a set of options for the listening
+ * socket, the client connections accepted from it and the connections
+ * the proxy opens upstream:
+ *
+ *   default     nothing beyond SO_REUSEADDR, as the kernel sets it up
+ *   latency     TCP_NODELAY, so small writes such as header lines are
+ *               not held back by Nagle's algorithm; TCP_DEFER_ACCEPT,
+ *               so a connection wakes the proxy only once its request
+ *               has arrived; TCP Fast Open both ways, so a repeat
+ *               connection to an origin carries the request in its SYN
+ *               instead of waiting a round trip; keepalive probes after
+ *               60 idle seconds, so dead peers are noticed
+ *   lowmem      as latency, with send and receive buffers fixed at
+ *               64 KiB instead of autotuned, for many slow connections
+ *
+ * Single socket_* settings override the profile's values. Fast Open
+ * also needs the net.ipv4.tcp_fastopen sysctl to allow it (1 for
+ * clients, 2 for servers); /proxy-stats shows the sysctl and the
+ * kernel's Fast Open counters.
+ */
+#include "csapp.h"
+#include "sockopt.h"
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+static sockopt_profile_t profiles[] = {
+    { "default", 0, 0, 0, 0, 0, 0 },
+    { "latency", 1, 1, 256, 0, 0, 60 },
+    { "lowmem", 1, 1, 256, 65536, 65536, 60 },
+};
+
+static sockopt_profile_t profile;
+static atomic_ulong failures;
+
+/*
+ * sockopt_init - Select the named profile, or the default one if the
+ * name is unknown. The caller may then adjust the returned settings
+ * before the first socket is opened.
+ */
+sockopt_profile_t *sockopt_init(const char *name) {
+    profile = profiles[0];
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+        if (strcasecmp(profiles[i].name, name) == 0)
+            profile = profiles[i];
+    if (strcasecmp(profile.name, name) != 0)
+        fprintf(stderr, "socket_profile: unknown profile %s\n", name);
+    return &profile;
+}
+
+static void set(int fd, int level, int opt, int value) {
+    if (setsockopt(fd, level, opt, &value, sizeof(value)) < 0)
+        atomic_fetch_add(&failures, 1);
+}
+
+/*
+ * set_buffers - Fix fd's buffer sizes if the profile says to. On a
+ * listener they are inherited by accepted connections, and they must be
+ * set before a connection's handshake for the window scale to match.
+ */
+static void set_buffers(int fd) {
+    if (profile.sndbuf)
+        set(fd, SOL_SOCKET, SO_SNDBUF, profile.sndbuf);
+    if (profile.rcvbuf)
+        set(fd, SOL_SOCKET, SO_RCVBUF, profile.rcvbuf);
+}
+
+static void set_connection(int fd) {
+    if (profile.nodelay)
+        set(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (profile.keepalive) {
+        set(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        set(fd, IPPROTO_TCP, TCP_KEEPIDLE, profile.keepalive);
+        set(fd, IPPROTO_TCP, TCP_KEEPINTVL, profile.keepalive / 6 > 0 ? profile.keepalive / 6 : 1);
+        set(fd, IPPROTO_TCP, TCP_KEEPCNT, 6);
+    }
+}
+
+/*
+ * sockopt_listen - Tune the listening socket fd before connections
+ * arrive on it.
+ */
+void sockopt_listen(int fd) {
+    set_buffers(fd);
+    if (profile.defer_accept)
+        set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile.defer_accept);
+    if (profile.fastopen)
+        set(fd, IPPROTO_TCP, TCP_FASTOPEN, profile.fastopen);
+}
+
+/*
+ * sockopt_accepted - Tune a connection accepted from a client.
+ */
+void sockopt_accepted(int fd) {
+    set_connection(fd);
+}
+
+/*
+ * sockopt_connect_addr - Connect to the address sa for an upstream
+ * connection, with the profile's options set first. If fastopen is set
+ * and the profile uses Fast Open, the connect returns at once and the
+ * handshake goes out with the first write. Returns the descriptor, or -1.
+ */
+int sockopt_connect_addr(const struct sockaddr *sa, socklen_t len, int fastopen) {
+    int fd;
+
+    if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    set_buffers(fd);
+    set_connection(fd);
+    if (fastopen && profile.fastopen)
+        set(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+    if (connect(fd, sa, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * netstat_counter - The TcpExt counter name from /proc/net/netstat,
+ * which lists names on one line and their values on the next; -1 if it
+ * is not there.
+ */
+static long netstat_counter(const char *name) {
+    char names[4096], values[4096], *n, *v, *ns, *vs;
+    FILE *f = fopen("/proc/net/netstat", "r");
+    long found = -1;
+
+    if (!f)
+        return -1;
+    while (found < 0 && fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+        n = strtok_r(names, " \n", &ns);
+        v = strtok_r(values, " \n", &vs);
+        while (n && v && found < 0) {
+            if (strcmp(n, name) == 0)
+                found = atol(v);
+            n = strtok_r(NULL, " \n", &ns);
+            v = strtok_r(NULL, " \n", &vs);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/*
+ * sockopt_stats - Print the profile, the Fast Open sysctl and the
+ * kernel's Fast Open counters as "name value" lines.
+ */
+void sockopt_stats(FILE *out) {
+    static const char *counters[] = {
+        "TCPFastOpenActive", "TCPFastOpenActiveFail", "TCPFastOpenPassive",
+        "TCPFastOpenPassiveFail", "TCPFastOpenCookieReqd", NULL
+    };
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int sysctl = -1;
+
+    if (f) {
+        if (fscanf(f, "%d", &sysctl) != 1)
+            sysctl = -1;
+        fclose(f);
+    }
+    fprintf(out, "socket_profile %s\n", profile.name);
+    fprintf(out, "socket_nodelay %d\n", profile.nodelay);
+    fprintf(out, "socket_defer_accept %d\n", profile.defer_accept);
+    fprintf(out, "socket_fastopen %d\n", profile.fastopen);
+    fprintf(out, "socket_sndbuf %d\n", profile.sndbuf);
+    fprintf(out, "socket_rcvbuf %d\n", profile.rcvbuf);
+    fprintf(out, "socket_keepalive %d\n", profile.keepalive);
+    fprintf(out, "socket_option_failures %lu\n", atomic_load(&failures));
+    fprintf(out, "socket_tcp_fastopen_sysctl %d\n", sysctl);
+    for (int i = 0; counters[i]; i++)
+        fprintf(out, "socket_%s %ld\n", counters[i], netstat_counter(counters[i]));
+}
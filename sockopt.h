@@ -0,0 +1,26 @@
+/*
+ * sockopt.h - Named socket tuning profiles
+ */
+#ifndef __SOCKOPT_H__
+#define __SOCKOPT_H__
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* Options applied to the proxy's sockets; 0 leaves the kernel default */
+typedef struct {
+    const char *name;
+    int nodelay;                /* TCP_NODELAY on client and upstream sockets */
+    int defer_accept;           /* Seconds the listener waits for a request (TCP_DEFER_ACCEPT) */
+    int fastopen;               /* TFO: listener queue length, and TCP_FASTOPEN_CONNECT upstream */
+    int sndbuf, rcvbuf;         /* SO_SNDBUF and SO_RCVBUF, fixing the size */
+    int keepalive;              /* Idle seconds before keepalive probes */
+} sockopt_profile_t;
+
+sockopt_profile_t *sockopt_init(const char *profile);
+void sockopt_listen(int fd);
+void sockopt_accepted(int fd);
+int sockopt_connect_addr(const struct sockaddr *sa, socklen_t len, int fastopen);
+void sockopt_stats(FILE *out);
+
+#endif /* __SOCKOPT_H__ */
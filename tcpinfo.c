@@ -0,0 +1,157 @@
+/*
+ * tcpinfo.c - Sampling kernel TCP statistics for finished requests
+ *
+ * When a request finishes, one request in every sample_every has
+ * TCP_INFO read from its upstream and client sockets. The values go in
+ * the log entry and into running totals per upstream endpoint (origin,
+ * peer or parent, as named by its connection pool key) and for clients
+ * overall, so a slow fetch can be told apart as a long or lossy path
+ * (high RTT, retransmits, small window) or a slow origin (a healthy
+ * path that simply waited).
+ *
+ * A sample is one getsockopt per socket, about a microsecond, and the
+ * totals take a short lock, so sampling every request is affordable.
+ * Retransmits count over the connection's whole life, which for a
+ * pooled connection spans earlier requests too.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "tcpinfo.h"
+#include <linux/tcp.h>
+#include <stdatomic.h>
+
+#define MAX_ENDPOINTS 64
+
+/* Running totals for one upstream endpoint, or for clients */
+typedef struct {
+    char name[320];
+    unsigned long samples;
+    unsigned long long rtt_us, rttvar_us, rate;
+    unsigned long rtt_max_us, retrans;
+} endpoint_t;
+
+static int every;
+static atomic_ulong requests, dropped;
+static endpoint_t endpoints[MAX_ENDPOINTS];
+static int endpoint_count;
+static endpoint_t clients;
+static lockstat_t tcpinfo_stat = LOCKSTAT_INITIALIZER("tcpinfo");
+static lockprof_t tcpinfo_mutex = LOCKPROF_INITIALIZER(&tcpinfo_stat);
+
+/*
+ * tcpinfo_init - Sample one request in every sample_every; 0 turns
+ * sampling off.
+ */
+void tcpinfo_init(int sample_every) {
+    every = sample_every > 0 ? sample_every : 0;
+}
+
+/*
+ * tcpinfo_sampled - Returns 1 if the request finishing now should be
+ * sampled.
+ */
+int tcpinfo_sampled(void) {
+    return every && atomic_fetch_add(&requests, 1) % every == 0;
+}
+
+/*
+ * tcpinfo_read - Fill ti from fd's TCP_INFO. Returns 0, or -1 if fd is
+ * not a TCP socket.
+ */
+int tcpinfo_read(int fd, tcpinfo_t *ti) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return -1;
+    ti->rtt_us = info.tcpi_rtt;
+    ti->rttvar_us = info.tcpi_rttvar;
+    ti->retrans = info.tcpi_total_retrans;
+    ti->cwnd = info.tcpi_snd_cwnd;
+    ti->in_flight = info.tcpi_unacked;
+    /* Older kernels return a shorter struct without the rate */
+    ti->rate = len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate)
+        ? info.tcpi_delivery_rate : 0;
+    return 0;
+}
+
+/*
+ * add_sample - Add ti to the totals e. Caller holds tcpinfo_mutex.
+ */
+static void add_sample(endpoint_t *e, const tcpinfo_t *ti) {
+    e->samples++;
+    e->rtt_us += ti->rtt_us;
+    e->rttvar_us += ti->rttvar_us;
+    e->rate += ti->rate;
+    e->retrans += ti->retrans;
+    if (ti->rtt_us > e->rtt_max_us)
+        e->rtt_max_us = ti->rtt_us;
+}
+
+/*
+ * tcpinfo_record - Add a sample of the connection to origin (up) and of
+ * the client connection to the totals. Either may be NULL.
+ */
+void tcpinfo_record(const char *origin, const tcpinfo_t *up, const tcpinfo_t *client) {
+    endpoint_t *e = NULL;
+
+    lockprof_lock(&tcpinfo_mutex);
+    if (up) {
+        for (int i = 0; i < endpoint_count && !e; i++)
+            if (strcmp(endpoints[i].name, origin) == 0)
+                e = &endpoints[i];
+        if (!e && endpoint_count < MAX_ENDPOINTS) {
+            e = &endpoints[endpoint_count++];
+            snprintf(e->name, sizeof(e->name), "%s", origin);
+        }
+        if (e)
+            add_sample(e, up);
+        else
+            atomic_fetch_add(&dropped, 1);
+    }
+    if (client)
+        add_sample(&clients, client);
+    lockprof_unlock(&tcpinfo_mutex);
+}
+
+/*
+ * tcpinfo_format - Write ti as " side_rtt=... side_rate=..." log fields
+ * into buf. Returns the length written.
+ */
+size_t tcpinfo_format(char *buf, size_t len, const char *side, const tcpinfo_t *ti) {
+    int n = snprintf(buf, len, " %s_rtt=%u %s_rttvar=%u %s_retrans=%u %s_cwnd=%u %s_inflight=%u %s_rate=%llu",
+                     side, ti->rtt_us, side, ti->rttvar_us, side, ti->retrans, side, ti->cwnd,
+                     side, ti->in_flight, side, ti->rate);
+    return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/*
+ * print_totals - Print the totals e as "prefix_field[_name] value" lines.
+ */
+static void print_totals(FILE *out, const char *prefix, const endpoint_t *e) {
+    unsigned long n = e->samples ? e->samples : 1;
+    const char *sep = e->name[0] ? "_" : "";
+
+    fprintf(out, "%s_samples%s%s %lu\n", prefix, sep, e->name, e->samples);
+    fprintf(out, "%s_rtt_us%s%s %llu\n", prefix, sep, e->name, e->rtt_us / n);
+    fprintf(out, "%s_rttvar_us%s%s %llu\n", prefix, sep, e->name, e->rttvar_us / n);
+    fprintf(out, "%s_rtt_max_us%s%s %lu\n", prefix, sep, e->name, e->rtt_max_us);
+    fprintf(out, "%s_retrans%s%s %lu\n", prefix, sep, e->name, e->retrans);
+    fprintf(out, "%s_delivery_rate%s%s %llu\n", prefix, sep, e->name, e->rate / n);
+}
+
+/*
+ * tcpinfo_stats - Print mean RTT and delivery rate, worst RTT and total
+ * retransmits per upstream endpoint and for clients, as "name value"
+ * lines.
+ */
+void tcpinfo_stats(FILE *out) {
+    fprintf(out, "tcp_info_sample_every %d\n", every);
+    fprintf(out, "tcp_info_endpoints_dropped %lu\n", atomic_load(&dropped));
+    lockprof_lock(&tcpinfo_mutex);
+    print_totals(out, "tcp_client", &clients);
+    for (int i = 0; i < endpoint_count; i++)
+        print_totals(out, "tcp_upstream", &endpoints[i]);
+    lockprof_unlock(&tcpinfo_mutex);
+}
@@ -0,0 +1,27 @@
+/*
+ * tcpinfo.h - Sampling kernel TCP statistics for finished requests
+ */
+#ifndef __TCPINFO_H__
+#define __TCPINFO_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* What one getsockopt(TCP_INFO) says about a connection so far */
+typedef struct {
+    unsigned rtt_us;                /* Smoothed round-trip time */
+    unsigned rttvar_us;             /* Its mean deviation */
+    unsigned retrans;               /* Segments retransmitted over the connection's life */
+    unsigned cwnd;                  /* Congestion window, in segments */
+    unsigned in_flight;             /* Segments sent and not yet acknowledged */
+    unsigned long long rate;        /* Recent delivery rate, bytes/s */
+} tcpinfo_t;
+
+void tcpinfo_init(int sample_every);
+int tcpinfo_sampled(void);
+int tcpinfo_read(int fd, tcpinfo_t *ti);
+void tcpinfo_record(const char *origin, const tcpinfo_t *up, const tcpinfo_t *client);
+size_t tcpinfo_format(char *buf, size_t len, const char *side, const tcpinfo_t *ti);
+void tcpinfo_stats(FILE *out);
+
+#endif /* __TCPINFO_H__ */
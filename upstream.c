@@ -0,0 +1,639 @@
+/*
+ * upstream.c - Pooled plain and TLS connections to origin servers
+ *
+ * An upstream_t is one connection to an origin, plain TCP for http://
+ * URIs or TLS (OpenSSL) for https:// ones, with a small read buffer so
+ * response headers can be read a line at a time. All reads and writes
+ * go through upstream_recv and upstream_send, which behave like recv and
+ * send (including EAGAIN on non-blocking descriptors) whatever the
+ * transport, so the relay can carry TLS bodies the same way as plain.
+ *
+ * Connections whose response ended cleanly are kept in an idle pool,
+ * keyed by scheme, host and port, and handed to the next request for the
+ * same origin; for TLS origins that skips the handshake entirely. When a
+ * new TLS connection is needed, the session ticket (or ID) last issued by
+ * that origin is offered so the handshake can be resumed instead of
+ * repeated in full.
+ *
+ * Connections can also be made through a parent proxy: plain HTTP goes
+ * to the parent and is pooled per parent, TLS is tunnelled with CONNECT
+ * and pooled per origin and parent.
+ *
+ * The pool can also be topped up ahead of demand with warm connections,
+ * opened (and handshaken) before any request asks for them; see
+ * preconnect.c for which origins get them.
+ */
+#include "csapp.h"
+#include "lockprof.h"
+#include "preconnect.h"
+#include "upstream.h"
+#include <poll.h>
+#include <stdatomic.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_SESSIONS 256        /* Slots in the per-origin session cache */
+
+/* The last resumable session each origin issued, direct-mapped by key */
+typedef struct {
+    char key[UPSTREAM_KEYLEN];
+    SSL_SESSION *session;
+} tls_session_t;
+
+static SSL_CTX *tls_ctx;
+static int tls_verify;
+static tls_session_t sessions[TLS_SESSIONS];
+static lockstat_t session_stat = LOCKSTAT_INITIALIZER("tls_session");
+static lockprof_t session_lock = LOCKPROF_INITIALIZER(&session_stat);
+
+static upstream_t *idle;        /* Idle connections, most recently used first */
+static int idle_per_origin;
+static int idle_timeout;
+static lockstat_t idle_stat = LOCKSTAT_INITIALIZER("upstream_idle");
+static lockprof_t idle_lock = LOCKPROF_INITIALIZER(&idle_stat);
+
+static atomic_ulong connects, pool_hits, tls_pool_hits, pool_stale;
+static atomic_ulong full_handshakes, resumed_handshakes, handshake_failures;
+static atomic_ulong full_handshake_us, resumed_handshake_us;
+static atomic_ulong connect_us, warm_opened, warm_used, warm_wasted, warm_saved_us, warm_idle_secs;
+
+/*
+ * session_slot - Session cache slot for an origin key (FNV-1a).
+ */
+static tls_session_t *session_slot(const char *key) {
+    unsigned h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return &sessions[h % TLS_SESSIONS];
+}
+
+/*
+ * new_session - OpenSSL callback for each session an origin issues
+ * (after the handshake under TLS 1.3). Keeps it for the origin, taking
+ * over the reference, and drops the one it replaces.
+ */
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    upstream_t *u = SSL_get_app_data(ssl);
+    tls_session_t *slot = session_slot(u->key);
+
+    lockprof_lock(&session_lock);
+    if (slot->session)
+        SSL_SESSION_free(slot->session);
+    strcpy(slot->key, u->key);
+    slot->session = session;
+    lockprof_unlock(&session_lock);
+    return 1;
+}
+
+/*
+ * upstream_init - Set the idle pool limits (connections kept per origin,
+ * seconds an idle connection is trusted) and prepare the TLS client
+ * context. Origin certificates are checked against the system trust
+ * store plus ca_file, if given, unless tls_verify is 0.
+ */
+void upstream_init(int max_idle_per_origin, int timeout, int verify, const char *ca_file) {
+    idle_per_origin = max_idle_per_origin;
+    idle_timeout = timeout;
+    tls_verify = verify;
+
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_default_verify_paths(tls_ctx);
+    if (ca_file && !SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL))
+        fprintf(stderr, "upstream: cannot load CA file %s\n", ca_file);
+    SSL_CTX_set_verify(tls_ctx, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+    /* Close-delimited bodies end with a TCP close, not always close_notify */
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    /* The relay retries writes from a ring buffer that moves */
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_ctx, new_session);
+}
+
+/*
+ * elapsed_us - Microseconds since start.
+ */
+static unsigned long elapsed_us(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * tls_handshake - Run the client handshake on u for host, offering the
+ * origin's cached session. Returns 0 on success, -1 on failure.
+ */
+static int tls_handshake(upstream_t *u, const char *host) {
+    tls_session_t *slot = session_slot(u->key);
+    struct timespec start;
+    unsigned long us;
+
+    u->ssl = SSL_new(tls_ctx);
+    SSL_set_app_data(u->ssl, u);
+    SSL_set_fd(u->ssl, u->fd);
+    SSL_set_tlsext_host_name(u->ssl, host);
+    if (tls_verify)
+        SSL_set1_host(u->ssl, host);
+
+    lockprof_lock(&session_lock);
+    if (slot->session && strcmp(slot->key, u->key) == 0)
+        SSL_set_session(u->ssl, slot->session);
+    lockprof_unlock(&session_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ERR_clear_error();
+    if (SSL_connect(u->ssl) != 1) {
+        atomic_fetch_add(&handshake_failures, 1);
+        ERR_clear_error();
+        return -1;
+    }
+    us = elapsed_us(&start);
+    if (SSL_session_reused(u->ssl)) {
+        atomic_fetch_add(&resumed_handshakes, 1);
+        atomic_fetch_add(&resumed_handshake_us, us);
+    } else {
+        atomic_fetch_add(&full_handshakes, 1);
+        atomic_fetch_add(&full_handshake_us, us);
+    }
+    return 0;
+}
+
+/*
+ * upstream_close - Shut down and free a connection.
+ */
+static void upstream_close(upstream_t *u) {
+    if (u->warm) {
+        atomic_fetch_add(&warm_wasted, 1);
+        atomic_fetch_add(&warm_idle_secs, time(NULL) - u->idle_since);
+    }
+    if (u->ssl) {
+        SSL_set_quiet_shutdown(u->ssl, 1);
+        SSL_shutdown(u->ssl);
+        SSL_free(u->ssl);
+    }
+    Close(u->fd);
+    free(u);
+}
+
+/*
+ * idle_usable - Returns 1 if the idle connection u can carry another
+ * request: nothing has arrived on it, or, over TLS, only handshake
+ * messages such as the session tickets a TLS 1.3 origin sends after the
+ * handshake, which are consumed here.
+ */
+static int idle_usable(upstream_t *u) {
+    struct pollfd pfd;
+    int flags, n, ok;
+    char c;
+
+    pfd.fd = u->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == 0)
+        return 1;
+    if (!u->ssl)
+        return 0;
+    flags = fcntl(u->fd, F_GETFL);
+    fcntl(u->fd, F_SETFL, flags | O_NONBLOCK);
+    n = SSL_peek(u->ssl, &c, 1);
+    ok = n <= 0 && SSL_get_error(u->ssl, n) == SSL_ERROR_WANT_READ;
+    fcntl(u->fd, F_SETFL, flags);
+    ERR_clear_error();
+    return ok;
+}
+
+/*
+ * pool_take - Unlink and return the most recently idled connection to
+ * the origin key, discarding any that have timed out or that the origin
+ * has closed (or sent unexpected bytes on) meanwhile. NULL if none.
+ */
+static upstream_t *pool_take(const char *key) {
+    upstream_t **pp, *u;
+
+    for (;;) {
+        lockprof_lock(&idle_lock);
+        for (pp = &idle; *pp && strcmp((*pp)->key, key) != 0; pp = &(*pp)->next)
+            ;
+        if ((u = *pp) != NULL)
+            *pp = u->next;
+        lockprof_unlock(&idle_lock);
+        if (!u)
+            return NULL;
+
+        if (time(NULL) - u->idle_since <= idle_timeout && idle_usable(u)) {
+            u->reused = 1;
+            u->next = NULL;
+            if (u->warm) {
+                u->warm = 0;
+                atomic_fetch_add(&warm_used, 1);
+                atomic_fetch_add(&warm_saved_us, u->setup_us);
+                atomic_fetch_add(&warm_idle_secs, time(NULL) - u->idle_since);
+            }
+            return u;
+        }
+        atomic_fetch_add(&pool_stale, 1);
+        upstream_close(u);
+    }
+}
+
+/*
+ * upstream_connect_via - Open a tunnel to host:port through the proxy at
+ * phost:pport with CONNECT. Returns the connected descriptor, or -1 if
+ * the proxy cannot be reached or refuses.
+ */
+int upstream_connect_via(const char *phost, int pport, const char *host, int port) {
+    char buf[MAXLINE];
+    rio_t rio;
+    int fd, n;
+
+    snprintf(buf, sizeof(buf), "%d", pport);
+    if ((fd = preconnect_connect(phost, buf, 1)) < 0)
+        return -1;
+    n = snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+                 host, port, host, port);
+    if (rio_writen(fd, buf, n) != n)
+        goto fail;
+
+    /* Nothing follows the proxy's reply until we speak, so the Rio
+     * buffer cannot swallow tunnelled bytes */
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0 || strncmp(buf, "HTTP/1.", 7) != 0
+        || strncmp(buf + 8, " 200", 4) != 0)
+        goto fail;
+    while ((n = rio_readlineb(&rio, buf, sizeof(buf))) > 0 && strcmp(buf, "\r\n") != 0)
+        ;
+    if (n <= 0)
+        goto fail;
+    return fd;
+
+fail:
+    Close(fd);
+    return -1;
+}
+
+/*
+ * origin_key - The pool key for host:port through the parent at
+ * phost:pport, or directly if phost is NULL.
+ */
+static void origin_key(char *key, const char *phost, int pport, const char *host, int port, int tls) {
+    if (!phost)
+        snprintf(key, UPSTREAM_KEYLEN, "%s://%s:%d", tls ? "https" : "http", host, port);
+    else if (!tls)
+        snprintf(key, UPSTREAM_KEYLEN, "proxy://%s:%d", phost, pport);
+    else
+        snprintf(key, UPSTREAM_KEYLEN, "https://%s:%d via %s:%d", host, port, phost, pport);
+}
+
+/*
+ * open_new - Open a new connection for key, as upstream_open_via, with
+ * Fast Open if fastopen is set and the socket profile uses it.
+ */
+static upstream_t *open_new(const char *key, const char *phost, int pport, const char *host, int port,
+                            int tls, int fastopen) {
+    char port_str[8];
+    struct timespec start;
+    upstream_t *u;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (phost && tls) {
+        fd = upstream_connect_via(phost, pport, host, port);
+    } else {
+        snprintf(port_str, sizeof(port_str), "%d", phost ? pport : port);
+        fd = preconnect_connect(phost ? phost : host, port_str, fastopen);
+    }
+    if (fd < 0)
+        return NULL;
+    atomic_fetch_add(&connects, 1);
+    u = Malloc(sizeof(upstream_t));
+    u->fd = fd;
+    u->ssl = NULL;
+    strcpy(u->key, key);
+    u->reused = 0;
+    u->warm = 0;
+    u->origin = -1;
+    u->idle_since = time(NULL);
+    u->bufptr = u->buf;
+    u->cnt = 0;
+    u->next = NULL;
+    if (tls && tls_handshake(u, host) < 0) {
+        upstream_close(u);
+        return NULL;
+    }
+    u->setup_us = elapsed_us(&start);
+    atomic_fetch_add(&connect_us, u->setup_us);
+    return u;
+}
+
+/*
+ * upstream_open - Return a connection to host:port, over TLS if tls is
+ * set: an idle pooled one if reuse is set and one is available, or else
+ * a new one. Returns NULL if the origin cannot be reached.
+ */
+upstream_t *upstream_open(const char *host, int port, int tls, int reuse) {
+    return upstream_open_via(NULL, 0, host, port, tls, reuse);
+}
+
+/*
+ * upstream_open_via - Like upstream_open, but through the parent proxy
+ * at phost:pport unless phost is NULL. Plain requests go to the parent
+ * itself, in absolute form, so one pooled connection to it serves every
+ * origin; TLS ones are tunnelled with CONNECT and pooled per origin.
+ */
+upstream_t *upstream_open_via(const char *phost, int pport, const char *host, int port,
+                              int tls, int reuse) {
+    char key[UPSTREAM_KEYLEN];
+    upstream_t *u;
+
+    origin_key(key, phost, pport, host, port, tls);
+    if (reuse && (u = pool_take(key)) != NULL) {
+        atomic_fetch_add(&pool_hits, 1);
+        if (u->ssl)
+            atomic_fetch_add(&tls_pool_hits, 1);
+    } else if ((u = open_new(key, phost, pport, host, port, tls, 1)) == NULL) {
+        return NULL;
+    }
+    if (reuse && !phost)
+        u->origin = preconnect_note(host, port, tls);
+    return u;
+}
+
+/*
+ * upstream_preconnect - Open warm connections to host:port (over TLS if
+ * tls is set) until want of them are idle in the pool, within the pool's
+ * limit per origin. Returns how many were opened.
+ */
+int upstream_preconnect(const char *host, int port, int tls, int want) {
+    char key[UPSTREAM_KEYLEN];
+    upstream_t *p, *u;
+    int have = 0, n = 0;
+
+    origin_key(key, NULL, 0, host, port, tls);
+    if (want > idle_per_origin)
+        want = idle_per_origin;
+    lockprof_lock(&idle_lock);
+    for (p = idle; p; p = p->next)
+        have += strcmp(p->key, key) == 0;
+    lockprof_unlock(&idle_lock);
+    for (; have + n < want; n++) {
+        /* Without Fast Open, so the handshake happens now, not with the
+         * first request */
+        if ((u = open_new(key, NULL, 0, host, port, tls, 0)) == NULL)
+            break;
+        u->warm = 1;
+        atomic_fetch_add(&warm_opened, 1);
+        upstream_release(u, 1);
+    }
+    return n;
+}
+
+/*
+ * upstream_release - Done with u. A connection whose last response was
+ * read completely, with nothing left over, may go back to the idle pool
+ * if reusable is set and its origin has room; otherwise it is closed.
+ */
+void upstream_release(upstream_t *u, int reusable) {
+    upstream_t *p;
+    int same = 0;
+
+    preconnect_done(u->origin);
+    u->origin = -1;
+    if (reusable && u->cnt == 0 && !upstream_pending(u)) {
+        lockprof_lock(&idle_lock);
+        for (p = idle; p; p = p->next)
+            same += strcmp(p->key, u->key) == 0;
+        if (same < idle_per_origin) {
+            u->idle_since = time(NULL);
+            u->bufptr = u->buf;
+            u->next = idle;
+            idle = u;
+            u = NULL;
+        }
+        lockprof_unlock(&idle_lock);
+    }
+    if (u)
+        upstream_close(u);
+}
+
+/*
+ * upstream_drain_idle - Close every idle pooled connection, e.g. to give
+ * memory back under pressure. Returns how many were closed.
+ */
+int upstream_drain_idle(void) {
+    upstream_t *list, *u;
+    int n = 0;
+
+    lockprof_lock(&idle_lock);
+    list = idle;
+    idle = NULL;
+    lockprof_unlock(&idle_lock);
+    while ((u = list) != NULL) {
+        list = u->next;
+        upstream_close(u);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * upstream_reap_idle - Close the idle connections that have timed out or
+ * that their origin has closed, so the pool holds only usable ones.
+ */
+void upstream_reap_idle(void) {
+    upstream_t **pp, *u, *dead = NULL;
+    time_t now = time(NULL);
+
+    lockprof_lock(&idle_lock);
+    for (pp = &idle; (u = *pp) != NULL;) {
+        if (now - u->idle_since > idle_timeout || !idle_usable(u)) {
+            *pp = u->next;
+            u->next = dead;
+            dead = u;
+        } else {
+            pp = &u->next;
+        }
+    }
+    lockprof_unlock(&idle_lock);
+    while ((u = dead) != NULL) {
+        dead = u->next;
+        atomic_fetch_add(&pool_stale, 1);
+        upstream_close(u);
+    }
+}
+
+/*
+ * tls_result - Map the return of SSL_read or SSL_write onto recv/send
+ * conventions: bytes moved, 0 at end of stream, or -1 with errno set
+ * (EAGAIN if the operation has to wait for the socket).
+ */
+static ssize_t tls_result(upstream_t *u, int n) {
+    if (n > 0)
+        return n;
+    switch (SSL_get_error(u->ssl, n)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    default:
+        ERR_clear_error();
+        if (n == 0 || errno == 0)
+            errno = EIO;
+        return -1;
+    }
+}
+
+/*
+ * upstream_recv - Read up to len bytes: buffered ones first, then one
+ * read from the connection. Returns bytes read, 0 at EOF, or -1.
+ */
+ssize_t upstream_recv(upstream_t *u, char *buf, size_t len) {
+    if (u->cnt > 0) {
+        if (len > u->cnt)
+            len = u->cnt;
+        memcpy(buf, u->bufptr, len);
+        u->bufptr += len;
+        u->cnt -= len;
+        return len;
+    }
+    if (!u->ssl)
+        return recv(u->fd, buf, len, 0);
+    ERR_clear_error();
+    return tls_result(u, SSL_read(u->ssl, buf, len > INT_MAX ? INT_MAX : len));
+}
+
+/*
+ * upstream_send - Write up to len bytes in one attempt. Returns bytes
+ * written or -1.
+ */
+ssize_t upstream_send(upstream_t *u, const char *buf, size_t len) {
+    if (!u->ssl)
+        return send(u->fd, buf, len, MSG_NOSIGNAL);
+    ERR_clear_error();
+    return tls_result(u, SSL_write(u->ssl, buf, len > INT_MAX ? INT_MAX : len));
+}
+
+/*
+ * upstream_write - Write all len bytes to a blocking connection.
+ * Returns len, or -1 on error.
+ */
+ssize_t upstream_write(upstream_t *u, const char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = upstream_send(u, buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return len;
+}
+
+/*
+ * upstream_writev - Write every byte of iov to a blocking connection, in
+ * one writev where possible for plain connections. Returns the bytes
+ * written, or -1 on error. iov is modified.
+ */
+ssize_t upstream_writev(upstream_t *u, struct iovec *iov, int cnt) {
+    size_t total = 0;
+    ssize_t n;
+    int i = 0;
+
+    if (u->ssl) {
+        for (; i < cnt; i++) {
+            if (upstream_write(u, iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+    while (i < cnt) {
+        if ((n = writev(u->fd, iov + i, cnt - i)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (total += n; i < cnt && (size_t)n >= iov[i].iov_len; i++)
+            n -= iov[i].iov_len;
+        if (i < cnt) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    return total;
+}
+
+/*
+ * upstream_readline - Read a text line (up to maxlen-1 bytes) into buf
+ * and null-terminate it, like rio_readlineb. Returns its length, 0 at
+ * EOF with nothing read, or -1 on error.
+ */
+ssize_t upstream_readline(upstream_t *u, char *buf, size_t maxlen) {
+    size_t n = 0;
+    ssize_t rc;
+
+    while (n + 1 < maxlen) {
+        if (u->cnt == 0) {
+            if ((rc = upstream_recv(u, u->buf, sizeof(u->buf))) < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0) {
+                if (rc < 0)
+                    return -1;
+                break;
+            }
+            u->bufptr = u->buf;
+            u->cnt = rc;
+        }
+        buf[n] = *u->bufptr++;
+        u->cnt--;
+        if (buf[n++] == '\n')
+            break;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ * upstream_pending - Returns 1 if bytes can be read from u without
+ * waiting for the socket: buffered here, or already decrypted by TLS.
+ */
+int upstream_pending(upstream_t *u) {
+    return u->cnt > 0 || (u->ssl && SSL_pending(u->ssl) > 0);
+}
+
+/*
+ * upstream_stats - Write the connection counters, one per line.
+ */
+void upstream_stats(FILE *out) {
+    int pooled = 0, warm = 0;
+
+    lockprof_lock(&idle_lock);
+    for (upstream_t *p = idle; p; p = p->next) {
+        pooled++;
+        warm += p->warm;
+    }
+    lockprof_unlock(&idle_lock);
+    fprintf(out, "upstream_connects %lu\n", atomic_load(&connects));
+    fprintf(out, "upstream_connect_us %lu\n", atomic_load(&connect_us));
+    fprintf(out, "upstream_pool_hits %lu\n", atomic_load(&pool_hits));
+    fprintf(out, "upstream_pool_stale %lu\n", atomic_load(&pool_stale));
+    fprintf(out, "upstream_pool_idle %d\n", pooled);
+    fprintf(out, "upstream_warm_opened %lu\n", atomic_load(&warm_opened));
+    fprintf(out, "upstream_warm_used %lu\n", atomic_load(&warm_used));
+    fprintf(out, "upstream_warm_wasted %lu\n", atomic_load(&warm_wasted));
+    fprintf(out, "upstream_warm_connect_us_saved %lu\n", atomic_load(&warm_saved_us));
+    fprintf(out, "upstream_warm_idle %d\n", warm);
+    fprintf(out, "upstream_warm_idle_bytes %zu\n", warm * sizeof(upstream_t));
+    fprintf(out, "upstream_warm_idle_secs %lu\n", atomic_load(&warm_idle_secs));
+    fprintf(out, "tls_full_handshakes %lu\n", atomic_load(&full_handshakes));
+    fprintf(out, "tls_resumed_handshakes %lu\n", atomic_load(&resumed_handshakes));
+    fprintf(out, "tls_handshakes_avoided %lu\n", atomic_load(&tls_pool_hits));
+    fprintf(out, "tls_handshake_failures %lu\n", atomic_load(&handshake_failures));
+    fprintf(out, "tls_full_handshake_us %lu\n", atomic_load(&full_handshake_us));
+    fprintf(out, "tls_resumed_handshake_us %lu\n", atomic_load(&resumed_handshake_us));
+}
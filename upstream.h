@@ -0,0 +1,52 @@
+/*
+ * upstream.h - Pooled plain and TLS connections to origin servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define UPSTREAM_KEYLEN 600     /* "https://" host ":" port [" via " host ":" port] */
+#define UPSTREAM_BUFSIZE 8192
+
+struct ssl_st;
+
+/* A connection to an origin. Bytes read ahead of a header line wait in
+ * buf, as in a Rio buffer, and are returned first by upstream_recv. */
+typedef struct upstream {
+    int fd;
+    struct ssl_st *ssl;             /* TLS session, or NULL for plain HTTP */
+    char key[UPSTREAM_KEYLEN];      /* Origin (and parent): scheme, host and port */
+    int reused;                     /* Taken from the idle pool */
+    int warm;                       /* Opened ahead of demand and not yet used */
+    int origin;                     /* Hot origin slot (see preconnect.c), or -1 */
+    unsigned long setup_us;         /* Time taken to connect and handshake */
+    char *bufptr;                   /* Next unread byte in buf */
+    size_t cnt;                     /* Unread bytes in buf */
+    char buf[UPSTREAM_BUFSIZE];
+    time_t idle_since;              /* When it was returned to the pool */
+    struct upstream *next;          /* Next idle connection */
+} upstream_t;
+
+void upstream_init(int max_idle_per_origin, int idle_timeout, int tls_verify, const char *ca_file);
+upstream_t *upstream_open(const char *host, int port, int tls, int reuse);
+upstream_t *upstream_open_via(const char *phost, int pport, const char *host, int port,
+                              int tls, int reuse);
+int upstream_connect_via(const char *phost, int pport, const char *host, int port);
+void upstream_release(upstream_t *u, int reusable);
+int upstream_drain_idle(void);
+int upstream_preconnect(const char *host, int port, int tls, int want);
+void upstream_reap_idle(void);
+ssize_t upstream_readline(upstream_t *u, char *buf, size_t maxlen);
+ssize_t upstream_recv(upstream_t *u, char *buf, size_t len);
+ssize_t upstream_send(upstream_t *u, const char *buf, size_t len);
+ssize_t upstream_write(upstream_t *u, const char *buf, size_t len);
+ssize_t upstream_writev(upstream_t *u, struct iovec *iov, int cnt);
+int upstream_pending(upstream_t *u);
+void upstream_stats(FILE *out);
+
+#endif /* __UPSTREAM_H__ */
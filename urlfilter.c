@@ -0,0 +1,399 @@
+/*
+ * urlfilter.c - Blocklist rules compiled into one Aho-Corasick automaton
+ *
+ * Each line of the blocklist file is a rule matched against request
+ * URIs, ignoring case:
+ *
+ *     tiktok.com          anywhere in the URI
+ *     ^http://ads.        at the start of the URI
+ *     .exe$               at the end of the path (before any ? or #)
+ *     ^http://x.com/$     the whole URI, up to the query
+ *     # comment
+ *
+ * All rules are compiled at startup into a single Aho-Corasick automaton,
+ * so a URI is checked in one pass over its bytes whatever the number of
+ * rules, instead of one strstr per rule. The ^ and $ anchors are two
+ * extra symbols: ^ is fed before the first byte of the URI, and $ is
+ * tried (without being consumed) where the path ends.
+ *
+ * The automaton's transitions are stored as a double array: state s
+ * goes on symbol c to t = base[s] + c if check[t] == s, and otherwise
+ * follows its failure link. Bytes are first mapped to symbols, one per
+ * (lowercased) byte that appears in some rule and one for all others,
+ * which keeps the arrays dense. Each state also records the first rule
+ * that ends at it or at a state down its failure chain, so a match is
+ * seen the moment it completes.
+ */
+#include "csapp.h"
+#include "urlfilter.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SYM_OTHER 0             /* Bytes in no rule */
+
+/* The trie the rules are first inserted into */
+typedef struct {
+    int child, sibling;         /* First child, next sibling, or -1 */
+    int sym;                    /* Symbol on the edge from the parent */
+    int rule;                   /* Rule ending here, or -1 */
+} node_t;
+
+static uint16_t sym_of[256];  /* Byte to symbol, upper case folded to lower */
+static int nsyms, sym_start, sym_end;
+
+static int32_t *base, *check, *fail, *out;
+static size_t slots;            /* Size of the double array */
+static int nstates;
+
+static char **rules;
+static int nrules;
+
+static atomic_ulong checked, blocked;
+
+/*
+ * While compiling, the free slots of the double array are kept on a
+ * circular doubly linked list, so place() only ever looks at free slots.
+ */
+static int32_t *next_free, *prev_free;
+static int32_t free_head = -1;
+static int head_misses;         /* Times place() failed on free_head */
+
+/*
+ * unfree - Take slot t off the free list.
+ */
+static void unfree(int32_t t) {
+    if (next_free[t] == t) {
+        free_head = -1;
+    } else {
+        next_free[prev_free[t]] = next_free[t];
+        prev_free[next_free[t]] = prev_free[t];
+        if (free_head == t) {
+            free_head = next_free[t];
+            head_misses = 0;
+        }
+    }
+}
+
+/*
+ * grow - Make the double array at least n slots long, new slots free.
+ */
+static void grow(size_t n) {
+    size_t old = slots;
+
+    if (n <= slots)
+        return;
+    slots = slots ? slots : 1024;
+    while (slots < n)
+        slots *= 2;
+    base = Realloc(base, slots * sizeof(int32_t));
+    check = Realloc(check, slots * sizeof(int32_t));
+    fail = Realloc(fail, slots * sizeof(int32_t));
+    out = Realloc(out, slots * sizeof(int32_t));
+    next_free = Realloc(next_free, slots * sizeof(int32_t));
+    prev_free = Realloc(prev_free, slots * sizeof(int32_t));
+    for (size_t i = old; i < slots; i++) {
+        base[i] = 0;
+        check[i] = -1;
+        fail[i] = 0;
+        out[i] = -1;
+        next_free[i] = i + 1;
+        prev_free[i] = i - 1;
+    }
+
+    /* Splice the new slots onto the end of the free list */
+    if (free_head < 0) {
+        free_head = old;
+        prev_free[old] = slots - 1;
+        next_free[slots - 1] = old;
+    } else {
+        int32_t last = prev_free[free_head];
+        next_free[last] = old;
+        prev_free[old] = last;
+        next_free[slots - 1] = free_head;
+        prev_free[free_head] = slots - 1;
+    }
+}
+
+/*
+ * go - The state s moves to on symbol c, or -1 if it has no such edge.
+ */
+static inline int go(int s, int c) {
+    size_t t = (size_t)base[s] + c;
+
+    return t < slots && check[t] == s ? (int)t : -1;
+}
+
+/*
+ * body - The part of rule text between its anchors: *anchored is set if
+ * it starts with ^, *ended if it ends with $. Returns the body's length.
+ */
+static size_t body(const char *text, int *anchored, int *ended) {
+    size_t len = strlen(text);
+
+    *anchored = text[0] == '^';
+    *ended = len > (size_t)*anchored && text[len - 1] == '$';
+    return len - *anchored - *ended;
+}
+
+/*
+ * trie_insert - Add the symbols of a rule to the trie, marking its end.
+ */
+static void trie_insert(node_t **trie, int *ntrie, int *cap, const int *syms, int n, int rule) {
+    int u = 0, v;
+
+    for (int i = 0; i < n; i++) {
+        for (v = (*trie)[u].child; v >= 0 && (*trie)[v].sym != syms[i]; v = (*trie)[v].sibling)
+            ;
+        if (v < 0) {
+            if (*ntrie == *cap) {
+                *cap *= 2;
+                *trie = Realloc(*trie, *cap * sizeof(node_t));
+            }
+            v = (*ntrie)++;
+            (*trie)[v].child = -1;
+            (*trie)[v].sibling = (*trie)[u].child;
+            (*trie)[v].sym = syms[i];
+            (*trie)[v].rule = -1;
+            (*trie)[u].child = v;
+        }
+        u = v;
+    }
+    if ((*trie)[u].rule < 0)
+        (*trie)[u].rule = rule;
+}
+
+/*
+ * place - Find a base under which every symbol in syms (n of them,
+ * ascending) lands on a free slot. Candidates are tried by putting
+ * syms[0] on each free slot in turn; a slot at the head of the list that
+ * keeps failing is dropped from it, so that the crowded low end of the
+ * array is not rescanned for every state.
+ */
+static int32_t place(const int *syms, int n) {
+    int32_t f = free_head, b;
+    int i;
+
+    while (f >= 0) {
+        b = f - syms[0];
+        if (b >= 0) {
+            grow(b + syms[n - 1] + 1);
+            for (i = 1; i < n && check[b + syms[i]] < 0; i++)
+                ;
+            if (i == n)
+                return b;
+        }
+        if (f == free_head && ++head_misses > 64) {
+            unfree(f);
+            f = free_head;
+            continue;
+        }
+        f = next_free[f];
+        if (f == free_head)
+            break;
+    }
+
+    /* No fit among the free slots: start past the end of the array */
+    b = slots;
+    grow(b + syms[n - 1] + 1);
+    return b;
+}
+
+static int by_sym(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * compile - Lay the trie out as a double array, in breadth-first order,
+ * and link each state to its failure state and first output.
+ */
+static void compile(node_t *trie, int ntrie) {
+    int *queue = Malloc(ntrie * sizeof(int)), *state = Malloc(ntrie * sizeof(int));
+    int *syms = Malloc((nsyms + 2) * sizeof(int));
+    int head = 0, tail = 0, u, v, n, s, t, f;
+    int32_t b;
+
+    grow(nsyms + 2);
+    state[0] = 0;
+    check[0] = 0;
+    unfree(0);
+    queue[tail++] = 0;
+    while (head < tail) {
+        u = queue[head++];
+        s = state[u];
+        out[s] = trie[u].rule;
+        n = 0;
+        for (v = trie[u].child; v >= 0; v = trie[v].sibling)
+            syms[n++] = trie[v].sym;
+        if (n == 0)
+            continue;
+        qsort(syms, n, sizeof(int), by_sym);
+        b = place(syms, n); /* May move base */
+        base[s] = b;
+        for (v = trie[u].child; v >= 0; v = trie[v].sibling) {
+            state[v] = base[s] + trie[v].sym;
+            check[state[v]] = s;
+            unfree(state[v]);
+            queue[tail++] = v;
+        }
+    }
+    nstates = ntrie;
+
+    /* Drop the unused tail left by doubling */
+    for (n = 0, t = 0; t < tail; t++)
+        n = state[queue[t]] > n ? state[queue[t]] : n;
+    slots = n + 1;
+    base = Realloc(base, slots * sizeof(int32_t));
+    check = Realloc(check, slots * sizeof(int32_t));
+    fail = Realloc(fail, slots * sizeof(int32_t));
+    out = Realloc(out, slots * sizeof(int32_t));
+
+    /* Failure links, parents before children */
+    for (head = 0; head < tail; head++) {
+        u = queue[head];
+        s = state[u];
+        for (v = trie[u].child; v >= 0; v = trie[v].sibling) {
+            t = state[v];
+            if (s == 0) {
+                fail[t] = 0;
+            } else {
+                for (f = fail[s]; f != 0 && go(f, trie[v].sym) < 0; f = fail[f])
+                    ;
+                fail[t] = go(f, trie[v].sym) >= 0 ? go(f, trie[v].sym) : 0;
+            }
+            if (out[t] < 0)
+                out[t] = out[fail[t]];
+        }
+    }
+    free(queue);
+    free(state);
+    free(syms);
+    free(next_free);
+    free(prev_free);
+    next_free = prev_free = NULL;
+}
+
+/*
+ * urlfilter_load - Compile the rules in filename, one per line. Returns
+ * the number of rules, or -1 if the file cannot be read.
+ */
+int urlfilter_load(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    char line[MAXLINE];
+    int anchored, ended, ntrie = 1, cap = 1024, textcap = 0, n, *syms;
+    size_t len;
+    node_t *trie;
+
+    if (!f)
+        return -1;
+
+    /* Collect the rules, lowercased, and give each byte they use a symbol */
+    memset(sym_of, SYM_OTHER, sizeof(sym_of));
+    nsyms = 1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || !(len = body(line, &anchored, &ended)))
+            continue;
+        for (size_t i = 0; line[i]; i++)
+            line[i] = tolower((unsigned char)line[i]);
+        for (size_t i = anchored; i < anchored + len; i++) {
+            unsigned char c = line[i];
+            if (!sym_of[c]) {
+                sym_of[c] = nsyms++;
+                sym_of[toupper(c)] = sym_of[c];
+            }
+        }
+        if (nrules == textcap) {
+            textcap = textcap ? textcap * 2 : 64;
+            rules = Realloc(rules, textcap * sizeof(char *));
+        }
+        rules[nrules++] = strdup(line);
+    }
+    fclose(f);
+    sym_start = nsyms++;
+    sym_end = nsyms++;
+
+    /* Build the trie, then the automaton */
+    trie = Malloc(cap * sizeof(node_t));
+    trie[0].child = trie[0].sibling = -1;
+    trie[0].sym = 0;
+    trie[0].rule = -1;
+    syms = Malloc((MAXLINE + 2) * sizeof(int));
+    for (int r = 0; r < nrules; r++) {
+        len = body(rules[r], &anchored, &ended);
+        n = 0;
+        if (anchored)
+            syms[n++] = sym_start;
+        for (size_t i = anchored; i < anchored + len; i++)
+            syms[n++] = sym_of[(unsigned char)rules[r][i]];
+        if (ended)
+            syms[n++] = sym_end;
+        trie_insert(&trie, &ntrie, &cap, syms, n, r);
+    }
+    free(syms);
+    compile(trie, ntrie);
+    free(trie);
+    return nrules;
+}
+
+/*
+ * step - The state s moves to on symbol c, following failure links.
+ */
+static inline int step(int s, int c) {
+    int t;
+
+    if (c == SYM_OTHER)
+        return 0;
+    while ((t = go(s, c)) < 0 && s != 0)
+        s = fail[s];
+    return t < 0 ? 0 : t;
+}
+
+/*
+ * urlfilter_match - The index of a rule that uri matches, or -1.
+ */
+int urlfilter_match(const char *uri) {
+    const unsigned char *p = (const unsigned char *)uri;
+    int s, end, in_path = 1;
+
+    atomic_fetch_add_explicit(&checked, 1, memory_order_relaxed);
+    if (!nrules)
+        return -1;
+    s = step(0, sym_start);
+    for (;; p++) {
+        if (in_path && (*p == '?' || *p == '#' || *p == '\0')) {
+            in_path = 0;
+            end = step(s, sym_end);
+            if (out[end] >= 0) {
+                s = end;
+                break;
+            }
+        }
+        if (*p == '\0')
+            return -1;
+        s = step(s, sym_of[*p]);
+        if (out[s] >= 0)
+            break;
+    }
+    atomic_fetch_add_explicit(&blocked, 1, memory_order_relaxed);
+    return out[s];
+}
+
+/*
+ * urlfilter_rule - The text of rule i, with its anchors.
+ */
+const char *urlfilter_rule(int i) {
+    return i >= 0 && i < nrules ? rules[i] : "";
+}
+
+/*
+ * urlfilter_stats - Print the automaton's size and match counters as
+ * "name value" lines.
+ */
+void urlfilter_stats(FILE *out_file) {
+    fprintf(out_file, "urlfilter_rules %d\n", nrules);
+    fprintf(out_file, "urlfilter_symbols %d\n", nsyms);
+    fprintf(out_file, "urlfilter_states %d\n", nstates);
+    fprintf(out_file, "urlfilter_bytes %zu\n", slots * 4 * sizeof(int32_t));
+    fprintf(out_file, "urlfilter_checked %lu\n", atomic_load(&checked));
+    fprintf(out_file, "urlfilter_blocked %lu\n", atomic_load(&blocked));
+}
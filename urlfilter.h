@@ -0,0 +1,14 @@
+/*
+ * urlfilter.h - Blocklist rules compiled into one Aho-Corasick automaton
+ */
+#ifndef __URLFILTER_H__
+#define __URLFILTER_H__
+
+#include <stdio.h>
+
+int urlfilter_load(const char *filename);
+int urlfilter_match(const char *uri);
+const char *urlfilter_rule(int rule);
+void urlfilter_stats(FILE *out);
+
+#endif /* __URLFILTER_H__ */